@@ -0,0 +1,128 @@
+/*
+ groups.c
+
+ Date Created: Sat Oct 24 11:02:37 2026
+
+ Hashing for receiver groups, the group= receiver option.
+
+ The receivers of a source context with the same group= option form
+ a group, among which the datagrams are split rather than copied:
+ each one goes to a single member, chosen by a hash of the
+ exporter's address, so all datagrams of an exporter end up at the
+ same member.  With the hash=flow option, NetFlow v5/v9 and IPFIX
+ datagrams are taken apart instead, and each flow record goes to the
+ member chosen by a hash of its flow key, its addresses, ports and
+ protocol (see record_sampler_assign() in records.c).  Datagrams that
+ cannot be taken apart fall back to the exporter hash.
+
+ Members are chosen by rendezvous (highest random weight) hashing:
+ each member has a key derived from its address and port, and a
+ datagram or record goes to the member whose key, combined with the
+ datagram's or record's hash, gives the highest weight.  So the
+ choice depends neither on the order of the members nor on the other
+ members of the group; when a member is added or removed, only the
+ traffic that it gains or loses moves.  The same goes for members that
+ are down (see health.c): they are passed over, so that just their
+ share is spread over the others, and returns to them once they are
+ up again.  If all members are down, they are chosen as if they were
+ up.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdint.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+# ifndef HAVE_MEMCPY
+#  define memcpy(d, s, n) bcopy ((s), (d), (n))
+# endif
+#endif
+
+#include "samplicator.h"
+#include "hashing.h"
+#include "groups.h"
+
+/*
+ receiver_group_member_key(receiver)
+
+ Return the rendezvous key of RECEIVER, from its address and port.
+ */
+uint64_t
+receiver_group_member_key (receiver)
+     const struct receiver *receiver;
+{
+  const struct sockaddr *sa = (const struct sockaddr *) &receiver->addr;
+  unsigned char addr[16];
+  uint16_t port = hash_address_bytes (sa, addr);
+
+  return hash_fnv1a (hash_fnv1a (FNV_OFFSET_BASIS, addr, 16),
+		     (const unsigned char *) &port, sizeof port);
+}
+
+/*
+ receiver_group_exporter_key(sa)
+
+ Return the hash by which the datagrams of the exporter with address
+ SA are assigned to a member.  The exporter's port is ignored.
+ */
+uint64_t
+receiver_group_exporter_key (sa)
+     const struct sockaddr *sa;
+{
+  unsigned char addr[16];
+
+  hash_address_bytes (sa, addr);
+  return hash_fnv1a (FNV_OFFSET_BASIS, addr, 16);
+}
+
+/*
+ receiver_up_p(receiver, now)
+
+ Return non-zero unless RECEIVER is considered down at time NOW.
+ */
+int
+receiver_up_p (receiver, now)
+     const struct receiver *receiver;
+     int64_t now;
+{
+  return receiver->health == 0
+    || now >= __atomic_load_n (&receiver->health->down_until,
+			       __ATOMIC_RELAXED);
+}
+
+/*
+ receiver_group_choose(group, key, now)
+
+ Return the index of the member of GROUP that gets the datagram or
+ record with hash KEY at time NOW.
+ */
+unsigned
+receiver_group_choose (group, key, now)
+     const struct receiver_group *group;
+     uint64_t key;
+     int64_t now;
+{
+  uint64_t best = 0;
+  unsigned k, choice = 0;
+  int best_up = 0;
+
+  for (k = 0; k < group->nmembers; ++k)
+    {
+      uint64_t weight = hash_mix64 (key ^ group->members[k]->group_key);
+      int up = receiver_up_p (group->members[k], now);
+
+      if (k == 0 || up > best_up || (up == best_up && weight > best))
+	{
+	  best = weight;
+	  best_up = up;
+	  choice = k;
+	}
+    }
+  return choice;
+}
@@ -0,0 +1,11 @@
+/*
+ groups.h
+
+ Date Created: Sat Oct 24 11:02:37 2026
+ */
+
+extern uint64_t receiver_group_member_key (const struct receiver *);
+extern uint64_t receiver_group_exporter_key (const struct sockaddr *);
+extern int receiver_up_p (const struct receiver *, int64_t);
+extern unsigned receiver_group_choose (const struct receiver_group *,
+				       uint64_t, int64_t);
@@ -0,0 +1,288 @@
+/*
+ grouptest.c
+
+ Date Created: Tue Oct 27 14:21:40 2026
+
+ Regression tests for choosing the members of receiver groups
+ (groups.c), by exporter and, with hash=flow, by flow record
+ (record_sampler_assign() in records.c).
+
+ Like parsetest, this program outputs a series of numbered "ok" or
+ "fail" lines.  Set a breakpoint at test_fail() to find out what went
+ wrong.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+#endif
+
+#include "samplicator.h"
+#include "sampling.h"
+#include "groups.h"
+#include "templates.h"
+#include "records.h"
+
+#define NMEMBERS 4
+#define NKEYS 4000
+#define NFLOWS 12
+
+static void init_members (void);
+static void choose_all (struct receiver **, unsigned, int64_t);
+static void test_choose (void);
+static void test_flow (void);
+static unsigned choose_member (const void *, uint64_t);
+static int check_int_equal (long, long);
+static int test_ok (void);
+static int test_fail (void);
+static int test_index = 1;
+
+static struct receiver members[NMEMBERS];
+static struct receiver_health health[NMEMBERS];
+static struct receiver *member_list[NMEMBERS];
+static struct receiver_group group;
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 1)
+    {
+      fprintf (stderr, "Usage: %s\n", argv[0]);
+      exit (1);
+    }
+  init_members ();
+  test_choose ();
+  test_flow ();
+  return 0;
+}
+
+/* A group of NMEMBERS receivers, 192.0.2.1 to 192.0.2.4, port 2055,
+   all of them up. */
+static void
+init_members ()
+{
+  unsigned k;
+
+  for (k = 0; k < NMEMBERS; ++k)
+    {
+      struct sockaddr_in *sin = (struct sockaddr_in *) &members[k].addr;
+
+      sin->sin_family = AF_INET;
+      sin->sin_addr.s_addr = htonl (0xc0000201 + k);
+      sin->sin_port = htons (2055);
+      members[k].addrlen = sizeof *sin;
+      members[k].group_key = receiver_group_member_key (&members[k]);
+      members[k].health = &health[k];
+      member_list[k] = &members[k];
+    }
+  group.name = "test";
+  group.members = member_list;
+  group.nmembers = NMEMBERS;
+}
+
+/* Store in CHOSEN the member that each of NKEYS keys goes to at time
+   NOW, when only the first NMEMBERS members of the group are left. */
+static void
+choose_all (chosen, nmembers, now)
+     struct receiver **chosen;
+     unsigned nmembers;
+     int64_t now;
+{
+  struct receiver_group g = group;
+  uint64_t key;
+
+  g.nmembers = nmembers;
+  for (key = 0; key < NKEYS; ++key)
+    {
+      uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+
+      chosen[key] = g.members[receiver_group_choose (&g, hash, now)];
+    }
+}
+
+/* The same key goes to the same member, whatever the order of the
+   members.  Removing a member, or marking it down, moves just the
+   keys that it had, and they are spread over the others. */
+static void
+test_choose ()
+{
+  static struct receiver *before[NKEYS], *after[NKEYS];
+  unsigned moved, wrong, k;
+  unsigned share[NMEMBERS];
+
+  choose_all (before, NMEMBERS, 0);
+  choose_all (after, NMEMBERS, 0);
+  check_int_equal (memcmp (before, after, sizeof before), 0);
+  bzero (share, sizeof share);
+  for (k = 0; k < NKEYS; ++k)
+    ++share[before[k] - members];
+  for (k = 0; k < NMEMBERS; ++k)
+    check_int_equal (share[k] > NKEYS / NMEMBERS / 2, 1);
+
+  member_list[0] = &members[3];
+  member_list[3] = &members[0];
+  choose_all (after, NMEMBERS, 0);
+  check_int_equal (memcmp (before, after, sizeof before), 0);
+  member_list[0] = &members[0];
+  member_list[3] = &members[3];
+
+  /* Removing the last member */
+  choose_all (after, NMEMBERS - 1, 0);
+  for (k = moved = wrong = 0; k < NKEYS; ++k)
+    if (before[k] == &members[NMEMBERS - 1])
+      moved += after[k] != before[k];
+    else
+      wrong += after[k] != before[k];
+  check_int_equal (moved, share[NMEMBERS - 1]);
+  check_int_equal (wrong, 0);
+
+  /* Marking member 1 down until time 1000 */
+  health[1].down_until = 1000;
+  check_int_equal (receiver_up_p (&members[1], 999), 0);
+  check_int_equal (receiver_up_p (&members[1], 1000), 1);
+  choose_all (after, NMEMBERS, 999);
+  for (k = moved = wrong = 0; k < NKEYS; ++k)
+    if (before[k] == &members[1])
+      moved += after[k] != before[k];
+    else
+      wrong += after[k] != before[k];
+  check_int_equal (moved, share[1]);
+  check_int_equal (wrong, 0);
+  bzero (share, sizeof share);
+  for (k = 0; k < NKEYS; ++k)
+    ++share[after[k] - members];
+  check_int_equal (share[1], 0);
+
+  /* ...and then it is back. */
+  choose_all (after, NMEMBERS, 1000);
+  check_int_equal (memcmp (before, after, sizeof before), 0);
+
+  /* If all of them are down, they are chosen as if they were up. */
+  for (k = 0; k < NMEMBERS; ++k)
+    health[k].down_until = 1000;
+  choose_all (after, NMEMBERS, 999);
+  check_int_equal (memcmp (before, after, sizeof before), 0);
+  for (k = 0; k < NMEMBERS; ++k)
+    health[k].down_until = 0;
+}
+
+/* With hash=flow, each record of a NetFlow v5 datagram goes to exactly
+   one member, chosen by its flow key: two records for each of NFLOWS
+   flows, which differ only outside the flow key, go to the same
+   member. */
+static void
+test_flow ()
+{
+  struct template_cache *cache = make_template_cache ();
+  struct record_sampler *rs = make_record_sampler ();
+  struct template_scope *scope;
+  struct sockaddr_in exporter;
+  unsigned char d[24 + 2 * NFLOWS * 48];
+  int got[2 * NFLOWS];
+  unsigned used = 0, k, r;
+
+  if (!check_int_equal (cache != 0 && rs != 0, 1))
+    return;
+  bzero (&exporter, sizeof exporter);
+  exporter.sin_family = AF_INET;
+  exporter.sin_addr.s_addr = htonl (0xc6336401);
+  bzero (d, sizeof d);
+  d[1] = 5;
+  d[3] = 2 * NFLOWS;
+  for (r = 0; r < 2 * NFLOWS; ++r)
+    {
+      unsigned char *rec = d + 24 + r * 48;
+
+      rec[3] = r % NFLOWS;	/* srcaddr */
+      rec[7] = 1;		/* dstaddr */
+      rec[33] = 80;		/* srcport */
+      rec[38] = 6;		/* prot */
+      rec[19] = r;		/* dPkts, not part of the key */
+    }
+  scope = template_cache_update (cache, (struct sockaddr *) &exporter,
+				 d, sizeof d);
+  check_int_equal (record_sampler_parse (rs, scope, d, sizeof d), 0);
+  check_int_equal (record_sampler_assign (rs, choose_member, &group,
+					  receiver_group_exporter_key
+					  ((struct sockaddr *) &exporter)), 0);
+  for (r = 0; r < 2 * NFLOWS; ++r)
+    got[r] = -1;
+  for (k = 0; k < NMEMBERS; ++k)
+    {
+      const unsigned char *out;
+      struct sampler s;
+      int freqcount = 0;
+      size_t len;
+
+      bzero (&s, sizeof s);
+      s.mode = SAMPLING_COUNT;
+      s.freq = 1;
+      s.freqcount = &freqcount;
+      len = record_sampler_select (rs, &members[k], k, &s, &out);
+      if (len == 0)
+	continue;
+      ++used;
+      check_int_equal (len, 24 + get16 (out + 2) * 48);
+      for (r = 0; r < get16 (out + 2); ++r)
+	{
+	  unsigned index = out[24 + r * 48 + 19];
+
+	  check_int_equal (got[index], -1);
+	  got[index] = k;
+	}
+    }
+  for (r = 0; r < NFLOWS; ++r)
+    {
+      check_int_equal (got[r] >= 0, 1);
+      check_int_equal (got[r], got[r + NFLOWS]);
+    }
+  check_int_equal (used > 1, 1);
+  record_sampler_reset (rs);
+}
+
+static unsigned
+choose_member (const void *arg, uint64_t key)
+{
+  return receiver_group_choose (arg, key, 0);
+}
+
+static int
+check_int_equal (is, should)
+     long is;
+     long should;
+{
+  if (is == should)
+    {
+      return test_ok ();
+    }
+  else
+    {
+      return test_fail ();
+    }
+}
+
+static int
+test_ok ()
+{
+  fprintf (stdout, "%3d... ok\n", test_index++);
+  return 1;
+}
+
+static int
+test_fail ()
+{
+  fprintf (stdout, "%3d... fail\n", test_index++);
+  return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ hashing.h
+
+ Date Created: Sat Oct 17 10:41:05 2026
+
+ The hashes behind receiver groups (groups.c), hash=flow (records.c)
+ and sampling=hash (samplicate.c, sampling.h): FNV-1a over the bytes
+ of addresses, flow keys and datagram headers, and the SplitMix64
+ finalizer to turn such hashes into weights and samples.
+ */
+
+#ifndef _HASHING_H_
+#define _HASHING_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* Continue the FNV-1a hash H over the LEN bytes at P.  Start with
+   FNV_OFFSET_BASIS. */
+static inline uint64_t
+hash_fnv1a (uint64_t h, const unsigned char *p, size_t len)
+{
+  while (len-- > 0)
+    {
+      h ^= *p++;
+      h *= FNV_PRIME;
+    }
+  return h;
+}
+
+/* The finalizer of SplitMix64, so that similar keys get unrelated
+   values. */
+static inline uint64_t
+hash_mix64 (uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/* Store the address of SA in ADDR as an IPv6 address, mapping IPv4
+   addresses, so that an address hashes the same whichever way it was
+   received.  Returns the port, in network byte order. */
+static inline uint16_t
+hash_address_bytes (const struct sockaddr *sa, unsigned char addr[16])
+{
+  memset (addr, 0, 16);
+  if (sa->sa_family == AF_INET)
+    {
+      const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+
+      addr[10] = addr[11] = 0xff;
+      memcpy (addr + 12, &sin->sin_addr, 4);
+      return sin->sin_port;
+    }
+  if (sa->sa_family == AF_INET6)
+    {
+      const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+      memcpy (addr, &sin6->sin6_addr, 16);
+      return sin6->sin6_port;
+    }
+  return 0;
+}
+
+#endif /* not _HASHING_H_ */
@@ -0,0 +1,462 @@
+/*
+ health.c
+
+ Date Created: Sun Oct 25 10:27:14 2026
+
+ Liveness of receivers, so that a receiver group (see groups.c) can
+ stop sending to a member that is gone, and give its share to the
+ others until it is back.
+
+ Sending UDP gives no indication of whether anyone is listening,
+ except for the ICMP errors that may come back.  With IP_RECVERR,
+ Linux queues those on the sending socket, together with the
+ destination of the datagram that caused them, which identifies the
+ receiver.  The workers read these queues every so often
+ (health_check_errors()).  A receiver whose port is unreachable, or
+ whose host or network is, is considered down for HOLD_DOWN_MS, and
+ then tried again.
+
+ A receiver with the health=<port> option is also probed by
+ connecting to that TCP port of its address every PROBE_INTERVAL_MS,
+ from a thread of its own.  For such a receiver, the probes decide
+ when it is up again, so that it is only readmitted once it answers.
+
+ The state is kept in a struct receiver_health per receiver address
+ and port, which survives configuration reloads, so that reloading
+ doesn't send traffic to a receiver that is known to be down.  These
+ are never freed: the list of them only grows, so the workers and
+ the prober can walk it without locking while the reloader adds to
+ it.  The state itself is a single time, DOWN_UNTIL, which the
+ workers read with relaxed atomic loads (see receiver_up_p()).
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <stdint.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+# ifndef HAVE_MEMCPY
+#  define memcpy(d, s, n) bcopy ((s), (d), (n))
+# endif
+#endif
+
+#include "samplicator.h"
+#include "health.h"
+
+#define HOLD_DOWN_MS 10000
+#define PROBE_INTERVAL_MS 1000
+#define PROBE_TIMEOUT_MS 1000
+
+#define DOWN_FOREVER INT64_MAX
+
+static uint16_t
+address_port (const struct sockaddr_storage *addr)
+{
+  return addr->ss_family == AF_INET
+    ? ((const struct sockaddr_in *) addr)->sin_port
+    : ((const struct sockaddr_in6 *) addr)->sin6_port;
+}
+
+static void
+set_address_port (struct sockaddr_storage *addr, uint16_t port)
+{
+  if (addr->ss_family == AF_INET)
+    ((struct sockaddr_in *) addr)->sin_port = port;
+  else
+    ((struct sockaddr_in6 *) addr)->sin6_port = port;
+}
+
+static int
+same_address_p (const struct sockaddr_storage *a,
+		const struct sockaddr_storage *b)
+{
+  if (a->ss_family != b->ss_family || address_port (a) != address_port (b))
+    return 0;
+  if (a->ss_family == AF_INET)
+    return memcmp (&((const struct sockaddr_in *) a)->sin_addr,
+		   &((const struct sockaddr_in *) b)->sin_addr,
+		   sizeof (struct in_addr)) == 0;
+  return memcmp (&((const struct sockaddr_in6 *) a)->sin6_addr,
+		 &((const struct sockaddr_in6 *) b)->sin6_addr,
+		 sizeof (struct in6_addr)) == 0;
+}
+
+static void
+report (const struct receiver_health *h, const char *what)
+{
+  char host[INET6_ADDRSTRLEN];
+  char serv[6];
+
+  if (getnameinfo ((struct sockaddr *) &h->addr, h->addrlen,
+		   host, INET6_ADDRSTRLEN,
+		   serv, 6,
+		   NI_NUMERICHOST|NI_NUMERICSERV) == -1)
+    {
+      strcpy (host, "???");
+      strcpy (serv, "?????");
+    }
+  fprintf (stderr, "receiver %s/%s %s\n", host, serv, what);
+}
+
+/*
+ health_attach(ctx, receiver)
+
+ Point RECEIVER->health to the liveness state of its address and
+ port, which is made if this is a new one, and take over its health=
+ option; receivers with the same address and port have the same one
+ (see read_config.c).  If the option was dropped by a reload, the
+ receiver is considered up again.  Returns 0 on success, and -1 if
+ out of memory.
+ */
+int
+health_attach (ctx, receiver)
+     struct samplicator_context *ctx;
+     struct receiver *receiver;
+{
+  struct receiver_health *h;
+
+  for (h = __atomic_load_n (&ctx->health, __ATOMIC_ACQUIRE); h != 0;
+       h = h->next)
+    if (same_address_p (&h->addr, &receiver->addr))
+      break;
+  if (h == 0)
+    {
+      if ((h = calloc (1, sizeof (struct receiver_health))) == 0)
+	{
+	  fprintf (stderr, "Out of memory\n");
+	  return -1;
+	}
+      memcpy (&h->addr, &receiver->addr, receiver->addrlen);
+      h->addrlen = receiver->addrlen;
+      h->next = ctx->health;
+      __atomic_store_n (&ctx->health, h, __ATOMIC_RELEASE);
+    }
+  /* Without probes, nothing would bring it up again. */
+  if (__atomic_exchange_n (&h->probe_port, receiver->health_port,
+			   __ATOMIC_RELAXED) != 0
+      && receiver->health_port == 0)
+    __atomic_store_n (&h->down_until, 0, __ATOMIC_RELAXED);
+  receiver->health = h;
+  return 0;
+}
+
+#if defined (HAVE_LINUX_ERRQUEUE_H) && defined (IP_RECVERR)
+
+/*
+ health_watch_socket(fd, af)
+
+ Have ICMP errors for what is sent on the UDP socket FD of address
+ family AF queued for health_check_errors().  Returns 0 on success,
+ and -1 on error.
+ */
+int
+health_watch_socket (fd, af)
+     int fd;
+     int af;
+{
+  int on = 1;
+
+  if (af == AF_INET6
+      ? setsockopt (fd, SOL_IPV6, IPV6_RECVERR, &on, sizeof on)
+      : setsockopt (fd, SOL_IP, IP_RECVERR, &on, sizeof on))
+    {
+      fprintf (stderr, "setsockopt(%s): %s\n",
+	       af == AF_INET6 ? "IPV6_RECVERR" : "IP_RECVERR",
+	       strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+/* Note that the datagram to ADDR caused error ERR at time NOW. */
+static void
+note_unreachable (struct samplicator_context *ctx,
+		  const struct sockaddr_storage *addr, int err, int64_t now)
+{
+  struct receiver_health *h;
+  int64_t until, old;
+
+  for (h = __atomic_load_n (&ctx->health, __ATOMIC_ACQUIRE); h != 0;
+       h = h->next)
+    if (same_address_p (&h->addr, addr))
+      break;
+  if (h == 0)
+    return;
+  until = __atomic_load_n (&h->probe_port, __ATOMIC_RELAXED) != 0
+    ? DOWN_FOREVER : now + (int64_t) HOLD_DOWN_MS * 1000000;
+  old = __atomic_exchange_n (&h->down_until, until, __ATOMIC_RELAXED);
+  if (old <= now)
+    {
+      char what[80];
+
+      snprintf (what, sizeof what, "is unreachable: %s", strerror (err));
+      report (h, what);
+    }
+}
+
+/*
+ health_check_errors(ctx, fd, now)
+
+ Read the errors queued on the send socket FD (see
+ health_watch_socket()), and mark the receivers that are unreachable
+ as down, as of time NOW.
+ */
+void
+health_check_errors (ctx, fd, now)
+     struct samplicator_context *ctx;
+     int fd;
+     int64_t now;
+{
+  struct sockaddr_storage addr;
+  union {
+    char buf[CMSG_SPACE (sizeof (struct sock_extended_err)
+			 + sizeof (struct sockaddr_in6))];
+    struct cmsghdr align;
+  } control;
+  unsigned char data[1];
+  struct iovec iov;
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+
+  while (1)
+    {
+      iov.iov_base = data;
+      iov.iov_len = sizeof data;
+      bzero (&mh, sizeof mh);
+      mh.msg_name = &addr;
+      mh.msg_namelen = sizeof addr;
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = &control;
+      mh.msg_controllen = sizeof control;
+      if (recvmsg (fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+	return;
+      for (cmsg = CMSG_FIRSTHDR (&mh); cmsg != 0;
+	   cmsg = CMSG_NXTHDR (&mh, cmsg))
+	{
+	  struct sock_extended_err ee;
+
+	  if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+	      && !(cmsg->cmsg_level == SOL_IPV6
+		   && cmsg->cmsg_type == IPV6_RECVERR))
+	    continue;
+	  memcpy (&ee, CMSG_DATA (cmsg), sizeof ee);
+	  if (ee.ee_errno == ECONNREFUSED || ee.ee_errno == EHOSTUNREACH
+	      || ee.ee_errno == ENETUNREACH)
+	    note_unreachable (ctx, &addr, ee.ee_errno, now);
+	}
+    }
+}
+
+#else /* not (HAVE_LINUX_ERRQUEUE_H && IP_RECVERR) */
+
+int
+health_watch_socket (fd, af)
+     int fd;
+     int af;
+{
+  return 0;
+}
+
+void
+health_check_errors (ctx, fd, now)
+     struct samplicator_context *ctx;
+     int fd;
+     int64_t now;
+{
+}
+
+#endif /* not (HAVE_LINUX_ERRQUEUE_H && IP_RECVERR) */
+
+/* A probe of the health port of a receiver: a TCP connection that is
+   being made on FD, until it is DONE.  SKIP is set if the probe could
+   not be made for reasons of our own, such as running out of
+   descriptors, which say nothing about the receiver. */
+struct probe {
+  struct receiver_health       *health;
+  int				fd;
+  int				done;
+  int				up;
+  int				skip;
+};
+
+/* Start probing H on PORT (in network byte order). */
+static void
+start_probe (struct probe *p, struct receiver_health *h, uint16_t port)
+{
+  struct sockaddr_storage addr = h->addr;
+
+  p->health = h;
+  p->done = 1;
+  p->up = 0;
+  p->skip = 1;
+  set_address_port (&addr, port);
+  if ((p->fd = socket (addr.ss_family, SOCK_STREAM, 0)) == -1)
+    return;
+  if (fcntl (p->fd, F_SETFL, fcntl (p->fd, F_GETFL) | O_NONBLOCK) == -1)
+    return;
+  p->skip = 0;
+  if (connect (p->fd, (struct sockaddr *) &addr, h->addrlen) == 0)
+    p->up = 1;
+  else if (errno == EINPROGRESS)
+    p->done = 0;
+}
+
+static void
+finish_probe (struct probe *p, int64_t now)
+{
+  struct receiver_health *h = p->health;
+  int64_t old;
+
+  if (p->fd != -1)
+    close (p->fd);
+  /* A reload may have dropped the health= option meanwhile. */
+  if (p->skip || __atomic_load_n (&h->probe_port, __ATOMIC_RELAXED) == 0)
+    return;
+  old = __atomic_exchange_n (&h->down_until, p->up ? 0 : DOWN_FOREVER,
+			     __ATOMIC_RELAXED);
+  if (p->up && old > now)
+    report (h, "is up again");
+  else if (!p->up && old <= now)
+    report (h, "does not answer on its health port");
+}
+
+static void *
+run_prober (arg)
+     void *arg;
+{
+  struct samplicator_context *ctx = arg;
+  struct probe *probes = 0;
+  struct pollfd *fds = 0;
+  unsigned nprobes, max_probes = 0, npending, k;
+  int64_t start, now, left;
+
+  while (1)
+    {
+      struct receiver_health *h;
+      struct timespec ts;
+
+      start = monotonic_ns ();
+      nprobes = 0;
+      for (h = __atomic_load_n (&ctx->health, __ATOMIC_ACQUIRE); h != 0;
+	   h = h->next)
+	{
+	  unsigned port = __atomic_load_n (&h->probe_port, __ATOMIC_RELAXED);
+
+	  if (port == 0)
+	    continue;
+	  if (nprobes == max_probes)
+	    {
+	      unsigned max = max_probes ? max_probes * 2 : 16;
+	      struct probe *p = realloc (probes, max * sizeof *probes);
+	      struct pollfd *f;
+
+	      if (p != 0)
+		probes = p;
+	      if (p == 0
+		  || (f = realloc (fds, max * sizeof *fds)) == 0)
+		break;
+	      fds = f;
+	      max_probes = max;
+	    }
+	  start_probe (&probes[nprobes++], h, htons (port));
+	}
+      do
+	{
+	  for (npending = k = 0; k < nprobes; ++k)
+	    if (!probes[k].done)
+	      {
+		fds[npending].fd = probes[k].fd;
+		fds[npending].events = POLLOUT;
+		++npending;
+	      }
+	  now = monotonic_ns ();
+	  if (npending == 0
+	      || now - start >= (int64_t) PROBE_TIMEOUT_MS * 1000000
+	      || poll (fds, npending,
+		       PROBE_TIMEOUT_MS - (now - start) / 1000000) <= 0)
+	    break;
+	  for (npending = k = 0; k < nprobes; ++k)
+	    if (!probes[k].done && fds[npending++].revents != 0)
+	      {
+		int err;
+		socklen_t len = sizeof err;
+
+		probes[k].done = 1;
+		probes[k].up = getsockopt (probes[k].fd, SOL_SOCKET, SO_ERROR,
+					   &err, &len) == 0 && err == 0;
+	      }
+	}
+      while (1);
+      now = monotonic_ns ();
+      for (k = 0; k < nprobes; ++k)
+	finish_probe (&probes[k], now);
+      left = start + (int64_t) PROBE_INTERVAL_MS * 1000000 - now;
+      if (left > 0)
+	{
+	  ts.tv_sec = left / 1000000000;
+	  ts.tv_nsec = left % 1000000000;
+	  nanosleep (&ts, 0);
+	}
+    }
+  return 0;
+}
+
+/*
+ start_health_prober(ctx)
+
+ Start the thread that probes the receivers with the health= option,
+ unless it is running, or there are none.  Returns 0 on success, and
+ -1 on error.
+ */
+int
+start_health_prober (ctx)
+     struct samplicator_context *ctx;
+{
+  struct receiver_health *h;
+  pthread_t thread;
+  int result;
+
+  if (ctx->health_prober_p)
+    return 0;
+  for (h = ctx->health; h != 0; h = h->next)
+    if (h->probe_port != 0)
+      break;
+  if (h == 0)
+    return 0;
+  if ((result = pthread_create (&thread, 0, run_prober, ctx)) != 0)
+    {
+      fprintf (stderr, "pthread_create(): %s\n", strerror (result));
+      return -1;
+    }
+  pthread_detach (thread);
+  ctx->health_prober_p = 1;
+  return 0;
+}
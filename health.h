@@ -0,0 +1,10 @@
+/*
+ health.h
+
+ Date Created: Sun Oct 25 10:27:14 2026
+ */
+
+extern int health_attach (struct samplicator_context *, struct receiver *);
+extern int health_watch_socket (int, int);
+extern void health_check_errors (struct samplicator_context *, int, int64_t);
+extern int start_health_prober (struct samplicator_context *);
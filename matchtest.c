@@ -0,0 +1,223 @@
+/*
+ matchtest.c
+
+ Date Created: Fri Oct 16 21:48:30 2026
+
+ Regression tests for matching sender addresses against the source
+ list (source_table.c).
+
+ Like parsetest, this program outputs a series of numbered "ok" or
+ "fail" lines.  Set a breakpoint at test_fail() to find out what went
+ wrong.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+#endif
+
+#include "samplicator.h"
+#include "read_config.h"
+#include "source_table.h"
+
+static int parse_cf_string (const char *, struct samplicator_context *);
+static void check_lookup (const struct source_table *, const char *,
+			  const int *);
+static int check_int_equal (int, int);
+static int test_ok (void);
+static int test_fail (void);
+static int test_index = 1;
+static struct match_cache *cache;
+
+static const char *test_config = "\
+10.0.0.0/8: 1.1.1.1/1000\n\
+10.1.0.0/16: 1.1.1.1/1001\n\
+10.1.2.3: 1.1.1.1/1002\n\
+192.168.0.0/255.255.0.255: 1.1.1.1/1003\n\
+10.1.0.0/16: 1.1.1.1/1004\n\
+[2001:db8::]/32: 1.1.1.1/1005\n\
+[2001:db8:1::]/48: 1.1.1.1/1006\n\
+10.0.0.1/8: 1.1.1.1/1007\n\
+[::]/0: 1.1.1.1/1008\n\
+";
+
+int
+main (int argc, char **argv)
+{
+  struct samplicator_context ctx;
+  struct source_table *table;
+
+  if (argc != 1)
+    {
+      fprintf (stderr, "Usage: %s\n", argv[0]);
+      exit (1);
+    }
+  cache = make_match_cache ();
+  check_int_equal (cache != 0, 1);
+  check_int_equal (parse_cf_string (test_config, &ctx), 0);
+  table = make_source_table (ctx.sources);
+  if (check_int_equal (table != 0, 1))
+    {
+      static const int m1[] = { 0, 1, 2, 4, 8, -1 };
+      static const int m2[] = { 0, 1, 4, 8, -1 };
+      static const int m3[] = { 0, 8, -1 };
+      static const int m4[] = { 3, 8, -1 };
+      static const int m5[] = { 8, -1 };
+      static const int m6[] = { 5, 6, 8, -1 };
+      static const int m7[] = { 5, 8, -1 };
+
+      check_int_equal (table->nsources, 9);
+      check_lookup (table, "10.1.2.3", m1);
+      check_lookup (table, "10.1.9.9", m2);
+      check_lookup (table, "10.2.0.1", m3);
+      check_lookup (table, "192.168.5.0", m4);
+      check_lookup (table, "192.168.5.1", m5);
+      check_lookup (table, "11.0.0.1", m5);
+      check_lookup (table, "::ffff:10.1.2.3", m1);
+      check_lookup (table, "2001:db8:1::5", m6);
+      check_lookup (table, "2001:db8:2::5", m7);
+      check_lookup (table, "2001:db9::", m5);
+      free_source_table (table);
+    }
+
+  /* A single source without prefix matches only itself. */
+  check_int_equal (parse_cf_string ("192.0.2.1: 1.1.1.1/1000\n", &ctx), 0);
+  table = make_source_table (ctx.sources);
+  if (check_int_equal (table != 0, 1))
+    {
+      static const int m1[] = { 0, -1 };
+      static const int m2[] = { -1 };
+
+      check_lookup (table, "192.0.2.1", m1);
+      check_lookup (table, "192.0.2.2", m2);
+      check_lookup (table, "2001:db8::1", m2);
+      free_source_table (table);
+    }
+  return 0;
+}
+
+static void
+check_lookup (table, addrstring, expected)
+     const struct source_table *table;
+     const char *addrstring;
+     const int *expected;
+{
+  struct source_context *matches[table->nsources], **cached;
+  struct addrinfo hints, *res;
+  unsigned nmatches, ncached, k, pass;
+
+  bzero (&hints, sizeof hints);
+  hints.ai_flags = AI_NUMERICHOST;
+  if (getaddrinfo (addrstring, 0, &hints, &res) != 0)
+    {
+      test_fail ();
+      return;
+    }
+  nmatches = source_table_lookup (table, res->ai_addr, matches);
+  for (k = 0; k < nmatches && expected[k] != -1; ++k)
+    check_int_equal (matches[k]->index, expected[k]);
+  check_int_equal (k, nmatches);
+  check_int_equal (expected[k], -1);
+
+  /* The match cache must return the same result when the address is
+     first seen, and when it is found in the cache. */
+  for (pass = 0; pass < 2; ++pass)
+    {
+      ncached = match_cache_lookup (cache, table, res->ai_addr, &cached);
+      check_int_equal (ncached, nmatches);
+      for (k = 0; k < ncached && k < nmatches; ++k)
+	check_int_equal (cached[k] == matches[k], 1);
+    }
+  freeaddrinfo (res);
+}
+
+static int
+parse_cf_string (s, ctx)
+     const char *s;
+     struct samplicator_context *ctx;
+{
+  const char *test_file_name = "matchtest.cf";
+  FILE *fp;
+  const char *args[20];
+  const char **ap;
+  int n_args;
+
+  unlink (test_file_name);
+  fp = fopen (test_file_name, "w");
+  if (fp == (FILE *) 0)
+    {
+      fprintf (stderr, "Could not create test file %s: %s",
+	       test_file_name,
+	       strerror (errno));
+      return -1;
+    }
+  if (fputs (s, fp) == EOF)
+    {
+      fprintf (stderr, "Error writing to test file %s: %s",
+	       test_file_name,
+	       strerror (errno));
+      return -1;
+    }
+  if (fclose (fp) != 0)
+    {
+      fprintf (stderr, "Error closing test file %s: %s",
+	       test_file_name,
+	       strerror (errno));
+      return -1;
+    }
+  ap = &args[0];
+  *ap++ = "matchtest";
+  *ap++ = "-c";
+  *ap++ = test_file_name;
+  n_args = ap-args;
+  *ap++ = (char *) 0;
+  return parse_args (n_args, args, ctx);
+}
+
+static int
+check_int_equal (is, should)
+     int is;
+     int should;
+{
+  if (is == should)
+    {
+      return test_ok ();
+    }
+  else
+    {
+      return test_fail ();
+    }
+}
+
+static int
+test_ok ()
+{
+  fprintf (stdout, "%3d... ok\n", test_index++);
+  return 1;
+}
+
+static int
+test_fail ()
+{
+  fprintf (stdout, "%3d... fail\n", test_index++);
+  return 0;
+}
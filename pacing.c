@@ -0,0 +1,119 @@
+/*
+ pacing.c
+
+ Date Created: Sat Oct 17 09:12:40 2026
+
+ Per-receiver rate limits.
+
+ A rate limit is implemented as a token bucket in "virtual scheduling"
+ form (the Generic Cell Rate Algorithm): instead of a token count, we
+ keep the theoretical arrival time TAT of the next unit of traffic.
+ Sending COST units at time NOW is allowed if TAT - NOW does not
+ exceed the burst tolerance; TAT then advances by COST times the time
+ per unit.  Because the whole state is a single 64-bit timestamp, it
+ can be updated with compare-and-swap, so a receiver's limit can be
+ shared by several worker threads without locks.  TAT lives outside
+ struct rate_limit, so that the caller can keep it away from data
+ that is only read (see struct receiver_pacing).
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "pacing.h"
+
+int64_t
+monotonic_ns ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ init_rate_limit(limit, rate, burst_ms, min_burst)
+
+ Initialize LIMIT to allow RATE units per second, with bursts of up
+ to BURST_MS milliseconds worth of traffic, but at least MIN_BURST
+ units.  A RATE of zero means no limit.
+ */
+void
+init_rate_limit (limit, rate, burst_ms, min_burst)
+     struct rate_limit *limit;
+     double rate;
+     unsigned burst_ms;
+     unsigned min_burst;
+{
+  double tolerance;
+
+  if (rate <= 0)
+    {
+      limit->ns_per_unit = 0;
+      limit->tolerance_ns = 0;
+      return;
+    }
+  limit->ns_per_unit = 1e9 / rate;
+  tolerance = burst_ms * 1e6;
+  if (tolerance < min_burst * limit->ns_per_unit)
+    tolerance = min_burst * limit->ns_per_unit;
+  /* A burst of B units is allowed if the bucket may run B-1 units
+     ahead of real time. */
+  limit->tolerance_ns = tolerance - limit->ns_per_unit;
+  if (limit->tolerance_ns < 0)
+    limit->tolerance_ns = 0;
+}
+
+/*
+ rate_limit_conform(limit, tatp, units, now)
+
+ Try to take UNITS units from LIMIT, whose theoretical arrival time is
+ *TATP, at time NOW (in nanoseconds, see monotonic_ns()).  Returns
+ zero if this is allowed, in which case the units have been accounted
+ for.  Otherwise, nothing is changed and the return value is the time
+ at which the units would be allowed.
+ */
+int64_t
+rate_limit_conform (limit, tatp, units, now)
+     const struct rate_limit *limit;
+     int64_t *tatp;
+     unsigned units;
+     int64_t now;
+{
+  int64_t tat, start, cost;
+
+  if (limit->ns_per_unit == 0)
+    return 0;
+  cost = (int64_t) (units * limit->ns_per_unit);
+  tat = __atomic_load_n (tatp, __ATOMIC_RELAXED);
+  do
+    {
+      start = tat > now ? tat : now;
+      if (start - now > limit->tolerance_ns)
+	return start - limit->tolerance_ns;
+    }
+  while (!__atomic_compare_exchange_n (tatp, &tat, start + cost,
+				       1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+/*
+ rate_limit_refund(limit, tatp, units)
+
+ Give back UNITS units that were taken from LIMIT and *TATP by a
+ successful rate_limit_conform(), but could not be used after all.
+ */
+void
+rate_limit_refund (limit, tatp, units)
+     const struct rate_limit *limit;
+     int64_t *tatp;
+     unsigned units;
+{
+  if (limit->ns_per_unit == 0)
+    return;
+  __atomic_sub_fetch (tatp, (int64_t) (units * limit->ns_per_unit),
+		      __ATOMIC_RELAXED);
+}
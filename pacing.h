@@ -0,0 +1,30 @@
+/*
+ pacing.h
+
+ Date Created: Sat Oct 17 09:12:40 2026
+ */
+
+#ifndef _PACING_H_
+#define _PACING_H_
+
+#include <stdint.h>
+
+/* A rate limit in the form of a virtual scheduling (GCRA) token
+   bucket, see pacing.c.  NS_PER_UNIT is zero for no limit.  The
+   bucket's state, its theoretical arrival time, is kept separately
+   by the caller, since it is written on every use while the limit
+   itself is only read. */
+struct rate_limit {
+  double			ns_per_unit;
+  int64_t			tolerance_ns;
+};
+
+#define DEFAULT_BURST_MS 10
+
+extern void init_rate_limit (struct rate_limit *, double, unsigned, unsigned);
+extern int64_t rate_limit_conform (const struct rate_limit *, int64_t *,
+				   unsigned, int64_t);
+extern void rate_limit_refund (const struct rate_limit *, int64_t *, unsigned);
+extern int64_t monotonic_ns (void);
+
+#endif /* not _PACING_H_ */
@@ -173,6 +173,108 @@ main (int argc, char **argv)
 	}
     }
 
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234/10,34;pps=100;queue=5\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      check_int_equal (sctx->nreceivers, 1);
+      check_receiver (&sctx->receivers[0], "6.7.8.9", 1234, AF_INET, 10, 34);
+      check_int_equal (sctx->receivers[0].queue_limit, 5);
+      check_int_equal ((sctx->receivers[0].flags & pf_PACED) != 0, 1);
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1200-1201;bps=10m;burst=5\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      check_int_equal (sctx->nreceivers, 2);
+      check_receiver (&sctx->receivers[0], "6.7.8.9", 1200, AF_INET, 1, DEFAULT_TTL);
+      if (sctx->nreceivers == 2)
+	{
+	  check_receiver (&sctx->receivers[1], "6.7.8.9", 1201, AF_INET, 1, DEFAULT_TTL);
+	  check_int_equal ((sctx->receivers[1].flags & pf_PACED) != 0, 1);
+	}
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      check_int_equal ((sctx->receivers[0].flags & pf_PACED) != 0, 0);
+      check_int_equal ((sctx->receivers[0].flags & pf_DROP_HEAD) != 0, 0);
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;queue=10;drop=head\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      check_int_equal (sctx->receivers[0].queue_limit, 10);
+      check_int_equal ((sctx->receivers[0].flags & pf_DROP_HEAD) != 0, 1);
+      check_int_equal ((sctx->receivers[0].flags & pf_PACED) != 0, 0);
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;drop=middle\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234/10;templates=60\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      check_receiver (&sctx->receivers[0], "6.7.8.9", 1234, AF_INET, 10, DEFAULT_TTL);
+      check_int_equal (sctx->receivers[0].template_interval, 60);
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;templates=0\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234/10;unit=records\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    check_int_equal ((sctx->receivers[0].flags & pf_RECORDS) != 0, 1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;unit=datagrams\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    check_int_equal ((sctx->receivers[0].flags & pf_RECORDS) != 0, 0);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;unit=flows\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234/4;sampling=hash 6.7.8.9/1235;sampling=random\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      check_int_equal (sctx->receivers[0].sampling, SAMPLING_HASH);
+      check_int_equal (sctx->receivers[0].sample_threshold == ((uint64_t) 1 << 30), 1);
+      check_int_equal (sctx->receivers[1].sampling, SAMPLING_RANDOM);
+      check_int_equal (sctx->receivers[1].sample_threshold == ((uint64_t) 1 << 32), 1);
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;sampling=sometimes\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;group=a 6.7.8.10/1234 6.7.8.9/2000+2;group=b;hash=flow 6.7.8.11/1234;group=a\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      check_int_equal (sctx->nreceivers, 5);
+      check_int_equal (sctx->ngroups, 2);
+      check_int_equal (sctx->receivers[1].group == 0, 1);
+      if (check_non_null (sctx->receivers[0].group))
+	{
+	  check_int_equal (sctx->receivers[0].group->nmembers, 2);
+	  check_int_equal (sctx->receivers[0].group->flow_p, 0);
+	  check_int_equal (sctx->receivers[0].group == sctx->receivers[4].group, 1);
+	}
+      if (check_non_null (sctx->receivers[2].group))
+	{
+	  check_int_equal (sctx->receivers[2].group->nmembers, 2);
+	  check_int_equal (sctx->receivers[2].group->flow_p, 1);
+	  check_int_equal (sctx->receivers[2].group == sctx->receivers[3].group, 1);
+	}
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;group=\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;group=a;health=8080\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    check_int_equal (sctx->receivers[0].health_port, 8080);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;health=65536\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;health=8080 6.7.8.9/1234\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;health=8080\n5.6.7.8: 6.7.8.9/1234;health=8081\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;health=8080\n5.6.7.8: 6.7.8.9/1234;health=8080 6.7.8.9/1235\n", &ctx), 0);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;hash=flow\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;group=a;hash=port\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;group=a;hash=flow 6.7.8.10/1234;group=a\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;frobnicate=1\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;pps=-5\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;dev=lo;lladdr=02:00:5e:0A:0b:ff\n", &ctx), 0);
+  if (check_non_null (sctx = ctx.sources))
+    {
+      static const unsigned char lladdr[LLADDR_LEN]
+	= { 0x02, 0x00, 0x5e, 0x0a, 0x0b, 0xff };
+
+      check_int_equal (sctx->receivers[0].ifindex != 0, 1);
+      check_int_equal (memcmp (sctx->receivers[0].lladdr, lladdr, LLADDR_LEN), 0);
+    }
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;dev=lo\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;dev=lo;lladdr=02:00:5e:0a:0b\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;dev=lo;lladdr=02:00:5e:0a:0b:ff:1\n", &ctx), -1);
+  check_int_equal (parse_cf_string ("1.2.3.4: 6.7.8.9/1234;dev=no-such-if0;lladdr=02:00:5e:0a:0b:ff\n", &ctx), -1);
+
 #ifdef NOTYET
   check_int_equal (parse_cf_string ("1.2.3.4/30: localhost/1234", &ctx), 0);
   check_int_equal (ctx.fork, 0);
@@ -32,6 +32,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <sys/uio.h>
 
 /* make uh_... slot names available under Linux */
@@ -47,8 +48,203 @@
 
 #define MAX_IP_DATAGRAM_SIZE 65535
 
-static unsigned ip_header_checksum (const void * header);
-static uint16_t udp_sum_calc (uint16_t, uint32_t, uint16_t, uint32_t, uint16_t, const void *);
+/*
+ struct raw_send_template
+
+ The parts of the IP header, UDP header and destination address that
+ are the same for every datagram sent to a given receiver.  The
+ one's complement sum of the fixed header words is precomputed, so
+ that the IP header checksum of each datagram can be derived from it
+ incrementally (RFC 1624): only the total length and the source
+ address have to be added.  Likewise, UH_SUM holds the part of the
+ UDP checksum that depends on the receiver only, i.e. the
+ destination address and port and the protocol number of the
+ pseudo-header.
+
+ For an IPv6 receiver, IH.IP6 is used instead of IH.IP.  IPv6 has
+ no header checksum, so IH_SUM is unused.
+ */
+struct raw_send_template {
+  union {
+    struct ip			ip;
+    struct ip6_hdr		ip6;
+  } ih;
+  uint32_t			ih_sum;
+  uint32_t			uh_sum;
+  in_port_t			dport;
+  union {
+    struct sockaddr		sa;
+    struct sockaddr_in		sin;
+    struct sockaddr_in6		sin6;
+  } dest;
+  socklen_t			destlen;
+};
+
+/* The ones' complement sum of the 16-bit words of P, not folded.
+   Interestingly, we don't need to convert between network and host
+   byte order because of the way the checksum is defined. */
+static uint32_t
+ones_sum (const void *p, size_t len)
+{
+  const uint16_t *w = (const uint16_t *) p;
+  uint32_t sum = 0;
+
+  for (; len >= 2; len -= 2)
+    sum += *w++;
+  return sum;
+}
+
+/*
+ raw_payload_sum(msg, msglen)
+
+ Return the ones' complement sum of the 16-bit words of the payload
+ MSG, for use with raw_send_with_template().  The sum only depends on
+ the payload, so it can be computed once per datagram and reused for
+ each receiver it is sent to.
+
+ The payload is summed 64 bits at a time, with the carries added back
+ in (RFC 1071, section 2), and the result is folded to 32 bits.  A
+ trailing odd byte is padded with zero, as if it were the high-order
+ byte of a final 16-bit word in network byte order.
+ */
+uint32_t
+raw_payload_sum (msg, msglen)
+     const void *msg;
+     size_t msglen;
+{
+  const unsigned char *p = (const unsigned char *) msg;
+  uint64_t sum = 0, w;
+  uint32_t w32;
+  uint16_t w16;
+
+  for (; msglen >= 32; msglen -= 32, p += 32)
+    {
+      memcpy (&w, p, 8); sum += w; sum += sum < w;
+      memcpy (&w, p+8, 8); sum += w; sum += sum < w;
+      memcpy (&w, p+16, 8); sum += w; sum += sum < w;
+      memcpy (&w, p+24, 8); sum += w; sum += sum < w;
+    }
+  for (; msglen >= 8; msglen -= 8, p += 8)
+    {
+      memcpy (&w, p, 8); sum += w; sum += sum < w;
+    }
+  /* Less than 8 bytes left, so the additions below cannot overflow
+     after folding SUM to 32 bits. */
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  if (msglen >= 4)
+    {
+      memcpy (&w32, p, 4); sum += w32;
+      p += 4; msglen -= 4;
+    }
+  if (msglen >= 2)
+    {
+      memcpy (&w16, p, 2); sum += w16;
+      p += 2; msglen -= 2;
+    }
+  if (msglen > 0)
+    {
+      unsigned char last[2];
+
+      last[0] = *p;
+      last[1] = 0;
+      memcpy (&w16, last, 2); sum += w16;
+    }
+  while (sum > 0xffffffff)
+    sum = (sum & 0xffffffff) + (sum >> 32);
+  return (uint32_t) sum;
+}
+
+/* Fold the ones' complement sum SUM to 16 bits and return its
+   complement, as a UDP checksum.  A zero checksum is transmitted as
+   all ones, because zero means "no checksum" (RFC 768). */
+static uint16_t
+udp_checksum (sum)
+     uint64_t sum;
+{
+  while (sum > 0xffff)
+    sum = (sum & 0xffff) + (sum >> 16);
+  sum = ~sum & 0xffff;
+  return sum == 0 ? 0xffff : sum;
+}
+
+/*
+ init_raw_send_template(t, daddr_generic, ttl)
+
+ Fill in template T for sending to DADDR_GENERIC (an IPv4 or IPv6
+ socket address) with the given TTL or hop limit.
+ */
+void
+init_raw_send_template (t, daddr_generic, ttl)
+     struct raw_send_template *t;
+     const struct sockaddr *daddr_generic;
+     int ttl;
+{
+  bzero ((char *) t, sizeof *t);
+  if (daddr_generic->sa_family == AF_INET6)
+    {
+      const struct sockaddr_in6 *daddr
+	= (const struct sockaddr_in6 *) daddr_generic;
+
+      t->ih.ip6.ip6_flow = htonl (6 << 28);
+      t->ih.ip6.ip6_nxt = 17;
+      t->ih.ip6.ip6_hlim = ttl;
+      t->ih.ip6.ip6_dst = daddr->sin6_addr;
+      /* ip6_plen and ip6_src are added in per datagram. */
+      t->uh_sum = ones_sum (&daddr->sin6_addr, sizeof daddr->sin6_addr)
+	+ daddr->sin6_port + htons (17);
+      t->dport = daddr->sin6_port;
+
+      /* The port of the destination of a raw socket, if non-zero,
+	 is taken as the protocol number. */
+      t->dest.sin6.sin6_family = AF_INET6;
+      t->dest.sin6.sin6_addr = daddr->sin6_addr;
+      t->dest.sin6.sin6_scope_id = daddr->sin6_scope_id;
+      t->destlen = sizeof t->dest.sin6;
+    }
+  else
+    {
+      const struct sockaddr_in *daddr
+	= (const struct sockaddr_in *) daddr_generic;
+
+      t->ih.ip.ip_hl = (sizeof t->ih.ip+3)/4;
+      t->ih.ip.ip_v = 4;
+      t->ih.ip.ip_tos = 0;
+      t->ih.ip.ip_off = htons (0);
+      t->ih.ip.ip_id = htons (0);
+      t->ih.ip.ip_ttl = ttl;
+      t->ih.ip.ip_p = 17;
+      t->ih.ip.ip_sum = htons (0);
+      t->ih.ip.ip_dst.s_addr = daddr->sin_addr.s_addr;
+      /* ip_len and ip_src are zero here, and are added in per datagram. */
+      t->ih_sum = ones_sum (&t->ih.ip, sizeof t->ih.ip);
+      t->uh_sum = ones_sum (&daddr->sin_addr.s_addr, sizeof daddr->sin_addr.s_addr)
+	+ daddr->sin_port + htons (17);
+      t->dport = daddr->sin_port;
+
+      t->dest.sin.sin_family = AF_INET;
+      t->dest.sin.sin_port = daddr->sin_port;
+      t->dest.sin.sin_addr.s_addr = daddr->sin_addr.s_addr;
+      t->destlen = sizeof t->dest.sin;
+    }
+}
+
+/*
+ make_raw_send_template(daddr, ttl)
+
+ Allocate and fill in a template, see init_raw_send_template().
+ Returns 0 if out of memory.
+ */
+struct raw_send_template *
+make_raw_send_template (daddr, ttl)
+     const struct sockaddr *daddr;
+     int ttl;
+{
+  struct raw_send_template *t = malloc (sizeof (struct raw_send_template));
+
+  if (t != 0)
+    init_raw_send_template (t, daddr, ttl);
+  return t;
+}
 
 int
 raw_send_from_to (s, msg, msglen, saddr_generic, daddr_generic, ttl, flags)
@@ -59,40 +255,256 @@ raw_send_from_to (s, msg, msglen, saddr_generic, daddr_generic, ttl, flags)
      struct sockaddr *daddr_generic;
      int ttl;
      int flags;
-#define saddr ((struct sockaddr_in *) saddr_generic)
-#define daddr ((struct sockaddr_in *) daddr_generic)
+{
+  struct raw_send_template t;
+
+  init_raw_send_template (&t, daddr_generic, ttl);
+  return raw_send_with_template (s, &t, msg, msglen,
+				 flags & RAWSEND_COMPUTE_UDP_CHECKSUM
+				 ? raw_payload_sum (msg, msglen) : 0,
+				 saddr_generic, flags);
+}
+
+/* The headers of a datagram, as built by fill_headers(). */
+struct raw_headers {
+  union {
+    struct ip			ip;
+    struct ip6_hdr		ip6;
+  } ih;
+  struct udphdr			uh;
+};
+
+/*
+ fill_headers(h, t, msg, msglen, payload_sum, saddr_generic, flags)
+
+ Fill in the IP and UDP headers H of a datagram with payload MSG of
+ MSGLEN bytes from SADDR_GENERIC to the receiver described by template T.
+ If FLAGS include RAWSEND_COMPUTE_UDP_CHECKSUM, PAYLOAD_SUM must be
+ raw_payload_sum() of the payload.  Returns the length of the IP
+ header, which is followed by the UDP header in H, or -1 if the
+ address families of sender and receiver don't fit.
+ */
+static int
+fill_headers (h, t, msg, msglen, payload_sum, saddr_generic, flags)
+     struct raw_headers *h;
+     const struct raw_send_template *t;
+     const void *msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr_generic;
+     int flags;
 {
   int length;
+  size_t ihlen;
+  uint32_t sum;
+
+  h->uh.uh_ulen = htons (msglen + sizeof h->uh);
+  h->uh.uh_dport = t->dport;
+  if (t->dest.sa.sa_family == AF_INET6)
+    {
+      const struct sockaddr_in6 *saddr
+	= (const struct sockaddr_in6 *) saddr_generic;
+
+      if (saddr_generic->sa_family != AF_INET6)
+	{
+	  /* We cannot pretend that an IPv4 sender sent over IPv6. */
+	  errno = EAFNOSUPPORT;
+	  return -1;
+	}
+      h->uh.uh_sport = saddr->sin6_port;
+      h->ih.ip6 = t->ih.ip6;
+      h->ih.ip6.ip6_plen = h->uh.uh_ulen;
+      h->ih.ip6.ip6_src = saddr->sin6_addr;
+      ihlen = sizeof h->ih.ip6;
+      /* The UDP checksum is mandatory for IPv6 (RFC 8200). */
+      sum = ones_sum (&saddr->sin6_addr, sizeof saddr->sin6_addr);
+      if (!(flags & RAWSEND_COMPUTE_UDP_CHECKSUM))
+	{
+	  payload_sum = raw_payload_sum (msg, msglen);
+	  flags |= RAWSEND_COMPUTE_UDP_CHECKSUM;
+	}
+    }
+  else
+    {
+      struct in_addr src;
+
+      /* An IPv4 sender received on an IPv6 socket has an IPv4-mapped
+	 address. */
+      if (saddr_generic->sa_family == AF_INET6)
+	{
+	  const struct sockaddr_in6 *saddr
+	    = (const struct sockaddr_in6 *) saddr_generic;
+
+	  if (!IN6_IS_ADDR_V4MAPPED (&saddr->sin6_addr))
+	    {
+	      errno = EAFNOSUPPORT;
+	      return -1;
+	    }
+	  memcpy (&src.s_addr, &saddr->sin6_addr.s6_addr[12],
+		  sizeof src.s_addr);
+	  h->uh.uh_sport = saddr->sin6_port;
+	}
+      else
+	{
+	  const struct sockaddr_in *saddr
+	    = (const struct sockaddr_in *) saddr_generic;
+
+	  src = saddr->sin_addr;
+	  h->uh.uh_sport = saddr->sin_port;
+	}
+      h->ih.ip = t->ih.ip;
+      ihlen = sizeof h->ih.ip;
+      length = msglen + sizeof h->uh + ihlen;
+      /* Depending on the target platform, te ip_off and ip_len fields
+	 should be in either host or network byte order.  Usually
+	 BSD-derivatives require host byte order, but at least OpenBSD
+	 since version 2.1 and FreeBSD since 11.0 use network byte
+	 order.  Linux uses network byte order for all IP header fields. */
+#if defined (__linux__) || (defined (__OpenBSD__) && (OpenBSD > 199702)) || (defined (__FreeBSD_version) && (__FreeBSD_version > 1100030))
+      h->ih.ip.ip_len = htons (length);
+#else 
+      h->ih.ip.ip_len = length;
+#endif
+      h->ih.ip.ip_src = src;
+
+      /* At least on Solaris and Linux, the raw IP datagram
+	 transmission code computes the IP header checksum for us, but
+	 other systems may not.  Starting from the template's sum,
+	 this only costs a few additions. */
+      sum = t->ih_sum + h->ih.ip.ip_len
+	+ (src.s_addr & 0xffff) + (src.s_addr >> 16);
+      while (sum > 0xffff)
+	sum = (sum & 0xffff) + (sum >> 16);
+      h->ih.ip.ip_sum = ~sum & 0xffff;
+      sum = (src.s_addr & 0xffff) + (src.s_addr >> 16);
+    }
+  /* The UDP length is counted twice, once in the pseudo-header and
+     once in the UDP header itself.  SUM holds the source address. */
+  h->uh.uh_sum = flags & RAWSEND_COMPUTE_UDP_CHECKSUM
+    ? udp_checksum ((uint64_t) t->uh_sum + payload_sum + sum
+		    + h->uh.uh_sport + 2 * h->uh.uh_ulen)
+    : 0;
+  return ihlen;
+}
+
+/*
+ raw_build_headers(buf, buflen, t, msg, msglen, payload_sum, saddr, flags)
+
+ Write the IP and UDP headers of the datagram that
+ raw_send_with_template() would send to BUF, which has room for
+ BUFLEN bytes.  Returns the length of the headers, which the payload
+ must follow, or -1 if the datagram doesn't fit (with errno set to
+ EMSGSIZE) or cannot be built.  This is for transmission paths that
+ bypass the IP layer, such as packet sockets (see txring.c), so on
+ those systems where the IP length field is in host byte order, this
+ is only correct if that doesn't matter.
+ */
+int
+raw_build_headers (buf, buflen, t, msg, msglen, payload_sum, saddr, flags)
+     void *buf;
+     size_t buflen;
+     const struct raw_send_template *t;
+     const void *msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr;
+     int flags;
+{
+  struct raw_headers h;
+  int ihlen;
+  unsigned char *p = (unsigned char *) buf;
+
+  if ((ihlen = fill_headers (&h, t, msg, msglen, payload_sum,
+			     saddr, flags)) == -1)
+    return -1;
+  if (ihlen + sizeof h.uh + msglen > buflen)
+    {
+      errno = EMSGSIZE;
+      return -1;
+    }
+  memcpy (p, &h.ih, ihlen);
+  memcpy (p + ihlen, &h.uh, sizeof h.uh);
+  return ihlen + sizeof h.uh;
+}
+
+/*
+ raw_build_datagram(buf, buflen, t, msg, msglen, payload_sum, saddr, flags)
+
+ Like raw_build_headers(), but also copy the payload to BUF.  Returns
+ the length of the whole datagram.
+ */
+int
+raw_build_datagram (buf, buflen, t, msg, msglen, payload_sum, saddr, flags)
+     void *buf;
+     size_t buflen;
+     const struct raw_send_template *t;
+     const void *msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr;
+     int flags;
+{
+  int hlen;
+
+  if ((hlen = raw_build_headers (buf, buflen, t, msg, msglen,
+				 payload_sum, saddr, flags)) == -1)
+    return -1;
+  memcpy ((unsigned char *) buf + hlen, msg, msglen);
+  return hlen + msglen;
+}
+
+/*
+ raw_send_with_template(s, t, msg, msglen, payload_sum, saddr, flags)
+
+ Send MSG to the receiver described by template T, from SADDR.  If
+ FLAGS include RAWSEND_COMPUTE_UDP_CHECKSUM, PAYLOAD_SUM must be
+ raw_payload_sum(MSG, MSGLEN); the UDP checksum is then derived from
+ it and the template's sum by adding the few per-datagram words.
+ */
+int
+raw_send_with_template (s, t, msg, msglen, payload_sum, saddr_generic, flags)
+     int s;
+     const struct raw_send_template *t;
+     const void * msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr_generic;
+     int flags;
+{
   int sockerr;
   socklen_t sockerr_size = sizeof sockerr;
-  struct sockaddr_in dest_a;
-  struct ip ih;
-  struct udphdr uh;
-
 #ifdef HAVE_SYS_UIO_H
+  struct raw_headers h;
+  int ihlen;
   struct msghdr mh;
   struct iovec iov[3];
 #else /* not HAVE_SYS_UIO_H */
-  int flags = 0;
   static char *msgbuf = 0;
   static size_t msgbuflen = 0;
   static size_t next_alloc_size = 1;
+  size_t length = msglen + sizeof (struct raw_headers);
+  int n;
 #endif /* not HAVE_SYS_UIO_H */
 
-  uh.uh_sport = saddr->sin_port;
-  uh.uh_dport = daddr->sin_port;
-  uh.uh_ulen = htons (msglen + sizeof uh);
-  uh.uh_sum = flags & RAWSEND_COMPUTE_UDP_CHECKSUM
-    ? udp_sum_calc (msglen,
-		    ntohl(saddr->sin_addr.s_addr),
-		    ntohs(saddr->sin_port),
-		    ntohl(daddr->sin_addr.s_addr),
-		    ntohs(daddr->sin_port),
-		    msg)
-    : 0;
+#ifdef HAVE_SYS_UIO_H
+  if ((ihlen = fill_headers (&h, t, msg, msglen, payload_sum,
+			     saddr_generic, flags)) == -1)
+    return -1;
+  iov[0].iov_base = (char *) &h.ih;
+  iov[0].iov_len = ihlen;
+  iov[1].iov_base = (char *) &h.uh;
+  iov[1].iov_len = sizeof h.uh;
+  iov[2].iov_base = (char *) msg;
+  iov[2].iov_len = msglen;
 
-  length = msglen + sizeof uh + sizeof ih;
-#ifndef HAVE_SYS_UIO_H
+  bzero ((char *) &mh, sizeof mh);
+  mh.msg_name = (char *) &t->dest;
+  mh.msg_namelen = t->destlen;
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 3;
+
+  if (sendmsg (s, &mh, 0) == -1)
+#else /* not HAVE_SYS_UIO_H */
   if (length > msgbuflen)
     {
       if (length > MAX_IP_DATAGRAM_SIZE)
@@ -111,77 +523,31 @@ raw_send_from_to (s, msg, msglen, saddr_generic, daddr_generic, ttl, flags)
       msgbuflen = next_alloc_size;
       next_alloc_size *= 2;
     }
-#endif /* not HAVE_SYS_UIO_H */
-  ih.ip_hl = (sizeof ih+3)/4;
-  ih.ip_v = 4;
-  ih.ip_tos = 0;
-  /* Depending on the target platform, te ip_off and ip_len fields
-     should be in either host or network byte order.  Usually
-     BSD-derivatives require host byte order, but at least OpenBSD
-     since version 2.1 and FreeBSD since 11.0 use network byte
-     order.  Linux uses network byte order for all IP header fields. */
-#if defined (__linux__) || (defined (__OpenBSD__) && (OpenBSD > 199702)) || (defined (__FreeBSD_version) && (__FreeBSD_version > 1100030))
-  ih.ip_len = htons (length);
-  ih.ip_off = htons (0);
-#else 
-  ih.ip_len = length;
-  ih.ip_off = 0;
-#endif
-  ih.ip_id = htons (0);
-  ih.ip_ttl = ttl;
-  ih.ip_p = 17;
-  ih.ip_sum = htons (0);
-  ih.ip_src.s_addr = saddr->sin_addr.s_addr;
-  ih.ip_dst.s_addr = daddr->sin_addr.s_addr;
-
-  /* At least on Solaris, it seems clear that even the raw IP datagram
-     transmission code will actually compute the IP header checksum
-     for us.  Probably this is the case for all other systems on which
-     this code works, so maybe we should just set the checksum to zero
-     to avoid duplicate work.  I'm not even sure whether my IP
-     checksum computation in ip_header_checksum() below is correct. */
-  ih.ip_sum = ip_header_checksum (&ih);
-
-  dest_a.sin_family = AF_INET;
-  dest_a.sin_port = daddr->sin_port;
-  dest_a.sin_addr.s_addr = daddr->sin_addr.s_addr;
+  if ((n = raw_build_datagram (msgbuf, msgbuflen, t, msg, msglen,
+			       payload_sum, saddr_generic, flags)) == -1)
+    return -1;
 
-#ifdef HAVE_SYS_UIO_H
-  iov[0].iov_base = (char *) &ih;
-  iov[0].iov_len = sizeof ih;
-  iov[1].iov_base = (char *) &uh;
-  iov[1].iov_len = sizeof uh;
-  iov[2].iov_base = (char *) msg;
-  iov[2].iov_len = msglen;
-
-  bzero ((char *) &mh, sizeof mh);
-  mh.msg_name = (char *)&dest_a;
-  mh.msg_namelen = sizeof dest_a;
-  mh.msg_iov = iov;
-  mh.msg_iovlen = 3;
-
-  if (sendmsg (s, &mh, 0) == -1)
-#else /* not HAVE_SYS_UIO_H */
-  memcpy (msgbuf+sizeof ih+sizeof uh, msg, msglen);
-  memcpy (msgbuf+sizeof ih, & uh, sizeof uh);
-  memcpy (msgbuf, & ih, sizeof ih);
-
-  if (sendto (s, msgbuf, length, flags,
-	      (struct sockaddr *)&dest_a, sizeof dest_a) == -1)
+  if (sendto (s, msgbuf, n, 0,
+	      (struct sockaddr *) &t->dest, t->destlen) == -1)
 #endif /* not HAVE_SYS_UIO_H */
     {
+      int saved_errno = errno;
+
+      /* A full send buffer on a non-blocking socket is not an error;
+	 the caller will queue the datagram and try again later. */
+      if (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK)
+	return -1;
       if (getsockopt (s, SOL_SOCKET, SO_ERROR, (char *) &sockerr, &sockerr_size) == 0)
 	{
 	  fprintf (stderr, "socket error: %d\n", sockerr);
 	  fprintf (stderr, "socket: %s\n",
-		   strerror (errno));
+		   strerror (saved_errno));
 	}
+      errno = saved_errno;
       return -1;
     }
   return 0;
 }
-#undef saddr
-#undef daddr
 
 extern int
 make_raw_udp_socket (sockbuflen, af)
@@ -189,12 +555,8 @@ make_raw_udp_socket (sockbuflen, af)
      int af;
 {
   int s;
-  if (af == AF_INET6)
-    {
-      fprintf (stderr, "Spoofing not supported for IPv6\n");
-      return -1;
-    }
-  if ((s = socket (PF_INET, SOCK_RAW, IPPROTO_RAW)) == -1)
+  if ((s = socket (af == AF_INET6 ? PF_INET6 : PF_INET,
+		   SOCK_RAW, IPPROTO_RAW)) == -1)
     return s;
   if (sockbuflen != -1)
     {
@@ -206,6 +568,20 @@ make_raw_udp_socket (sockbuflen, af)
 	}
     }
 
+  if (af == AF_INET6)
+    {
+#ifdef IPV6_HDRINCL
+      /* Linux implies this for IPPROTO_RAW sockets, but say it
+	 anyway. */
+      int on = 1;
+      if (setsockopt (s, IPPROTO_IPV6, IPV6_HDRINCL, (char *) &on, sizeof(on)) < 0)
+	{
+	  fprintf (stderr, "setsockopt(IPV6_HDRINCL,%d): %s\n",
+		   on, strerror (errno));
+	}
+#endif /* IPV6_HDRINCL */
+      return s;
+    }
 #ifdef IP_HDRINCL
   /* Some BSD-derived systems require the IP_HDRINCL socket option for
      header spoofing.  Contributed by Vladimir A. Jakovenko
@@ -222,113 +598,3 @@ make_raw_udp_socket (sockbuflen, af)
  
   return s;
 }
-
-/* unsigned ip_header_checksum (header)
-
-   Compute IP header checksum IN NETWORK BYTE ORDER.
-
-   This is defined in RFC 760 as "the 16 bit one's complement of the
-   one's complement sum of all 16 bit words in the header.  For
-   purposes of computing the checksum, the value of the checksum field
-   is zero.".
-*/
-static unsigned
-ip_header_checksum (const void * header)
-{
-  unsigned long csum = 0;
-  unsigned size = ((struct ip *) header)->ip_hl;
-  uint16_t *h = (uint16_t *) header;
-  unsigned k;
-
-  /* Interestingly, we don't need to convert between network and host
-     byte order because of the way the checksum is defined. */
-  for (k = 0; k < size; ++k)
-    {
-      csum += *h++, csum += *h++;
-    }
-  while (csum > 0xffff)
-    {
-      csum = (csum & 0xffff) + (csum >> 16);
-    }
-  return ~csum & 0xffff;
-}
-
-uint16_t udp_sum_calc( uint16_t len_udp,
-		  uint32_t src_addr,
-		  uint16_t src_port,
-		  uint32_t dest_addr,
-		  uint16_t dest_port,
-		  const void * buff
-		)
-{
-	uint16_t prot_udp        = 17;
-	uint16_t chksum_init     = 0;
-	uint16_t udp_len_total   = 0;
-	uint32_t sum             = 0;
-	uint16_t pad             = 0;
-	uint16_t low;
-	uint16_t high;
-	int i;
-
-	/* if we have an odd number of bytes in the data payload, then set the pad to 1
-	 * for special processing
-	 */
-	if( len_udp%2 != 0 ) {
-	  pad = 1;
-	}
-	/* do the source and destination addresses, first, we have to split them
-	 * into 2 shorts instead of the 32 long as sent.  Sorry, that's just how they
-	 * calculate
-	 */
-	low  = src_addr;
-	high = ( src_addr>>16 );
-	sum  += ( ( uint32_t ) high + ( uint32_t ) low );
-
-	/* now do the same with the destination address */
-	low  = dest_addr;
-	high = ( dest_addr>>16 );
-	sum  += ( ( uint32_t ) high + ( uint32_t ) low );
-
-	/* the protocol and the number and the length of the UDP packet */
-	udp_len_total = len_udp + 8;  /* length sent is length of data, need to add 8 */
-	sum += ( ( uint32_t )prot_udp + ( uint32_t )udp_len_total );
-
-
-	/* next comes the source and destination ports */
-	sum += ( ( uint32_t )src_port + ( uint32_t ) dest_port );
-
-	/* Now add the UDP length and checksum=0 bits 
-	 * The Length will always be 8 bytes plus the length of the udp data sent
-	 * and the checksum will always be zero
-	 */
-	sum += ( ( uint32_t ) udp_len_total + ( uint32_t ) chksum_init );
-        
-
-	/* Add all 16 bit words to the sum, if pad is set (ie, odd data length) this will just read up
-	 * to the last full 16 bit word.
-	 * */
-        for( i=0; i< ( len_udp - pad ); i+=2 ) {
-          high  = ntohs(*(uint16_t *)buff);
-	  buff +=2;
-	  sum  += ( uint32_t ) high;
-	}
-
-	/* ok, if pad is true, then the pointer is now  right before the last single byte in 
-	 * the payload.  We only need to add till the end of the string (1-byte) , not the next 2 bytes
-	 * as above.
-	 */
-	if( pad ) {
-	  sum += ntohs( * ( unsigned char * ) buff );
-	}
-
-	/* keep only the last 16 bits of the 32 bit calculated sum and add the carry overs */
-	while ( sum>>16 ) {
-          sum = ( sum & 0xFFFF ) + ( sum >> 16 );
-	}
-
-	/* one's compliment the sum */
-        sum = ~sum;
-
-	/* finally, return the 16bit network formated checksum */
-        return ((uint16_t) htons(sum) );
-};
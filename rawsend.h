@@ -9,6 +9,8 @@
 
 #define RAWSEND_COMPUTE_UDP_CHECKSUM	0x0001
 
+struct raw_send_template;
+
 extern int make_raw_udp_socket (size_t, int);
 extern int raw_send_from_to (int,
 			     const void *, size_t,
@@ -16,3 +18,26 @@ extern int raw_send_from_to (int,
 			     struct sockaddr *,
 			     int,
 			     int);
+extern struct raw_send_template *make_raw_send_template (const struct sockaddr *,
+							 int);
+extern void init_raw_send_template (struct raw_send_template *,
+				    const struct sockaddr *, int);
+extern int raw_build_headers (void *, size_t,
+			      const struct raw_send_template *,
+			      const void *, size_t,
+			      uint32_t,
+			      const struct sockaddr *,
+			      int);
+extern int raw_build_datagram (void *, size_t,
+			       const struct raw_send_template *,
+			       const void *, size_t,
+			       uint32_t,
+			       const struct sockaddr *,
+			       int);
+extern uint32_t raw_payload_sum (const void *, size_t);
+extern int raw_send_with_template (int,
+				   const struct raw_send_template *,
+				   const void *, size_t,
+				   uint32_t,
+				   const struct sockaddr *,
+				   int);
@@ -21,6 +21,7 @@
 # include <arpa/inet.h>
 #endif
 #include <netdb.h>
+#include <net/if.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -38,18 +39,22 @@
 
 #include "samplicator.h"
 #include "read_config.h"
+#include "groups.h"
 #include "inet.h"
 #include "rawsend.h"
 
 #define PORT_SEPARATOR	'/'
 #define FREQ_SEPARATOR	'/'
 #define TTL_SEPARATOR	','
+#define OPTION_SEPARATOR ';'
 
 #define FLOWPORT "2000"
 
 #define DEFAULT_SOCKBUFLEN 65536
 #define DEFAULT_PDULEN 65536
 
+#define DEFAULT_QUEUE_LIMIT 1000
+
 #define MAX_PEERS 100
 #define MAX_LINELEN 8000
 
@@ -483,6 +488,252 @@ parse_line (ctx, start, end)
   return 0;
 }
 
+/* parse_rate (start, end, ctx, ratep)
+
+   Parse a positive decimal number, optionally followed by one of the
+   suffixes k, m or g (for 10^3, 10^6 and 10^9, respectively).
+ */
+static int
+parse_rate (const char *start,
+	    const char *end,
+	    const struct samplicator_context *ctx,
+	    double *ratep)
+{
+  char *parse_end;
+  double rate = strtod (start, &parse_end);
+
+  if (parse_end < end)
+    {
+      switch (*parse_end)
+	{
+	case 'k': case 'K': rate *= 1e3; ++parse_end; break;
+	case 'm': case 'M': rate *= 1e6; ++parse_end; break;
+	case 'g': case 'G': rate *= 1e9; ++parse_end; break;
+	}
+    }
+  if (parse_end == start || parse_end != end || !(rate > 0))
+    {
+      return parse_error (ctx, "Illegal rate %.*s", (int) (end-start), start);
+    }
+  *ratep = rate;
+  return 0;
+}
+
+static int
+parse_positive_int (const char *start,
+		    const char *end,
+		    const struct samplicator_context *ctx,
+		    const char *what,
+		    unsigned *valuep)
+{
+  char *parse_end;
+  long value = strtol (start, &parse_end, 10);
+
+  if (parse_end == start || parse_end != end || value < 1)
+    {
+      return parse_error (ctx, "Illegal %s %.*s", what, (int) (end-start), start);
+    }
+  *valuep = value;
+  return 0;
+}
+
+/* parse_lladdr (start, end, ctx, lladdr)
+
+   Parse a link-layer (Ethernet) address of the form xx:xx:xx:xx:xx:xx
+   into LLADDR.
+ */
+static int
+parse_lladdr (const char *start,
+	      const char *end,
+	      const struct samplicator_context *ctx,
+	      unsigned char *lladdr)
+{
+  const char *p = start;
+  unsigned k;
+
+  for (k = 0; k < LLADDR_LEN; ++k)
+    {
+      unsigned value = 0, digits;
+
+      if (k > 0 && (p == end || *p++ != ':'))
+	break;
+      for (digits = 0; digits < 2 && p < end && isxdigit (*p); ++digits, ++p)
+	value = value * 16 + (isdigit (*p) ? *p - '0' : tolower (*p) - 'a' + 10);
+      if (digits == 0)
+	break;
+      lladdr[k] = value;
+    }
+  if (k < LLADDR_LEN || p != end)
+    {
+      return parse_error (ctx, "Illegal link-layer address %.*s",
+			  (int) (end-start), start);
+    }
+  return 0;
+}
+
+/* parse_receiver_options (receiverp, start, end, ctx)
+
+   Parse the options that can follow a receiver specification.  Each
+   option is introduced by OPTION_SEPARATOR and has the form
+   NAME=VALUE.  START points to the first separator.
+ */
+static int
+parse_receiver_options (struct receiver *receiverp,
+			const char *start,
+			const char *end,
+			struct samplicator_context *ctx)
+{
+  double pps = 0, bps = 0;
+  unsigned burst_ms = DEFAULT_BURST_MS;
+  int lladdr_p = 0;
+
+  while (start < end && *start == OPTION_SEPARATOR)
+    {
+      const char *name = ++start, *name_end, *value;
+      size_t name_len;
+
+      while (start < end && *start != OPTION_SEPARATOR)
+	++start;
+      for (name_end = name; name_end < start && *name_end != '='; ++name_end)
+	;
+      if (name_end == start)
+	{
+	  return parse_error (ctx, "Missing value for option %.*s",
+			      (int) (start-name), name);
+	}
+      name_len = name_end - name;
+      value = name_end + 1;
+#define OPTION_IS(s) (name_len == sizeof (s) - 1 && strncmp (name, s, name_len) == 0)
+      if (OPTION_IS ("pps"))
+	{
+	  if (parse_rate (value, start, ctx, &pps) != 0)
+	    return -1;
+	}
+      else if (OPTION_IS ("bps"))
+	{
+	  if (parse_rate (value, start, ctx, &bps) != 0)
+	    return -1;
+	}
+      else if (OPTION_IS ("burst"))
+	{
+	  if (parse_positive_int (value, start, ctx, "burst", &burst_ms) != 0)
+	    return -1;
+	}
+      else if (OPTION_IS ("queue"))
+	{
+	  if (parse_positive_int (value, start, ctx, "queue length",
+				  &receiverp->queue_limit) != 0)
+	    return -1;
+	}
+      else if (OPTION_IS ("unit"))
+	{
+	  if (start - value == 7 && strncmp (value, "records", 7) == 0)
+	    receiverp->flags |= pf_RECORDS;
+	  else if (start - value == 9 && strncmp (value, "datagrams", 9) == 0)
+	    receiverp->flags &= ~pf_RECORDS;
+	  else
+	    return parse_error (ctx, "Illegal sampling unit %.*s",
+				(int) (start-value), value);
+	}
+      else if (OPTION_IS ("sampling"))
+	{
+	  if (start - value == 5 && strncmp (value, "count", 5) == 0)
+	    receiverp->sampling = SAMPLING_COUNT;
+	  else if (start - value == 6 && strncmp (value, "random", 6) == 0)
+	    receiverp->sampling = SAMPLING_RANDOM;
+	  else if (start - value == 4 && strncmp (value, "hash", 4) == 0)
+	    receiverp->sampling = SAMPLING_HASH;
+	  else
+	    return parse_error (ctx, "Illegal sampling mode %.*s",
+				(int) (start-value), value);
+	}
+      else if (OPTION_IS ("templates"))
+	{
+	  if (parse_positive_int (value, start, ctx, "template interval",
+				  &receiverp->template_interval) != 0)
+	    return -1;
+	}
+      else if (OPTION_IS ("group"))
+	{
+	  if (start == value)
+	    return parse_error (ctx, "Empty group name");
+	  free (receiverp->group_name);
+	  if ((receiverp->group_name = malloc (start - value + 1)) == 0)
+	    return parse_error (ctx, "Out of memory");
+	  memcpy (receiverp->group_name, value, start - value);
+	  receiverp->group_name[start - value] = 0;
+	}
+      else if (OPTION_IS ("hash"))
+	{
+	  if (start - value == 4 && strncmp (value, "flow", 4) == 0)
+	    receiverp->flags |= pf_HASH_FLOW;
+	  else if (start - value == 8 && strncmp (value, "exporter", 8) == 0)
+	    receiverp->flags &= ~pf_HASH_FLOW;
+	  else
+	    return parse_error (ctx, "Illegal group hash %.*s",
+				(int) (start-value), value);
+	}
+      else if (OPTION_IS ("health"))
+	{
+	  if (parse_positive_int (value, start, ctx, "health port",
+				  &receiverp->health_port) != 0)
+	    return -1;
+	  if (receiverp->health_port > 65535)
+	    return parse_error (ctx, "Illegal health port %u",
+				receiverp->health_port);
+	}
+      else if (OPTION_IS ("drop"))
+	{
+	  if (start - value == 4 && strncmp (value, "head", 4) == 0)
+	    receiverp->flags |= pf_DROP_HEAD;
+	  else if (start - value == 4 && strncmp (value, "tail", 4) == 0)
+	    receiverp->flags &= ~pf_DROP_HEAD;
+	  else
+	    return parse_error (ctx, "Illegal drop policy %.*s",
+				(int) (start-value), value);
+	}
+      else if (OPTION_IS ("dev"))
+	{
+	  char name[IF_NAMESIZE];
+
+	  if (start - value >= IF_NAMESIZE || start == value)
+	    return parse_error (ctx, "Illegal interface name %.*s",
+				(int) (start-value), value);
+	  memcpy (name, value, start - value);
+	  name[start - value] = 0;
+	  if ((receiverp->ifindex = if_nametoindex (name)) == 0)
+	    return parse_error (ctx, "Unknown interface %s", name);
+	}
+      else if (OPTION_IS ("lladdr"))
+	{
+	  if (parse_lladdr (value, start, ctx, receiverp->lladdr) != 0)
+	    return -1;
+	  lladdr_p = 1;
+	}
+      else
+	{
+	  return parse_error (ctx, "Unknown receiver option %.*s",
+			      (int) name_len, name);
+	}
+#undef OPTION_IS
+    }
+  if (receiverp->ifindex != 0 && !lladdr_p)
+    {
+      return parse_error (ctx, "Option dev requires lladdr");
+    }
+  if ((receiverp->flags & pf_HASH_FLOW) && receiverp->group_name == 0)
+    {
+      return parse_error (ctx, "Option hash requires group");
+    }
+  if (pps > 0 || bps > 0)
+    {
+      init_rate_limit (&receiverp->pps_limit, pps, burst_ms, 1);
+      init_rate_limit (&receiverp->bps_limit, bps, burst_ms, 65535*8);
+      receiverp->flags |= pf_PACED;
+    }
+  return 0;
+}
+
 static int
 parse_receiver (struct receiver *receiverp,
 		const char *arg,
@@ -490,14 +741,19 @@ parse_receiver (struct receiver *receiverp,
 {
   const char *start, *end;
   const char *host_start, *host_end;
+  const char *options;
   char portspec[NI_MAXSERV];
   struct addrinfo hints, *res;
   int result;
 
   receiverp->flags = ctx->default_receiver_flags;
-  receiverp->freqcount = 0;
   receiverp->freq = 1;
   receiverp->ttl = DEFAULT_TTL; 
+  receiverp->queue_limit = DEFAULT_QUEUE_LIMIT;
+  receiverp->template_interval = 0;
+  receiverp->sampling = SAMPLING_COUNT;
+  receiverp->group_name = 0;
+  receiverp->health_port = 0;
 
   start = arg; end = start + strlen (arg);
   while (start < end && isspace (*start))
@@ -505,6 +761,16 @@ parse_receiver (struct receiver *receiverp,
   while (start < end && isspace (*(end-1)))
     --end;
 
+  /* split off any options */
+  for (options = start; options < end && *options != OPTION_SEPARATOR; ++options)
+    ;
+  if (options < end)
+    {
+      if (parse_receiver_options (receiverp, options, end, ctx) != 0)
+	return -1;
+      end = options;
+    }
+
   if (start < end && *start == '[')
     {
       host_end = host_start = start+1;
@@ -633,8 +899,13 @@ expand_port_ranges (argc, argv, exp_argc, exp_argv)
       else
       {
          char *range_start=NULL, *inc_start=NULL;
+         char *options=strchr (port_begin, OPTION_SEPARATOR);
          range_start=strchr (port_begin, '-');
          inc_start=strchr (port_begin, '+');
+         if (options && range_start > options)
+             range_start=NULL;
+         if (options && inc_start > options)
+             inc_start=NULL;
          if (!range_start && !inc_start)
              just_copy=1;
          else
@@ -687,6 +958,102 @@ expand_port_ranges (argc, argv, exp_argc, exp_argv)
   return 0;
 }
 
+/* make_receiver_groups (sctx, ctx)
+
+   Collect the receivers of SCTX that have the same group= option into
+   groups, see groups.c.
+ */
+static int
+make_receiver_groups (struct source_context *sctx,
+		      struct samplicator_context *ctx)
+{
+  struct receiver_group *group;
+  unsigned i, k;
+
+  for (i = 0; i < sctx->nreceivers; ++i)
+    if (sctx->receivers[i].group_name != 0)
+      break;
+  if (i == sctx->nreceivers)
+    return 0;
+  if ((sctx->groups = calloc (sctx->nreceivers,
+			      sizeof (struct receiver_group))) == 0)
+    return parse_error (ctx, "Out of memory");
+  for (; i < sctx->nreceivers; ++i)
+    {
+      struct receiver *receiver = &sctx->receivers[i];
+
+      if (receiver->group_name == 0)
+	continue;
+      for (k = 0; k < sctx->ngroups; ++k)
+	if (strcmp (sctx->groups[k].name, receiver->group_name) == 0)
+	  break;
+      group = &sctx->groups[k];
+      if (k == sctx->ngroups)
+	{
+	  group->name = receiver->group_name;
+	  group->flow_p = (receiver->flags & pf_HASH_FLOW) != 0;
+	  ++sctx->ngroups;
+	}
+      else if (group->flow_p != ((receiver->flags & pf_HASH_FLOW) != 0))
+	return parse_error (ctx, "Receivers of group %s disagree on hash",
+			    group->name);
+      receiver->group = group;
+      receiver->group_key = receiver_group_member_key (receiver);
+      ++group->nmembers;
+    }
+  for (k = 0; k < sctx->ngroups; ++k)
+    {
+      group = &sctx->groups[k];
+      if ((group->members = calloc (group->nmembers,
+				    sizeof (struct receiver *))) == 0)
+	return parse_error (ctx, "Out of memory");
+      group->nmembers = 0;
+    }
+  for (i = 0; i < sctx->nreceivers; ++i)
+    if ((group = sctx->receivers[i].group) != 0)
+      group->members[group->nmembers++] = &sctx->receivers[i];
+  return 0;
+}
+
+/* check_health_ports (sctx, ctx)
+
+   Refuse receivers of SCTX that have the same address and port as
+   an earlier receiver, but a different health= option: they share
+   their liveness state (see health.c), which can only be probed one
+   way.
+*/
+static int
+check_health_ports (struct source_context *sctx,
+		    const struct samplicator_context *ctx)
+{
+  const struct source_context *other;
+  unsigned i, k;
+
+  for (i = 0; i < sctx->nreceivers; ++i)
+    {
+      const struct receiver *a = &sctx->receivers[i];
+
+      for (other = ctx->sources; ; other = other->next)
+	{
+	  unsigned n = other == 0 ? i : other->nreceivers;
+
+	  for (k = 0; k < n; ++k)
+	    {
+	      const struct receiver *b
+		= other == 0 ? &sctx->receivers[k] : &other->receivers[k];
+
+	      if (a->addrlen == b->addrlen
+		  && memcmp (&a->addr, &b->addr, a->addrlen) == 0
+		  && a->health_port != b->health_port)
+		return parse_error (ctx, "Receivers with the same address"
+				    " and port disagree on health");
+	    }
+	  if (other == 0)
+	    break;
+	}
+    }
+  return 0;
+}
 
 int
 parse_receivers (argc, argv, ctx, sctx)
@@ -718,7 +1085,20 @@ parse_receivers (argc, argv, ctx, sctx)
 	{
 	  return -1;
 	}
+      sctx->receivers[i].sample_threshold
+	= ((uint64_t) 1 << 32) / sctx->receivers[i].freq;
+      /* The -x transmit delay is implemented by pacing each receiver
+	 that doesn't have a rate limit of its own. */
+      if (sctx->tx_delay != 0 && !(sctx->receivers[i].flags & pf_PACED))
+	{
+	  init_rate_limit (&sctx->receivers[i].pps_limit,
+			   1e6 / sctx->tx_delay, 0, 1);
+	  sctx->receivers[i].flags |= pf_PACED;
+	}
     }
+  if (make_receiver_groups (sctx, ctx) != 0
+      || check_health_ports (sctx, ctx) != 0)
+    return -1;
   if (ctx->sources == NULL)
     {
       ctx->sources = sctx;
@@ -758,17 +1138,26 @@ parse_args (argc, argv, ctx)
 
   ctx->sockbuflen = DEFAULT_SOCKBUFLEN;
   ctx->pdulen = DEFAULT_PDULEN;
+  ctx->batch_size = 1;
+  ctx->nworkers = 1;
   ctx->faddr_spec = 0;
   bzero (&ctx->faddr, sizeof ctx->faddr);
   ctx->fport_spec = FLOWPORT;
+  ctx->capture_dev = 0;
+  ctx->xdp_dev = 0;
+  ctx->io_uring = 0;
   ctx->debug = 0;
   ctx->timeout = 0;
   ctx->ipv4_only = 0;
   ctx->ipv6_only = 0;
   ctx->fork = 0;
   ctx->pid_file = (const char *) 0;
+  ctx->stats_socket = (const char *) 0;
+  ctx->stats_fd = -1;
   ctx->sources = 0;
   ctx->default_receiver_flags = pf_CHECKSUM;
+  ctx->stats = 0;
+  ctx->stats_generation = 0;
   /* assume that command-line supplied receivers want to get all data */
   sctx->source.ss_family = AF_INET;
   ((struct sockaddr_in *) &sctx->source)->sin_addr.s_addr = 0;
@@ -777,7 +1166,7 @@ parse_args (argc, argv, ctx)
   sctx->tx_delay = 0;
 
   optind = 1;
-  while ((i = getopt (argc, (char **) argv, "hu:b:d:t:m:p:s:x:c:fSn46")) != -1)
+  while ((i = getopt (argc, (char **) argv, "hu:b:B:d:t:m:p:s:i:X:Iw:x:c:U:fSn46")) != -1)
     {
       switch (i)
 	{
@@ -787,6 +1176,14 @@ parse_args (argc, argv, ctx)
 	case 'u': /* pdu length */
 	  ctx->pdulen = atol (optarg);
 	  break;
+	case 'B': /* receive batch size */
+	  ctx->batch_size = atoi (optarg);
+	  if (ctx->batch_size < 1)
+	    {
+	      fprintf (stderr, "Illegal batch size %s\n", optarg);
+	      return -1;
+	    }
+	  break;
 	case 'd': /* debug */
 	  ctx->debug = atoi (optarg);
 	  break;
@@ -802,9 +1199,29 @@ parse_args (argc, argv, ctx)
 	case 'm': /* make PID file */
 	  ctx->pid_file = optarg;
 	  break;
+	case 'U': /* statistics socket */
+	  ctx->stats_socket = optarg;
+	  break;
 	case 's': /* flow address */
 	  ctx->faddr_spec = optarg;
 	  break;
+	case 'i': /* capture interface */
+	  ctx->capture_dev = optarg;
+	  break;
+	case 'X': /* AF_XDP interface */
+	  ctx->xdp_dev = optarg;
+	  break;
+	case 'I': /* io_uring */
+	  ctx->io_uring = 1;
+	  break;
+	case 'w': /* worker threads */
+	  ctx->nworkers = atoi (optarg);
+	  if (ctx->nworkers < 1)
+	    {
+	      fprintf (stderr, "Illegal number of workers %s\n", optarg);
+	      return -1;
+	    }
+	  break;
 	case 'x': /* transmit delay */
 	  sctx->tx_delay = atoi (optarg);
 	  break;
@@ -838,6 +1255,16 @@ parse_args (argc, argv, ctx)
 	}
     }
 
+  if (ctx->capture_dev != 0 && ctx->xdp_dev != 0)
+    {
+      fprintf (stderr, "Options -i and -X cannot be used together\n");
+      return -1;
+    }
+  if (ctx->io_uring && (ctx->capture_dev != 0 || ctx->xdp_dev != 0))
+    {
+      fprintf (stderr, "Option -I cannot be used with -i or -X\n");
+      return -1;
+    }
   if (argc - optind > 0)
     {
       if (parse_receivers (argc - optind, argv + optind, ctx, sctx) == -1)
@@ -846,6 +1273,8 @@ parse_args (argc, argv, ctx)
 	  return -1;
 	}
     }
+  else
+    free (sctx);
   return 0;
 }
 
@@ -865,30 +1294,70 @@ Supported options:\n\
 \n\
   -p <port>                UDP port to accept flows on (default %s)\n\
   -s <address>             Interface address to accept flows on (default any)\n\
+  -i <interface>           capture flows to the port from a packet socket ring\n\
+                           on this interface instead of receiving them on a\n\
+                           UDP socket\n\
+  -X <interface>           receive flows to the port through AF_XDP sockets on\n\
+                           this interface, and send spoofed copies to dev=\n\
+                           receivers on it the same way\n\
+  -I                       receive flows and send copies to receivers without\n\
+                           -S through an io_uring\n\
   -d <level>               debug level\n\
   -t <timeout_ms>          Exit with RC 5 if no data is received for this\n\
                            amount of milliseconds\n\
   -b <size>                set socket buffer size (default %lu)\n\
-  -n			   don't compute UDP checksum (leave at 0)\n\
+  -n			   don't compute UDP checksum (leave at 0, IPv4 only)\n\
   -S                       maintain (spoof) source addresses\n\
-  -x <delay>               transmit delay in microseconds\n\
+  -x <delay>               transmit delay in microseconds (paces each receiver\n\
+                           given on the command line to one datagram per delay)\n\
   -c <configfile>          specify a config file to read\n\
   -f                       fork program into background\n\
   -m <pidfile>             write process ID to file\n\
+  -U <path>                serve statistics on a Unix domain socket\n\
   -4                       IPv4 only\n\
   -6                       IPv6 only\n\
   -h                       print this usage message and exit\n\
   -u <pdulen>              size of max pdu on listened socket (default 65536)\n\
+  -B <count>               receive up to this many datagrams per system call\n\
+                           (default 1)\n\
+  -w <workers>             number of receiving/forwarding threads (default 1)\n\
 \n\
 Specifying receivers:\n\
 \n\
-  A.B.C.D[%cport[%cfreq][%cttl]]...\n\
+  A.B.C.D[%cport[%cfreq][%cttl]][%coption=value...]...\n\
 where:\n\
   A.B.C.D                  is the receiver's IP address\n\
   port                     is the UDP port to send to (default %s)\n\
   freq                     is the sampling rate (default 1)\n\
   ttl                      is the outgoing packets' TTL value (default %d)\n\
 \n\
+Receiver options:\n\
+  pps=<rate>               send at most <rate> packets per second\n\
+  bps=<rate>               send at most <rate> bits per second (k/m/g suffixes)\n\
+  burst=<ms>               allow bursts of <ms> milliseconds of traffic (default %d)\n\
+  queue=<count>            queue up to <count> datagrams (default %d)\n\
+  drop=tail|head           when the queue is full, drop the new datagram (tail)\n\
+                           or the oldest queued one (head) (default tail)\n\
+  unit=datagrams|records   sample 1-in-freq datagrams, or 1-in-freq NetFlow\n\
+                           v5/v9 or IPFIX records (default datagrams)\n\
+  sampling=count|random|hash\n\
+                           pick every freq-th one (count), one in freq at\n\
+                           random, or one in freq by a hash of exporter and\n\
+                           sequence number (default count)\n\
+  templates=<seconds>      send the exporter's NetFlow v9/IPFIX templates when\n\
+                           they change, and every <seconds>\n\
+  group=<name>             send each datagram to just one of the receivers\n\
+                           with the same group on this line, chosen by a hash\n\
+                           of the exporter's address\n\
+  hash=exporter|flow       with group, split NetFlow v5/v9 and IPFIX datagrams\n\
+                           by a hash of each record's flow key (flow)\n\
+                           (default exporter)\n\
+  health=<port>            consider the receiver down unless it accepts TCP\n\
+                           connections on <port>\n\
+  dev=<interface>          with -S, send through a packet socket transmit ring\n\
+                           on <interface>; requires lladdr\n\
+  lladdr=<address>         Ethernet address of the next hop for dev\n\
+\n\
 The port can be a number, a range, or a number plus the number of instances:\n\
   7000                     means port 7000\n\
   7000-7010                means from port 7000 to 7010 (both inclusive)\n\
@@ -907,7 +1376,8 @@ specified in the config-file will get only packets with a matching source.\n\n\
 ",
 	   progname,
 	   FLOWPORT, (unsigned long) DEFAULT_SOCKBUFLEN,
-	   PORT_SEPARATOR, FREQ_SEPARATOR, TTL_SEPARATOR,
+	   PORT_SEPARATOR, FREQ_SEPARATOR, TTL_SEPARATOR, OPTION_SEPARATOR,
 	   FLOWPORT,
-	   DEFAULT_TTL);
+	   DEFAULT_TTL,
+	   DEFAULT_BURST_MS, DEFAULT_QUEUE_LIMIT);
 }
@@ -0,0 +1,562 @@
+/*
+ records.c
+
+ Date Created: Fri Oct 23 09:41:26 2026
+
+ Record-level sampling for the unit=records receiver option.
+
+ A NetFlow or IPFIX datagram bundles many flow records, often from
+ different interfaces of the exporter, so forwarding every Nth
+ datagram is a poor sample of the flows.  Instead, a receiver with
+ unit=records gets every Nth flow record, repacked into datagrams of
+ its own.  The header of each such datagram is fixed up to match its
+ contents:
+
+ - NetFlow v5: the record count, the flow sequence number (counting
+   the records sent to the receiver), and the sampling interval,
+   which is multiplied by N.
+
+ - NetFlow v9: the record count, and the sequence number (counting
+   the datagrams sent to the receiver).
+
+ - IPFIX: the message length, and the sequence number (counting the
+   data records sent to the receiver).
+
+ The sequence numbers are kept per receiver in the template scope of
+ the exporter (see templates.c).  Template sets, options template
+ sets and data sets described by options templates are always
+ forwarded.  The records of a v9 or IPFIX data set can only be told
+ apart when its template is known and has no variable-length fields;
+ otherwise, the set is sampled as a whole.
+
+ The same machinery splits datagrams among the members of a receiver
+ group with hash=flow (see groups.c): each record is assigned to one
+ member by a hash of its flow key, its addresses, ports and protocol
+ (record_sampler_assign()), and each member gets a datagram with its
+ own records, plus all template sets.
+
+ A datagram is taken apart once (record_sampler_parse()), and then
+ sampled for each receiver (record_sampler_select()).  The received
+ datagram itself is left alone, since other receivers may still be
+ sending it, and with -I, -i or -X it is in memory shared with the
+ kernel.  The sampled datagrams are written to an arena of buffers
+ that belongs to the worker, and is reused from batch to batch once
+ the sends of the previous batch are done (record_sampler_reset()),
+ so that in the steady state, no memory is allocated.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <string.h>
+#include <stdint.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+# ifndef HAVE_MEMCPY
+#  define memcpy(d, s, n) bcopy ((s), (d), (n))
+# endif
+#endif
+
+#include "samplicator.h"
+#include "hashing.h"
+#include "sampling.h"
+#include "templates.h"
+#include "records.h"
+
+#define NETFLOW_V5_HEADER_LEN 24
+#define NETFLOW_V5_RECORD_LEN 48
+#define NETFLOW_V9_HEADER_LEN 20
+#define IPFIX_HEADER_LEN 16
+#define MIN_DATA_SET_ID 256
+
+/* The flow key of NetFlow v5 records: srcaddr, dstaddr, srcport,
+   dstport and prot. */
+static const struct flow_key v5_flow_key = {
+  { 0, 4, 32, 34, 38 },
+  { 4, 4, 2, 2, 1 }
+};
+
+/* The size of the arena's chunks; a sampled datagram is never larger
+   than a UDP datagram, plus some padding. */
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+enum set_kind
+{
+  SET_KEEP,			/* forwarded as is */
+  SET_RECORDS,			/* RECORD_LEN bytes per record */
+  SET_WHOLE,			/* sampled as a unit */
+};
+
+/* A set (FlowSet in NetFlow v9) of the datagram being sampled, of LEN
+   bytes at offset OFF.  The records of a SET_RECORDS set start after
+   a set header of HDRLEN bytes (zero for the records of a v5
+   datagram).  NRECORDS is the number of records in the set, as the
+   NetFlow v9 header counts them, and NDATA the number of data records,
+   as IPFIX sequence numbers count them; COUNTED_P is zero if these
+   are not known (see count_unknown_records()).  The records of a
+   SET_RECORDS set are units UNIT and up for record_sampler_assign();
+   a SET_WHOLE set is a single unit. */
+struct set {
+  enum set_kind			kind;
+  unsigned			off;
+  unsigned			len;
+  unsigned			hdrlen;
+  unsigned			record_len;
+  unsigned			nrecords;
+  unsigned			ndata;
+  int				counted_p;
+  unsigned			unit;
+  struct flow_key		key;
+};
+
+struct arena_chunk {
+  struct arena_chunk	       *next;
+  size_t			used;
+  unsigned char			data[ARENA_CHUNK_SIZE];
+};
+
+struct record_sampler {
+  /* the datagram being sampled */
+  struct template_scope	       *scope;
+  const unsigned char	       *data;
+  size_t			len;
+  unsigned			version;
+  unsigned			hdrlen;
+  struct set		       *sets;
+  unsigned			nsets;
+  unsigned			max_sets;
+
+  /* the member of a receiver group that each unit is assigned to */
+  unsigned			nunits;
+  unsigned			max_units;
+  uint16_t		       *members;
+
+  /* chunks in use, the current one first; and reusable ones */
+  struct arena_chunk	       *chunks;
+  struct arena_chunk	       *free_chunks;
+};
+
+struct record_sampler *
+make_record_sampler ()
+{
+  return calloc (1, sizeof (struct record_sampler));
+}
+
+static struct set *
+add_set (struct record_sampler *rs, enum set_kind kind,
+	 unsigned off, unsigned len)
+{
+  struct set *set;
+
+  if (rs->nsets == rs->max_sets)
+    {
+      unsigned max = rs->max_sets ? rs->max_sets * 2 : 16;
+
+      if ((set = realloc (rs->sets, max * sizeof (struct set))) == 0)
+	return 0;
+      rs->sets = set;
+      rs->max_sets = max;
+    }
+  set = &rs->sets[rs->nsets++];
+  set->kind = kind;
+  set->off = off;
+  set->len = len;
+  set->hdrlen = 0;
+  set->record_len = 0;
+  set->nrecords = set->ndata = 0;
+  set->counted_p = 1;
+  set->unit = rs->nunits;
+  if (kind == SET_WHOLE)
+    ++rs->nunits;
+  return set;
+}
+
+/* NetFlow v9 sets whose template is not known yet have an unknown
+   number of records.  Together, they have the records that the header
+   counts beyond those of the other sets, which are shared out among
+   them by their length. */
+static void
+count_unknown_records (struct record_sampler *rs, unsigned total)
+{
+  unsigned k, known = 0, unknown_len = 0, remaining;
+
+  for (k = 0; k < rs->nsets; ++k)
+    if (rs->sets[k].counted_p)
+      known += rs->sets[k].nrecords;
+    else
+      unknown_len += rs->sets[k].len;
+  if (unknown_len == 0)
+    return;
+  remaining = total > known ? total - known : 0;
+  for (k = 0; k < rs->nsets; ++k)
+    {
+      struct set *set = &rs->sets[k];
+
+      if (set->counted_p)
+	continue;
+      set->nrecords = set->ndata
+	= (uint64_t) remaining * set->len / unknown_len;
+      remaining -= set->nrecords;
+      unknown_len -= set->len;
+    }
+}
+
+/*
+ record_sampler_parse(rs, scope, data, len)
+
+ Take apart the datagram DATA of LEN bytes, whose template scope is
+ SCOPE, for record_sampler_select().  Its templates must have been
+ learned already (see template_cache_update()).  Returns 0 on
+ success, and -1 if it cannot be sampled by record, in which case it
+ should be sampled as a whole.
+ */
+int
+record_sampler_parse (rs, scope, data, len)
+     struct record_sampler *rs;
+     struct template_scope *scope;
+     const unsigned char *data;
+     size_t len;
+{
+  unsigned off, set_id, set_len;
+  struct set *set;
+
+  rs->nsets = rs->nunits = 0;
+  rs->scope = scope;
+  rs->data = data;
+  rs->version = get16 (data);
+  rs->hdrlen = 0;
+  switch (rs->version)
+    {
+    case 5:
+      rs->hdrlen = NETFLOW_V5_HEADER_LEN;
+      if (len < rs->hdrlen)
+	return -1;
+      {
+	unsigned n = get16 (data + 2);
+
+	if (n > (len - rs->hdrlen) / NETFLOW_V5_RECORD_LEN)
+	  n = (len - rs->hdrlen) / NETFLOW_V5_RECORD_LEN;
+	if ((set = add_set (rs, SET_RECORDS, rs->hdrlen,
+			    n * NETFLOW_V5_RECORD_LEN)) == 0)
+	  return -1;
+	set->record_len = NETFLOW_V5_RECORD_LEN;
+	set->nrecords = set->ndata = n;
+	set->key = v5_flow_key;
+	rs->nunits += n;
+	rs->len = rs->hdrlen + set->len;
+      }
+      return 0;
+    case 9:
+      rs->hdrlen = NETFLOW_V9_HEADER_LEN;
+      break;
+    case 10:
+      rs->hdrlen = IPFIX_HEADER_LEN;
+      if (get16 (data + 2) < len)
+	len = get16 (data + 2);
+      break;
+    default:
+      return -1;
+    }
+  if (len < rs->hdrlen)
+    return -1;
+  for (off = rs->hdrlen; len - off >= 4; off += set_len)
+    {
+      int options_p, n;
+      unsigned record_len;
+      struct flow_key key;
+
+      set_id = get16 (data + off);
+      set_len = get16 (data + off + 2);
+      if (set_len < 4 || set_len > len - off)
+	return -1;
+      n = template_set_records (scope, set_id, data + off + 4, set_len - 4);
+      if (set_id < MIN_DATA_SET_ID)
+	{
+	  if ((set = add_set (rs, SET_KEEP, off, set_len)) == 0)
+	    return -1;
+	  set->nrecords = n;	/* template records */
+	  continue;
+	}
+      record_len = template_record_length (scope, set_id, &options_p, &key);
+      if ((set = add_set (rs, options_p ? SET_KEEP
+			  : record_len != 0 ? SET_RECORDS : SET_WHOLE,
+			  off, set_len)) == 0)
+	return -1;
+      set->hdrlen = 4;
+      set->record_len = record_len;
+      if (n >= 0)
+	set->nrecords = set->ndata = n;	/* anything after them is padding */
+      else
+	set->counted_p = 0;
+      if (record_len != 0)
+	{
+	  set->key = key;
+	  if (!options_p)
+	    rs->nunits += set->nrecords;
+	}
+    }
+  rs->len = off;		/* without trailing garbage */
+  if (rs->version == 9)
+    count_unknown_records (rs, get16 (data + 2));
+  return 0;
+}
+
+/* A hash of the flow key fields KEY of the record REC. */
+static uint64_t
+flow_key_hash (const unsigned char *rec, const struct flow_key *key)
+{
+  uint64_t h = FNV_OFFSET_BASIS;
+  unsigned k;
+
+  for (k = 0; k < FK_NFIELDS; ++k)
+    h = hash_fnv1a (h, rec + key->off[k], key->len[k]);
+  return h;
+}
+
+/*
+ record_sampler_assign(rs, choose, arg, whole_key)
+
+ Assign each record of the datagram last given to
+ record_sampler_parse() to the member CHOOSE(ARG, HASH) of a receiver
+ group, where HASH is a hash of its flow key.  Sets that cannot be
+ split up are assigned as a whole, using WHOLE_KEY as the hash.
+ Returns 0 on success, and -1 if out of memory.
+ */
+int
+record_sampler_assign (rs, choose, arg, whole_key)
+     struct record_sampler *rs;
+     unsigned (*choose) (const void *, uint64_t);
+     const void *arg;
+     uint64_t whole_key;
+{
+  unsigned k, r;
+
+  if (rs->nunits > rs->max_units)
+    {
+      uint16_t *members = realloc (rs->members,
+				   rs->nunits * sizeof (uint16_t));
+
+      if (members == 0)
+	return -1;
+      rs->members = members;
+      rs->max_units = rs->nunits;
+    }
+  for (k = 0; k < rs->nsets; ++k)
+    {
+      const struct set *set = &rs->sets[k];
+      const unsigned char *rec = rs->data + set->off + set->hdrlen;
+
+      if (set->kind == SET_WHOLE)
+	rs->members[set->unit] = (*choose) (arg, whole_key);
+      else if (set->kind == SET_RECORDS)
+	for (r = 0; r < set->nrecords; ++r, rec += set->record_len)
+	  rs->members[set->unit + r]
+	    = (*choose) (arg, flow_key_hash (rec, &set->key));
+    }
+  return 0;
+}
+
+/* Room for LEN bytes in the arena of RS, or 0 if out of memory. */
+static unsigned char *
+arena_alloc (struct record_sampler *rs, size_t len)
+{
+  struct arena_chunk *c = rs->chunks;
+
+  if (c == 0 || ARENA_CHUNK_SIZE - c->used < len)
+    {
+      if ((c = rs->free_chunks) != 0)
+	rs->free_chunks = c->next;
+      else if ((c = malloc (sizeof (struct arena_chunk))) == 0)
+	return 0;
+      c->used = 0;
+      c->next = rs->chunks;
+      rs->chunks = c;
+    }
+  c->used += len;
+  return c->data + c->used - len;
+}
+
+/*
+ record_sampler_buffer(rs, len)
+
+ Return room for a datagram of LEN bytes in the arena of RS, or 0 if
+ out of memory.  Like the datagrams made by record_sampler_select(),
+ it remains valid until record_sampler_reset().
+ */
+unsigned char *
+record_sampler_buffer (rs, len)
+     struct record_sampler *rs;
+     size_t len;
+{
+  return arena_alloc (rs, len);
+}
+
+/* Give back the unused end of the LEN bytes last allocated from the
+   arena of RS, of which USED have been used. */
+static void
+arena_trim (struct record_sampler *rs, size_t len, size_t used)
+{
+  rs->chunks->used -= len - used;
+}
+
+/*
+ record_sampler_select(rs, receiver, member, sampler, datap)
+
+ Select the records of the datagram last given to
+ record_sampler_parse() that SAMPLER picks for RECEIVER, one in
+ SAMPLER->freq (see sampling.h).  Unless MEMBER is negative, only the
+ records that record_sampler_assign() gave to MEMBER are considered.
+ The resulting datagram is stored in *DATAP, and its length is
+ returned.  It remains valid until record_sampler_reset().  Zero
+ means there is nothing to send to RECEIVER.
+ */
+size_t
+record_sampler_select (rs, receiver, member, sampler, datap)
+     struct record_sampler *rs;
+     const void *receiver;
+     int member;
+     struct sampler *sampler;
+     const unsigned char **datap;
+{
+  unsigned freq = sampler->freq;
+  const unsigned char *data = rs->data;
+  unsigned char *out, *p;
+  unsigned k, r, nsel = 0, ndropped = 0, ndata = 0, nkept = 0;
+  size_t max = rs->len + 3 * rs->nsets;
+
+  if ((out = arena_alloc (rs, max)) == 0)
+    return 0;
+  memcpy (out, data, rs->hdrlen);
+  p = out + rs->hdrlen;
+  for (k = 0; k < rs->nsets; ++k)
+    {
+      const struct set *set = &rs->sets[k];
+      const unsigned char *in = data + set->off;
+      unsigned char *set_start = p;
+      unsigned n = 0;
+
+      switch (set->kind)
+	{
+	case SET_KEEP:
+	  memcpy (p, in, set->len);
+	  p += set->len;
+	  ndata += set->ndata;
+	  ++nkept;
+	  continue;
+	case SET_WHOLE:
+	  if ((member < 0 || rs->members[set->unit] == member)
+	      && sample_p (sampler, set->unit))
+	    {
+	      memcpy (p, in, set->len);
+	      p += set->len;
+	      ndata += set->ndata;
+	      ++nsel;
+	    }
+	  else
+	    ndropped += set->nrecords;
+	  continue;
+	case SET_RECORDS:
+	  break;
+	}
+      p += set->hdrlen;
+      for (r = 0; r < set->nrecords; ++r)
+	{
+	  if (member >= 0 && rs->members[set->unit + r] != member)
+	    continue;
+	  if (sample_p (sampler, set->unit + r))
+	    {
+	      memcpy (p, in + set->hdrlen + r * set->record_len,
+		      set->record_len);
+	      p += set->record_len;
+	      ++n;
+	    }
+	}
+      nsel += n;
+      ndata += n;
+      ndropped += set->nrecords - n;
+      if (set->hdrlen == 0)
+	continue;		/* NetFlow v5 */
+      if (n == 0)
+	{
+	  p = set_start;
+	  continue;
+	}
+      if (rs->version == 9)
+	while ((p - set_start) % 4 != 0)
+	  *p++ = 0;
+      memcpy (set_start, in, 2);
+      put16 (set_start + 2, p - set_start);
+    }
+  if (nsel == 0 && nkept == 0)
+    {
+      arena_trim (rs, max, 0);
+      return 0;
+    }
+  arena_trim (rs, max, p - out);
+
+  switch (rs->version)
+    {
+    case 5:
+      {
+	unsigned interval = get16 (data + 22) & 0x3fff;
+	unsigned mode = get16 (data + 22) >> 14;
+
+	/* Our sampling is deterministic (mode 1), except with
+	   sampling=random (mode 2). */
+	if (mode == 0)
+	  mode = sampler->mode == SAMPLING_RANDOM ? 2 : 1;
+	interval = (interval ? interval : 1) * freq;
+	put16 (out + 2, nsel);
+	put32 (out + 16, template_scope_sequence (rs->scope, receiver,
+						  get32 (data + 16), nsel));
+	/* Records split among a group are not sampled. */
+	if (freq > 1)
+	  put16 (out + 22, (mode << 14)
+		 | (interval < 0x3fff ? interval : 0x3fff));
+      }
+      break;
+    case 9:
+      put16 (out + 2, get16 (data + 2) > ndropped
+	     ? get16 (data + 2) - ndropped : 0);
+      put32 (out + 12, template_scope_sequence (rs->scope, receiver,
+						get32 (data + 12), 1));
+      break;
+    case 10:
+      put16 (out + 2, p - out);
+      put32 (out + 8, template_scope_sequence (rs->scope, receiver,
+					       get32 (data + 8), ndata));
+      break;
+    }
+  *datap = out;
+  return p - out;
+}
+
+/*
+ record_sampler_reset(rs)
+
+ Make the whole arena of RS available again.  The caller must make
+ sure that no sends that refer to the datagrams made by
+ record_sampler_select() are pending.
+ */
+void
+record_sampler_reset (rs)
+     struct record_sampler *rs;
+{
+  struct arena_chunk *c;
+
+  while ((c = rs->chunks) != 0)
+    {
+      rs->chunks = c->next;
+      c->next = rs->free_chunks;
+      rs->free_chunks = c;
+    }
+}
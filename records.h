@@ -0,0 +1,22 @@
+/*
+ records.h
+
+ Date Created: Fri Oct 23 09:41:26 2026
+ */
+
+struct record_sampler;
+struct template_scope;
+struct sampler;
+
+extern struct record_sampler *make_record_sampler (void);
+extern int record_sampler_parse (struct record_sampler *,
+				 struct template_scope *,
+				 const unsigned char *, size_t);
+extern int record_sampler_assign (struct record_sampler *,
+				  unsigned (*) (const void *, uint64_t),
+				  const void *, uint64_t);
+extern size_t record_sampler_select (struct record_sampler *,
+				     const void *, int, struct sampler *,
+				     const unsigned char **);
+extern unsigned char *record_sampler_buffer (struct record_sampler *, size_t);
+extern void record_sampler_reset (struct record_sampler *);
@@ -0,0 +1,429 @@
+/*
+ recordtest.c
+
+ Date Created: Tue Oct 27 10:05:12 2026
+
+ Regression tests for sampling NetFlow v5, v9 and IPFIX datagrams by
+ record (records.c): which records are selected, and how the headers
+ of the resulting datagrams are rewritten.
+
+ Like parsetest, this program outputs a series of numbered "ok" or
+ "fail" lines.  Set a breakpoint at test_fail() to find out what went
+ wrong.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+#endif
+
+#include "samplicator.h"
+#include "sampling.h"
+#include "templates.h"
+#include "records.h"
+
+/* A datagram under construction */
+struct dgram {
+  unsigned char			data[2048];
+  size_t			len;
+  size_t			set;	/* start of the open set, or 0 */
+};
+
+static void make_v5 (struct dgram *, uint32_t);
+static void test_v5 (void);
+static void test_v9 (void);
+static void test_ipfix (void);
+static size_t sample (struct template_scope *, const struct dgram *,
+		      const void *, unsigned, int, const unsigned char **);
+static void init_dgram (struct dgram *, unsigned, unsigned, uint32_t);
+static void add8 (struct dgram *, unsigned);
+static void add16 (struct dgram *, unsigned);
+static void add32 (struct dgram *, uint32_t);
+static void open_set (struct dgram *, unsigned);
+static void close_set (struct dgram *);
+static void close_dgram (struct dgram *);
+static int check_int_equal (long, long);
+static int test_ok (void);
+static int test_fail (void);
+static int test_index = 1;
+
+static struct template_cache *cache;
+static struct record_sampler *rs;
+static struct sockaddr_in exporter;
+
+/* Receivers are only compared by address. */
+static const int receiver_a, receiver_b;
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 1)
+    {
+      fprintf (stderr, "Usage: %s\n", argv[0]);
+      exit (1);
+    }
+  cache = make_template_cache ();
+  rs = make_record_sampler ();
+  check_int_equal (cache != 0 && rs != 0, 1);
+  bzero (&exporter, sizeof exporter);
+  exporter.sin_family = AF_INET;
+  exporter.sin_addr.s_addr = htonl (0xc0000201);
+  exporter.sin_port = htons (2055);
+
+  test_v5 ();
+  test_v9 ();
+  test_ipfix ();
+  return 0;
+}
+
+/* A NetFlow v5 datagram with sequence number SEQUENCE and six
+   records, from source addresses 10.0.0.0 to 10.0.0.5. */
+static void
+make_v5 (d, sequence)
+     struct dgram *d;
+     uint32_t sequence;
+{
+  unsigned k;
+
+  init_dgram (d, 5, 6, sequence);
+  for (k = 0; k < 6; ++k)
+    {
+      add32 (d, 0x0a000000 + k);
+      while (d->len < 24 + (k + 1) * 48)
+	add8 (d, k);
+    }
+}
+
+/* NetFlow v5: every other one of six records, with the header count,
+   sequence number and sampling interval rewritten. */
+static void
+test_v5 ()
+{
+  struct template_scope *scope;
+  struct dgram d;
+  const unsigned char *out;
+  unsigned k;
+  size_t len;
+
+  make_v5 (&d, 1000);
+  scope = template_cache_update (cache, (struct sockaddr *) &exporter,
+				 d.data, d.len);
+  check_int_equal (scope != 0, 1);
+  len = sample (scope, &d, &receiver_a, 2, 0, &out);
+  check_int_equal (len, 24 + 3 * 48);
+  check_int_equal (get16 (out + 2), 3);
+  check_int_equal (get32 (out + 16), 1000);
+  check_int_equal (get16 (out + 22), (1 << 14) | 2);
+  for (k = 0; k < 3; ++k)
+    check_int_equal (get32 (out + 24 + k * 48), 0x0a000000 + 2 * k);
+
+  /* The next datagram continues the receiver's own sequence, which
+     counts the records it got. */
+  make_v5 (&d, 2000);
+  len = sample (scope, &d, &receiver_a, 2, 0, &out);
+  check_int_equal (get32 (out + 16), 1003);
+  record_sampler_reset (rs);
+}
+
+/* NetFlow v9: a template set, a data set of four records with a known
+   template, and a data set whose template is not known yet, which can
+   only be sampled as a whole.  The header counts eight records: one
+   template, four known and three unknown data records. */
+static void
+test_v9 ()
+{
+  struct template_scope *scope;
+  struct dgram d;
+  const unsigned char *out;
+  size_t len;
+  unsigned k;
+
+  init_dgram (&d, 9, 8, 500);
+  open_set (&d, 0);
+  add16 (&d, 256);		/* template 256: source address, port */
+  add16 (&d, 2);
+  add16 (&d, 8);
+  add16 (&d, 4);
+  add16 (&d, 7);
+  add16 (&d, 2);
+  close_set (&d);
+  open_set (&d, 256);
+  for (k = 0; k < 4; ++k)
+    {
+      add32 (&d, 0x0a000000 + k);
+      add16 (&d, 1000 + k);
+    }
+  close_set (&d);
+  open_set (&d, 300);
+  for (k = 0; k < 3 * 4; ++k)
+    add8 (&d, k);
+  close_set (&d);
+  close_dgram (&d);
+  scope = template_cache_update (cache, (struct sockaddr *) &exporter,
+				 d.data, d.len);
+  check_int_equal (scope != 0, 1);
+
+  /* Records 0 and 2, and the unknown set: 1 + 2 + 3 records */
+  len = sample (scope, &d, &receiver_a, 2, 0, &out);
+  check_int_equal (get16 (out + 2), 6);
+  check_int_equal (get32 (out + 12), 500);
+  check_int_equal (len, 20 + 16 + (4 + 2 * 6 + 0) + (4 + 12));
+  /* the template set, as is */
+  check_int_equal (memcmp (out + 20, d.data + 20, 16), 0);
+  /* the data set, whose two records fill four-byte units */
+  check_int_equal (get16 (out + 36), 256);
+  check_int_equal (get16 (out + 38), 16);
+  check_int_equal (get32 (out + 40), 0x0a000000);
+  check_int_equal (get16 (out + 44), 1000);
+  check_int_equal (get32 (out + 46), 0x0a000002);
+  check_int_equal (get16 (out + 50), 1002);
+  check_int_equal (get16 (out + 52), 300);
+
+  /* Records 1 and 3, but not the unknown set: 1 + 2 records */
+  len = sample (scope, &d, &receiver_b, 2, 1, &out);
+  check_int_equal (get16 (out + 2), 3);
+  check_int_equal (get32 (out + 12), 500);
+  check_int_equal (len, 20 + 16 + 16);
+  check_int_equal (get32 (out + 40), 0x0a000001);
+
+  /* NetFlow v9 sequence numbers count datagrams. */
+  len = sample (scope, &d, &receiver_a, 2, 0, &out);
+  check_int_equal (get32 (out + 12), 501);
+  record_sampler_reset (rs);
+}
+
+/* IPFIX: a data set of three fixed-length records, and one of three
+   records with a variable-length field, which is sampled as a whole
+   but whose records still count for the sequence number. */
+static void
+test_ipfix ()
+{
+  struct template_scope *scope;
+  struct dgram d;
+  const unsigned char *out;
+  size_t len;
+  unsigned k;
+
+  init_dgram (&d, 10, 0, 7000);
+  open_set (&d, 2);
+  add16 (&d, 400);		/* template 400: source address */
+  add16 (&d, 1);
+  add16 (&d, 8);
+  add16 (&d, 4);
+  add16 (&d, 401);		/* template 401: port, a string */
+  add16 (&d, 2);
+  add16 (&d, 7);
+  add16 (&d, 2);
+  add16 (&d, 82);		/* interfaceName */
+  add16 (&d, 65535);
+  close_set (&d);
+  close_dgram (&d);
+  scope = template_cache_update (cache, (struct sockaddr *) &exporter,
+				 d.data, d.len);
+  check_int_equal (scope != 0, 1);
+
+  init_dgram (&d, 10, 0, 7000);
+  open_set (&d, 400);
+  for (k = 0; k < 3; ++k)
+    add32 (&d, 0x0a000000 + k);
+  close_set (&d);
+  open_set (&d, 401);
+  for (k = 0; k < 3; ++k)
+    {
+      unsigned i;
+
+      add16 (&d, 2000 + k);
+      add8 (&d, k);		/* a name of K bytes */
+      for (i = 0; i < k; ++i)
+	add8 (&d, 'a');
+    }
+  close_set (&d);
+  close_dgram (&d);
+  check_int_equal (template_cache_update (cache,
+					  (struct sockaddr *) &exporter,
+					  d.data, d.len) == scope, 1);
+
+  /* Records 0 and 2 of the first set, without the second set */
+  len = sample (scope, &d, &receiver_a, 2, 0, &out);
+  check_int_equal (len, 16 + 4 + 2 * 4);
+  check_int_equal (get16 (out + 2), len);
+  check_int_equal (get32 (out + 8), 7000);
+  check_int_equal (get16 (out + 16), 400);
+  check_int_equal (get16 (out + 18), 4 + 2 * 4);
+  check_int_equal (get32 (out + 20), 0x0a000000);
+  check_int_equal (get32 (out + 24), 0x0a000002);
+
+  /* IPFIX sequence numbers count data records: two were sent. */
+  len = sample (scope, &d, &receiver_a, 2, 0, &out);
+  check_int_equal (get32 (out + 8), 7002);
+
+  /* Record 1 and the second set, whose three records count, too */
+  len = sample (scope, &d, &receiver_b, 2, 1, &out);
+  check_int_equal (len, 16 + (4 + 4) + (4 + 12));
+  check_int_equal (get16 (out + 2), len);
+  check_int_equal (get32 (out + 20), 0x0a000001);
+  check_int_equal (get16 (out + 24), 401);
+  check_int_equal (memcmp (out + 24, d.data + 32, 16), 0);
+  len = sample (scope, &d, &receiver_b, 2, 1, &out);
+  check_int_equal (get32 (out + 8), 7004);
+  record_sampler_reset (rs);
+}
+
+/* Sample the datagram D of SCOPE for RECEIVER, one in FREQ by
+   counting, skipping SKIP units first, and return the length of the
+   result, which is stored in *OUTP. */
+static size_t
+sample (scope, d, receiver, freq, skip, outp)
+     struct template_scope *scope;
+     const struct dgram *d;
+     const void *receiver;
+     unsigned freq;
+     int skip;
+     const unsigned char **outp;
+{
+  struct sampler s;
+  int freqcount = skip;
+
+  bzero (&s, sizeof s);
+  s.mode = SAMPLING_COUNT;
+  s.freq = freq;
+  s.freqcount = &freqcount;
+  if (record_sampler_parse (rs, scope, d->data, d->len) != 0)
+    return 0;
+  return record_sampler_select (rs, receiver, -1, &s, outp);
+}
+
+/* Start D as a datagram with header fields for VERSION, COUNT records
+   (NetFlow v5 and v9) and sequence number SEQUENCE. */
+static void
+init_dgram (d, version, count, sequence)
+     struct dgram *d;
+     unsigned version;
+     unsigned count;
+     uint32_t sequence;
+{
+  bzero (d, sizeof *d);
+  add16 (d, version);
+  add16 (d, count);
+  switch (version)
+    {
+    case 5:
+      add32 (d, 12345);		/* uptime */
+      add32 (d, 1700000000);	/* seconds */
+      add32 (d, 0);		/* nanoseconds */
+      add32 (d, sequence);
+      add32 (d, 0);		/* engine and sampling */
+      break;
+    case 9:
+      add32 (d, 12345);		/* uptime */
+      add32 (d, 1700000000);	/* seconds */
+      add32 (d, sequence);
+      add32 (d, 7);		/* source ID */
+      break;
+    default:
+      add32 (d, 1700000000);	/* export time */
+      add32 (d, sequence);
+      add32 (d, 9);		/* observation domain */
+      break;
+    }
+}
+
+static void
+add8 (d, v)
+     struct dgram *d;
+     unsigned v;
+{
+  d->data[d->len++] = v;
+}
+
+static void
+add16 (d, v)
+     struct dgram *d;
+     unsigned v;
+{
+  add8 (d, v >> 8);
+  add8 (d, v);
+}
+
+static void
+add32 (d, v)
+     struct dgram *d;
+     uint32_t v;
+{
+  add16 (d, v >> 16);
+  add16 (d, v);
+}
+
+static void
+open_set (d, id)
+     struct dgram *d;
+     unsigned id;
+{
+  d->set = d->len;
+  add16 (d, id);
+  add16 (d, 0);
+}
+
+static void
+close_set (d)
+     struct dgram *d;
+{
+  unsigned len = d->len - d->set;
+
+  d->data[d->set + 2] = len >> 8;
+  d->data[d->set + 3] = len;
+  d->set = 0;
+}
+
+/* The header of an IPFIX datagram has its length. */
+static void
+close_dgram (d)
+     struct dgram *d;
+{
+  if (get16 (d->data) == 10)
+    {
+      d->data[2] = d->len >> 8;
+      d->data[3] = d->len;
+    }
+}
+
+static int
+check_int_equal (is, should)
+     long is;
+     long should;
+{
+  if (is == should)
+    {
+      return test_ok ();
+    }
+  else
+    {
+      return test_fail ();
+    }
+}
+
+static int
+test_ok ()
+{
+  fprintf (stdout, "%3d... ok\n", test_index++);
+  return 1;
+}
+
+static int
+test_fail ()
+{
+  fprintf (stdout, "%3d... fail\n", test_index++);
+  return 0;
+}
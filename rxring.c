@@ -0,0 +1,450 @@
+/*
+ rxring.c
+
+ Date Created: Sun Oct 18 16:40:05 2026
+
+ Reception of flow-export datagrams from a packet socket with a
+ memory-mapped TPACKET_V3 receive ring (the -i option), instead of a
+ UDP socket.  The kernel fills blocks of the ring with the packets
+ that pass a BPF filter for the flow-export port, and hands over a
+ whole block at a time.  samplicator parses the IP and UDP headers
+ itself, and the datagrams are passed on to the matching and fan-out
+ code in place, without copying them out of the ring.
+
+ Since a packet socket sees all traffic on the interface, this also
+ works for datagrams that are not addressed to this host, e.g. on a
+ SPAN port; the interface is put into promiscuous mode for that.
+ Fragmented datagrams are not reassembled, and are ignored.
+
+ With several workers, each has its own ring, and the rings form a
+ PACKET_FANOUT group that spreads packets over them by flow hash.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_IF_PACKET_H
+# include <sys/mman.h>
+# include <net/if.h>
+# include <linux/if_packet.h>
+# include <linux/if_ether.h>
+# include <linux/filter.h>
+#endif
+
+#include "samplicator.h"
+#include "rxring.h"
+
+/*
+ rx_parse_datagram(ip, caplen, pdu)
+
+ Fill in PDU with the UDP payload and the sender's address of the IP
+ datagram of CAPLEN bytes at IP.  Returns -1 if this is not a
+ complete UDP datagram.  This is also used for AF_XDP sockets, see
+ xsk.c.
+ */
+int
+rx_parse_datagram (ip, caplen, pdu)
+     unsigned char *ip;
+     size_t caplen;
+     struct pdu *pdu;
+{
+  size_t iplen, hlen;
+  unsigned char *udp;
+  uint16_t ulen;
+
+  if (caplen < 1)
+    return -1;
+  if ((ip[0] >> 4) == 4)
+    {
+      struct sockaddr_in *sin = (struct sockaddr_in *) &pdu->addr;
+
+      hlen = (ip[0] & 0xf) * 4;
+      if (hlen < 20 || caplen < hlen + 8)
+	return -1;
+      iplen = ip[2] << 8 | ip[3];
+      memset (sin, 0, sizeof *sin);
+      sin->sin_family = AF_INET;
+      memcpy (&sin->sin_addr, ip + 12, 4);
+      pdu->addrlen = sizeof *sin;
+      udp = ip + hlen;
+      memcpy (&sin->sin_port, udp, 2);
+    }
+  else if ((ip[0] >> 4) == 6)
+    {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &pdu->addr;
+
+      hlen = 40;
+      if (caplen < hlen + 8)
+	return -1;
+      iplen = hlen + (ip[4] << 8 | ip[5]);
+      memset (sin6, 0, sizeof *sin6);
+      sin6->sin6_family = AF_INET6;
+      memcpy (&sin6->sin6_addr, ip + 8, 16);
+      pdu->addrlen = sizeof *sin6;
+      udp = ip + hlen;
+      memcpy (&sin6->sin6_port, udp, 2);
+    }
+  else
+    return -1;
+  ulen = udp[4] << 8 | udp[5];
+  if (iplen > caplen || ulen < 8 || hlen + ulen > iplen)
+    return -1;
+  pdu->data = udp + 8;
+  pdu->len = ulen - 8;
+  pdu->payload_sum_p = 0;
+  return 0;
+}
+
+#if defined (HAVE_LINUX_IF_PACKET_H) && defined (TPACKET3_HDRLEN)
+
+/* Geometry of each ring.  A block is handed over when it is full, or
+   RX_BLOCK_TIMEOUT_MS after its first packet arrived. */
+#define RX_BLOCK_SIZE (1 << 20)
+#define RX_BLOCKS 8
+#define RX_FRAME_SIZE 2048
+#define RX_BLOCK_TIMEOUT_MS 10
+
+/*
+ struct rx_ring
+
+ A receive ring of NBLOCKS blocks.  BLOCK is the index of the block
+ we are reading or waiting for; if HOLDING is set, we own it, and
+ REMAINING packets starting at NEXT are still to be read.
+ */
+struct rx_ring {
+  int				fd;
+  unsigned char		       *blocks;
+  size_t			ring_size;
+  unsigned			nblocks;
+  unsigned			block;
+  int				holding;
+  unsigned			remaining;
+  unsigned char		       *next;
+  unsigned long			drops; /* not yet reported */
+};
+
+/*
+ attach_port_filter(fd, port, ipv4_p, ipv6_p)
+
+ Attach a classic BPF program to packet socket FD that accepts
+ incoming, unfragmented UDP datagrams to PORT over IPv4 (if IPV4_P)
+ and IPv6 (if IPV6_P).  The socket is a SOCK_DGRAM socket, so packet
+ data starts at the network header.  IPv6 extension headers are not
+ followed.
+ */
+static int
+attach_port_filter (fd, port, ipv4_p, ipv6_p)
+     int fd;
+     unsigned port;
+     int ipv4_p;
+     int ipv6_p;
+{
+  struct sock_filter code[] = {
+    /* 0: drop our own outgoing packets */
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 15, 0),
+    /* 2: dispatch on the protocol */
+    BPF_STMT (BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP,
+	      ipv4_p ? 0 : 13, ipv6_p ? 7 : 13),
+    /* 4: IPv4: UDP, not a fragment, A = destination port */
+    BPF_STMT (BPF_LD | BPF_B | BPF_ABS, 9),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 17, 0, 11),
+    BPF_STMT (BPF_LD | BPF_H | BPF_ABS, 6),
+    BPF_JUMP (BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 9, 0),
+    BPF_STMT (BPF_LDX | BPF_B | BPF_MSH, 0),
+    BPF_STMT (BPF_LD | BPF_H | BPF_IND, 2),
+    BPF_JUMP (BPF_JMP | BPF_JA, 4, 0, 0),
+    /* 11: IPv6: UDP, A = destination port */
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 5),
+    BPF_STMT (BPF_LD | BPF_B | BPF_ABS, 6),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 17, 0, 3),
+    BPF_STMT (BPF_LD | BPF_H | BPF_ABS, 40 + 2),
+    /* 15: check the port */
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+    BPF_STMT (BPF_RET | BPF_K, 0xffff),
+    /* 17: */
+    BPF_STMT (BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog;
+
+  prog.len = sizeof code / sizeof code[0];
+  prog.filter = code;
+  if (setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		  (char *) &prog, sizeof prog) == -1)
+    {
+      fprintf (stderr, "setsockopt(SO_ATTACH_FILTER): %s\n", strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ make_rx_ring(ifname, port, ipv4_p, ipv6_p, fanout_id)
+
+ Create a receive ring for UDP datagrams to PORT on interface IFNAME,
+ see attach_port_filter().  If FANOUT_ID is not -1, the ring joins
+ the fanout group with that ID.  Returns 0 after printing an error
+ message if this fails.
+ */
+struct rx_ring *
+make_rx_ring (ifname, port, ipv4_p, ipv6_p, fanout_id)
+     const char *ifname;
+     unsigned port;
+     int ipv4_p;
+     int ipv6_p;
+     int fanout_id;
+{
+  struct rx_ring *r;
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct packet_mreq mreq;
+  int version = TPACKET_V3, ifindex;
+
+  if ((ifindex = if_nametoindex (ifname)) == 0)
+    {
+      fprintf (stderr, "Unknown interface %s\n", ifname);
+      return 0;
+    }
+  if ((r = calloc (1, sizeof (struct rx_ring))) == 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return 0;
+    }
+  /* No protocol yet, so that nothing is received before the filter
+     is in place. */
+  if ((r->fd = socket (PF_PACKET, SOCK_DGRAM, 0)) == -1)
+    {
+      fprintf (stderr, "socket(PF_PACKET): %s\n", strerror (errno));
+      free (r);
+      return 0;
+    }
+  if (attach_port_filter (r->fd, port, ipv4_p, ipv6_p) != 0)
+    goto fail;
+  if (setsockopt (r->fd, SOL_PACKET, PACKET_VERSION,
+		  (char *) &version, sizeof version) == -1)
+    {
+      fprintf (stderr, "setsockopt(PACKET_VERSION): %s\n", strerror (errno));
+      goto fail;
+    }
+  memset (&req, 0, sizeof req);
+  req.tp_block_size = RX_BLOCK_SIZE;
+  req.tp_block_nr = RX_BLOCKS;
+  req.tp_frame_size = RX_FRAME_SIZE;
+  req.tp_frame_nr = RX_BLOCK_SIZE / RX_FRAME_SIZE * RX_BLOCKS;
+  req.tp_retire_blk_tov = RX_BLOCK_TIMEOUT_MS;
+  if (setsockopt (r->fd, SOL_PACKET, PACKET_RX_RING,
+		  (char *) &req, sizeof req) == -1)
+    {
+      fprintf (stderr, "setsockopt(PACKET_RX_RING): %s\n", strerror (errno));
+      goto fail;
+    }
+  r->nblocks = RX_BLOCKS;
+  r->ring_size = (size_t) RX_BLOCK_SIZE * RX_BLOCKS;
+  if ((r->blocks = mmap (0, r->ring_size, PROT_READ|PROT_WRITE,
+			 MAP_SHARED, r->fd, 0)) == MAP_FAILED)
+    {
+      fprintf (stderr, "mmap(PACKET_RX_RING): %s\n", strerror (errno));
+      goto fail;
+    }
+
+  memset (&sll, 0, sizeof sll);
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons (ETH_P_ALL);
+  sll.sll_ifindex = ifindex;
+  if (bind (r->fd, (struct sockaddr *) &sll, sizeof sll) == -1)
+    {
+      fprintf (stderr, "bind(%s): %s\n", ifname, strerror (errno));
+      goto fail_unmap;
+    }
+  memset (&mreq, 0, sizeof mreq);
+  mreq.mr_ifindex = ifindex;
+  mreq.mr_type = PACKET_MR_PROMISC;
+  if (setsockopt (r->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+		  (char *) &mreq, sizeof mreq) == -1)
+    {
+      fprintf (stderr, "Warning: cannot put %s into promiscuous mode: %s\n",
+	       ifname, strerror (errno));
+    }
+  if (fanout_id != -1)
+    {
+      int fanout = (fanout_id & 0xffff) | (PACKET_FANOUT_HASH << 16);
+
+      if (setsockopt (r->fd, SOL_PACKET, PACKET_FANOUT,
+		      (char *) &fanout, sizeof fanout) == -1)
+	{
+	  fprintf (stderr, "setsockopt(PACKET_FANOUT): %s\n", strerror (errno));
+	  goto fail_unmap;
+	}
+    }
+  return r;
+
+ fail_unmap:
+  munmap (r->blocks, r->ring_size);
+ fail:
+  close (r->fd);
+  free (r);
+  return 0;
+}
+
+int
+rx_ring_fd (r)
+     const struct rx_ring *r;
+{
+  return r->fd;
+}
+
+/*
+ parse_packet(ppd, pdu)
+
+ Fill in PDU from the packet described by PPD, see
+ rx_parse_datagram().
+ */
+static int
+parse_packet (ppd, pdu)
+     struct tpacket3_hdr *ppd;
+     struct pdu *pdu;
+{
+  if (ppd->tp_snaplen < ppd->tp_len)
+    return -1;
+  return rx_parse_datagram ((unsigned char *) ppd + ppd->tp_net,
+			    ppd->tp_snaplen, pdu);
+}
+
+/* Add the kernel's count of packets dropped on ring R since the last
+   call to R->drops. */
+static void
+collect_drops (r)
+     struct rx_ring *r;
+{
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof st;
+
+  if (getsockopt (r->fd, SOL_PACKET, PACKET_STATISTICS,
+		  (char *) &st, &len) == 0)
+    r->drops += st.tp_drops;
+}
+
+/*
+ rx_ring_receive(r, pdus, max)
+
+ Store up to MAX datagrams from ring R in PDUS, and return their
+ number, which is zero if there are none.  The PDUs point into the
+ ring, and stay valid until the next call, which may hand their block
+ back to the kernel.  Datagrams are only taken from one block per
+ call.
+ */
+unsigned
+rx_ring_receive (r, pdus, max)
+     struct rx_ring *r;
+     struct pdu *pdus;
+     unsigned max;
+{
+  struct tpacket_block_desc *bd
+    = (struct tpacket_block_desc *) (r->blocks
+				     + (size_t) r->block * RX_BLOCK_SIZE);
+  unsigned n = 0;
+
+  while (n < max)
+    {
+      if (r->remaining == 0)
+	{
+	  if (r->holding)
+	    {
+	      if (n > 0)
+		break;
+	      __atomic_store_n (&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				__ATOMIC_RELEASE);
+	      collect_drops (r);
+	      r->holding = 0;
+	      r->block = (r->block + 1) % r->nblocks;
+	      bd = (struct tpacket_block_desc *)
+		(r->blocks + (size_t) r->block * RX_BLOCK_SIZE);
+	    }
+	  if (!(__atomic_load_n (&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+		& TP_STATUS_USER))
+	    break;
+	  r->holding = 1;
+	  r->remaining = bd->hdr.bh1.num_pkts;
+	  r->next = (unsigned char *) bd + bd->hdr.bh1.offset_to_first_pkt;
+	  continue;
+	}
+      {
+	struct tpacket3_hdr *ppd = (struct tpacket3_hdr *) r->next;
+
+	r->next += ppd->tp_next_offset;
+	--r->remaining;
+	if (parse_packet (ppd, &pdus[n]) == 0)
+	  ++n;
+      }
+    }
+  return n;
+}
+
+/*
+ rx_ring_drops(r)
+
+ Return the number of packets that the kernel had to drop because
+ ring R was full, since the last call.  The count is updated
+ whenever a block is handed back to the kernel.
+ */
+unsigned long
+rx_ring_drops (r)
+     struct rx_ring *r;
+{
+  unsigned long drops = r->drops;
+
+  r->drops = 0;
+  return drops;
+}
+
+#else /* not (HAVE_LINUX_IF_PACKET_H && TPACKET3_HDRLEN) */
+
+struct rx_ring *
+make_rx_ring (ifname, port, ipv4_p, ipv6_p, fanout_id)
+     const char *ifname;
+     unsigned port;
+     int ipv4_p;
+     int ipv6_p;
+     int fanout_id;
+{
+  fprintf (stderr, "Receive rings (-i) are not supported on this system\n");
+  return 0;
+}
+
+int
+rx_ring_fd (r)
+     const struct rx_ring *r;
+{
+  return -1;
+}
+
+unsigned
+rx_ring_receive (r, pdus, max)
+     struct rx_ring *r;
+     struct pdu *pdus;
+     unsigned max;
+{
+  return 0;
+}
+
+unsigned long
+rx_ring_drops (r)
+     struct rx_ring *r;
+{
+  return 0;
+}
+
+#endif /* not (HAVE_LINUX_IF_PACKET_H && TPACKET3_HDRLEN) */
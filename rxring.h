@@ -0,0 +1,13 @@
+/*
+ rxring.h
+
+ Date Created: Sun Oct 18 16:40:05 2026
+ */
+
+struct rx_ring;
+
+extern struct rx_ring *make_rx_ring (const char *, unsigned, int, int, int);
+extern int rx_ring_fd (const struct rx_ring *);
+extern unsigned rx_ring_receive (struct rx_ring *, struct pdu *, unsigned);
+extern unsigned long rx_ring_drops (struct rx_ring *);
+extern int rx_parse_datagram (unsigned char *, size_t, struct pdu *);
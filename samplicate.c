@@ -8,9 +8,22 @@
 #include <unistd.h>
 #endif
 #include <sys/socket.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <netdb.h>
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#ifdef HAVE_LINUX_FILTER_H
+# include <linux/filter.h>
+#endif
 #ifdef HAVE_ARPA_INET_H
 # include <arpa/inet.h>
 #endif
@@ -34,17 +47,105 @@
 #endif
 
 #include "samplicator.h"
+#include "hashing.h"
+#include "sampling.h"
 #include "read_config.h"
 #include "rawsend.h"
 #include "inet.h"
+#include "source_table.h"
+#include "stats.h"
+#include "txring.h"
+#include "rxring.h"
+#include "xsk.h"
+#include "uring.h"
+#include "templates.h"
+#include "records.h"
+#include "groups.h"
+#include "health.h"
+
+struct worker;
 
-static int send_pdu_to_receiver (struct receiver *, const void *, size_t,
-				 struct sockaddr *);
+static int send_pdu_to_receiver (struct worker *, struct receiver *,
+				 struct pdu *);
 static int init_samplicator (struct samplicator_context *);
 static int samplicate (struct samplicator_context *);
 static int make_udp_socket (long, int, int);
 static int make_recv_socket (struct samplicator_context *);
-static int make_send_sockets (struct samplicator_context *);
+static int make_send_sockets (struct samplicator_context *,
+			      struct source_context *);
+
+/* The most a UDP_GRO buffer can hold.  The receive buffers must be at
+   least this large, or UDP_GRO isn't used (see open_recv_socket()). */
+#define GRO_MAX_BYTES 65535
+
+/*
+ struct worker
+
+ Forwarding state of one worker thread (see the -w option).  Each
+ worker has its own receive socket, receive batch and send queues,
+ and uses its own slot of each receiver's STATE array, so that the
+ forwarding path needs no locking.  Worker 0 runs in the main thread.
+
+ TABLE is the source table the worker uses, and GENERATION its
+ generation number, which tells reload_config() when the worker has
+ stopped using older tables.
+
+ The send sockets are non-blocking.  When one of them is full,
+ datagrams for its receivers are queued (see enqueue_pending_pdu()),
+ and the socket is noted in BLOCKED_FDS until poll() reports it
+ writable again.  The same goes for the worker's transmit rings
+ (TX_RINGS, one per interface used with the dev= receiver option),
+ and its AF_XDP socket (XSK), which are flushed after each batch.
+
+ With -I, the worker receives through an io_uring (URING), on which
+ the sends over the cooked sockets are submitted as well, see
+ uring_receive_pdus().
+ */
+struct worker {
+  struct samplicator_context   *ctx;
+  unsigned			index;
+  int				fsockfd;
+  struct rx_ring	       *rx_ring; /* -i, see rxring.c */
+  struct xsk		       *xsk; /* -X, see xsk.c */
+  struct uring		       *uring; /* -I, see uring.c */
+  pthread_t			thread;
+  struct receive_batch	       *batch;
+  struct send_queue	       *send_queues;
+  struct match_cache	       *match_cache;
+  struct template_cache	       *templates; /* see replay_templates() */
+  struct record_sampler	       *records; /* see transmit_records() */
+  struct source_table	       *table;
+  unsigned long			generation;
+  int64_t			now; /* monotonic_ns() after the last receive */
+  struct receiver_state	       *pending; /* states with queued datagrams */
+  struct tx_ring	       *tx_rings;
+  int			       *blocked_fds; /* send sockets and rings */
+  unsigned			nblocked;
+  unsigned			max_blocked;
+  struct pollfd		       *pollfds; /* max_blocked + 1 entries */
+  uint32_t			in_drops_seen; /* last SO_RXQ_OVFL value */
+  int64_t			next_error_check; /* see check_send_errors() */
+  uint64_t			random_state; /* for sampling=random */
+} CACHE_ALIGNED;
+
+#define WOULD_BLOCK_P(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+
+/* Errors that a send on a socket with IP_RECVERR (see health.c) may
+   report for an earlier datagram, to whichever receiver, rather than
+   for the one being sent. */
+#define ASYNC_SEND_ERROR_P(e) \
+  ((e) == ECONNREFUSED || (e) == EHOSTUNREACH || (e) == ENETUNREACH)
+
+/* How often a worker reads the error queues of the send sockets. */
+#define SEND_ERROR_CHECK_NS 20000000
+
+static void note_send_result (struct worker *, struct receiver *, size_t, int);
+static void enqueue_pending_pdu (struct worker *, struct receiver_state *,
+				 const struct pdu *);
+static void receiver_refund (struct receiver *, size_t);
+static void check_received_pdus (struct worker *, unsigned);
+static void wait_uring_sends (struct worker *);
+static void exit_if_timed_out (struct samplicator_context *);
 
 int
 main (argc, argv)
@@ -57,6 +158,8 @@ main (argc, argv)
     {
       exit (1);
     }
+  ctx.argc = argc;
+  ctx.argv = argv;
   if (init_samplicator (&ctx) == -1)
     exit (1);
   if (samplicate (&ctx) != 0) /* actually, samplicate() should never return. */
@@ -118,13 +221,16 @@ write_pid_file (const char *filename)
 /*
  make_recv_socket(ctx)
 
- Create the socket on which samplicator receives its packets.
+ Create the sockets on which samplicator receives its packets.
 
- There can only be one.  This will be either a wildcard socket
- listening on a specific port on all interfaces, or a socket bound to
- a specific address (and, thus, interface).
+ There is one socket per worker thread (see the -w option).  This will
+ be either a wildcard socket listening on a specific port on all
+ interfaces, or a socket bound to a specific address (and, thus,
+ interface).  When there are several workers, their sockets are all
+ bound to the same address with SO_REUSEPORT, and the kernel
+ distributes incoming datagrams among them.
 
- The creation of this socket is affected by the preferences in CTX:
+ The creation of these sockets is affected by the preferences in CTX:
 
  CTX->faddr_spec
    This is either a null pointer, meaning that a wildcard socket
@@ -157,52 +263,362 @@ write_pid_file (const char *filename)
    buffer size is more useful than no socket at all, although some
    people may differ.
 
+ CTX->nworkers
+   The number of sockets to create.  If this is greater than one, a
+   classic BPF program is attached to the socket group that selects
+   the socket by a hash of the sender's address, so that all packets
+   from a given exporter are handled by the same worker.
+
+ CTX->capture_dev
+   If this is set (-i), the workers read from packet socket receive
+   rings on this interface instead, see open_capture_rings().
+
+ CTX->xdp_dev
+   Likewise for AF_XDP sockets on this interface (-X).
+
+ The address that the sockets have been bound to is stored in
+ CTX->faddr.
+
  RETURN VALUE
 
- If a socket could be created and bound, this function will return
+ If the sockets could be created and bound, this function will return
  zero.  If this was not possible, the function will produce an error
  message and return -1.
  */
+static int
+open_recv_socket (ctx, addr, addrlen)
+     struct samplicator_context *ctx;
+     struct sockaddr *addr;
+     socklen_t addrlen;
+{
+  int s;
+
+  if ((s = socket (addr->sa_family, SOCK_DGRAM, 0)) < 0)
+    {
+      fprintf (stderr, "socket(): %s\n", strerror (errno));
+      return -1;
+    }
+  if (setsockopt (s, SOL_SOCKET, SO_RCVBUF,
+		  (char *) &ctx->sockbuflen, sizeof ctx->sockbuflen) == -1)
+    {
+      fprintf (stderr, "Warning: setsockopt(SO_RCVBUF,%ld) failed: %s\n",
+	       ctx->sockbuflen, strerror (errno));
+    }
+  if (ctx->nworkers > 1)
+    {
+#ifdef SO_REUSEPORT
+      int on = 1;
+      if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT,
+		      (char *) &on, sizeof on) == -1)
+	{
+	  fprintf (stderr, "setsockopt(SO_REUSEPORT): %s\n", strerror (errno));
+	  close (s);
+	  return -1;
+	}
+#else
+      fprintf (stderr, "SO_REUSEPORT not supported, cannot use -w\n");
+      close (s);
+      return -1;
+#endif
+    }
+#ifdef SO_RXQ_OVFL
+  {
+    /* Have the kernel report how many datagrams it dropped because
+       the receive queue was full, see note_receive_drops(). */
+    int on = 1;
+    if (setsockopt (s, SOL_SOCKET, SO_RXQ_OVFL,
+		    (char *) &on, sizeof on) == -1)
+      {
+	fprintf (stderr, "Warning: setsockopt(SO_RXQ_OVFL) failed: %s\n",
+		 strerror (errno));
+      }
+  }
+#endif
+#ifdef UDP_GRO
+  if (ctx->pdulen >= GRO_MAX_BYTES)
+    {
+      /* Let the kernel hand us runs of datagrams from the same sender
+	 in a single buffer, see gro_segment_size(). */
+      int on = 1;
+      if (setsockopt (s, SOL_UDP, UDP_GRO,
+		      (char *) &on, sizeof on) == -1)
+	{
+	  fprintf (stderr, "Warning: setsockopt(UDP_GRO) failed: %s\n",
+		   strerror (errno));
+	}
+    }
+#endif
+  if (bind (s, addr, addrlen) < 0)
+    {
+      fprintf (stderr, "bind(): %s\n", strerror (errno));
+      close (s);
+      return -1;
+    }
+  return s;
+}
+
+#if defined (SO_ATTACH_REUSEPORT_CBPF) && defined (HAVE_LINUX_FILTER_H)
+/*
+ attach_exporter_hash(ctx, s)
+
+ Attach a classic BPF program to the SO_REUSEPORT group of socket S
+ that returns the index of the socket that should receive a packet,
+ computed from the packet's source address.  For IPv4, this is the
+ source address itself; for IPv6, the four 32-bit words of the source
+ address are XORed together.  The result is folded once and taken
+ modulo the number of workers.
+ */
+static int
+attach_exporter_hash (ctx, s)
+     struct samplicator_context *ctx;
+     int s;
+{
+  struct sock_filter code[] = {
+    /* A = IP version */
+    BPF_STMT (BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF + 0),
+    BPF_STMT (BPF_ALU | BPF_RSH | BPF_K, 4),
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 6, 2, 0),
+    /* IPv4: A = source address */
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+    BPF_JUMP (BPF_JMP | BPF_JA, 10, 0, 0),
+    /* IPv6: A = XOR of the four words of the source address */
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8),
+    BPF_STMT (BPF_MISC | BPF_TAX, 0),
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+    BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0),
+    BPF_STMT (BPF_MISC | BPF_TAX, 0),
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+    BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0),
+    BPF_STMT (BPF_MISC | BPF_TAX, 0),
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+    BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0),
+    /* A = (A ^ (A >> 16)) % nworkers */
+    BPF_STMT (BPF_MISC | BPF_TAX, 0),
+    BPF_STMT (BPF_ALU | BPF_RSH | BPF_K, 16),
+    BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0),
+    BPF_STMT (BPF_ALU | BPF_MOD | BPF_K, ctx->nworkers),
+    BPF_STMT (BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog prog;
+
+  prog.len = sizeof code / sizeof code[0];
+  prog.filter = code;
+  if (setsockopt (s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		  (char *) &prog, sizeof prog) == -1)
+    {
+      fprintf (stderr, "Warning: setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed: %s\n"
+	       "Packets from one exporter may be spread over several workers.\n",
+	       strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+#endif /* SO_ATTACH_REUSEPORT_CBPF && HAVE_LINUX_FILTER_H */
+
+/*
+ open_capture_rings(ctx, res0)
+
+ Set up the receive rings for -i, or the AF_XDP sockets for -X, one
+ per worker, for the port of the first address in RES0.
+
+ With -i, flow-export datagrams to this host would also be delivered
+ to the UDP stack, which answers with ICMP port unreachable messages
+ if no socket is bound to the port.  So a UDP socket is bound to each
+ of the addresses in RES0, where possible, with a filter that drops
+ everything.  These sockets stay open for the life of the process.
+ With -X, the datagrams never reach the stack.
+ */
+static int
+open_capture_rings (ctx, res0)
+     struct samplicator_context *ctx;
+     struct addrinfo *res0;
+{
+  struct addrinfo *res;
+  unsigned port;
+  int k;
+
+  memcpy (&ctx->faddr, res0->ai_addr, res0->ai_addrlen);
+  ctx->fsockaddrlen = res0->ai_addrlen;
+  port = ntohs (res0->ai_family == AF_INET6
+		? ((struct sockaddr_in6 *) res0->ai_addr)->sin6_port
+		: ((struct sockaddr_in *) res0->ai_addr)->sin_port);
+  if (ctx->xdp_dev != 0)
+    {
+      struct xsk **xsks = calloc (ctx->nworkers, sizeof (struct xsk *));
+
+      if (xsks == 0)
+	{
+	  fprintf (stderr, "Out of memory\n");
+	  return -1;
+	}
+      if (open_xsks (ctx->xdp_dev, port, !ctx->ipv6_only, !ctx->ipv4_only,
+		     xsks, ctx->nworkers) != 0)
+	return -1;
+      for (k = 0; k < ctx->nworkers; ++k)
+	{
+	  ctx->workers[k].xsk = xsks[k];
+	  ctx->workers[k].fsockfd = xsk_fd (xsks[k]);
+	}
+      free (xsks);
+      return 0;
+    }
+#if defined (SO_ATTACH_FILTER) && defined (HAVE_LINUX_FILTER_H)
+  for (res = res0; res; res = res->ai_next)
+    {
+      struct sock_filter drop_all[] = {
+	BPF_STMT (BPF_RET | BPF_K, 0),
+      };
+      struct sock_fprog prog;
+      int s, on = 1;
+
+      prog.len = 1;
+      prog.filter = drop_all;
+      if ((s = socket (res->ai_family, SOCK_DGRAM, 0)) == -1)
+	continue;
+      if (res->ai_family == AF_INET6)
+	setsockopt (s, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &on, sizeof on);
+      if (setsockopt (s, SOL_SOCKET, SO_ATTACH_FILTER,
+		      (char *) &prog, sizeof prog) == -1
+	  || bind (s, res->ai_addr, res->ai_addrlen) == -1)
+	{
+	  if (ctx->debug)
+	    fprintf (stderr, "Cannot bind sink socket: %s\n", strerror (errno));
+	  close (s);
+	}
+    }
+#endif
+  for (k = 0; k < ctx->nworkers; ++k)
+    {
+      struct worker *w = &ctx->workers[k];
+
+      if ((w->rx_ring = make_rx_ring (ctx->capture_dev, port,
+				      !ctx->ipv6_only, !ctx->ipv4_only,
+				      ctx->nworkers > 1 ? getpid () : -1)) == 0)
+	return -1;
+      w->fsockfd = rx_ring_fd (w->rx_ring);
+    }
+  return 0;
+}
+
 static int
 make_recv_socket (ctx)
      struct samplicator_context *ctx;
 {
-  struct addrinfo hints, *res;
+  struct addrinfo hints, *res, *res0;
   int result;
+  int k;
 
   init_hints_from_preferences (&hints, ctx);
-  if ((result = getaddrinfo (ctx->faddr_spec, ctx->fport_spec, &hints, &res)) != 0)
+  if ((result = getaddrinfo (ctx->faddr_spec, ctx->fport_spec, &hints, &res0)) != 0)
     {
       fprintf (stderr, "Failed to resolve IP address/port (%s:%s): %s\n",
 	       ctx->faddr_spec, ctx->fport_spec, gai_strerror (result));
       return -1;
     }
-  for (; res; res = res->ai_next)
+  if (ctx->capture_dev != 0 || ctx->xdp_dev != 0)
     {
-      if ((ctx->fsockfd = socket (res->ai_family, SOCK_DGRAM, 0)) < 0)
-	{
-	  fprintf (stderr, "socket(): %s\n", strerror (errno));
-	  break;
-	}
-      if (setsockopt (ctx->fsockfd, SOL_SOCKET, SO_RCVBUF,
-		      (char *) &ctx->sockbuflen, sizeof ctx->sockbuflen) == -1)
+      result = open_capture_rings (ctx, res0);
+      freeaddrinfo (res0);
+      return result;
+    }
+  for (res = res0; res; res = res->ai_next)
+    {
+      if ((ctx->workers[0].fsockfd
+	   = open_recv_socket (ctx, res->ai_addr, res->ai_addrlen)) != -1)
+	break;
+    }
+  if (res == 0)
+    {
+      freeaddrinfo (res0);
+      return -1;
+    }
+  memcpy (&ctx->faddr, res->ai_addr, res->ai_addrlen);
+  ctx->fsockaddrlen = res->ai_addrlen;
+  freeaddrinfo (res0);
+
+  for (k = 1; k < ctx->nworkers; ++k)
+    {
+      if ((ctx->workers[k].fsockfd
+	   = open_recv_socket (ctx, (struct sockaddr *) &ctx->faddr,
+			       ctx->fsockaddrlen)) == -1)
+	return -1;
+    }
+#if defined (SO_ATTACH_REUSEPORT_CBPF) && defined (HAVE_LINUX_FILTER_H)
+  if (ctx->nworkers > 1)
+    attach_exporter_hash (ctx, ctx->workers[0].fsockfd);
+#endif
+  return 0;
+}
+
+/*
+ calloc_aligned(nmemb, size)
+
+ Like calloc(), but the result is aligned to a cache line.  This is
+ used for the per-worker arrays, so that the entries of different
+ workers don't share cache lines.
+ */
+static void *
+calloc_aligned (nmemb, size)
+     size_t nmemb;
+     size_t size;
+{
+  void *p;
+
+  if (posix_memalign (&p, CACHE_LINE_SIZE, nmemb * size) != 0)
+    return 0;
+  memset (p, 0, nmemb * size);
+  return p;
+}
+
+/*
+ init_source_state(ctx, sctx)
+
+ Allocate the per-worker statistics of SCTX and the per-worker and
+ pacing state of its receivers, unless they have been taken over from
+ an earlier configuration (see reload_config()).
+ */
+static int
+init_source_state (ctx, sctx)
+     struct samplicator_context *ctx;
+     struct source_context *sctx;
+{
+  unsigned i;
+  int k;
+
+  if (sctx->stats == 0
+      && (sctx->stats = calloc_aligned (ctx->nworkers,
+					sizeof (struct source_stats))) == 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return -1;
+    }
+  for (i = 0; i < sctx->nreceivers; ++i)
+    {
+      struct receiver *receiver = &sctx->receivers[i];
+
+      if (receiver->state != 0)
+	continue;
+      if ((receiver->state
+	   = calloc_aligned (ctx->nworkers,
+			     sizeof (struct receiver_state))) == 0)
 	{
-	  fprintf (stderr, "Warning: setsockopt(SO_RCVBUF,%ld) failed: %s\n",
-		   ctx->sockbuflen, strerror (errno));
+	  fprintf (stderr, "Out of memory\n");
+	  return -1;
 	}
-      if (bind (ctx->fsockfd,
-		(struct sockaddr*)res->ai_addr, res->ai_addrlen) < 0)
+      for (k = 0; k < ctx->nworkers; ++k)
+	receiver->state[k].receiver = receiver;
+      if ((receiver->flags & pf_PACED)
+	  && (receiver->pacing
+	      = calloc_aligned (1, sizeof (struct receiver_pacing))) == 0)
 	{
-	  fprintf (stderr, "bind(): %s\n", strerror (errno));
-	  break;
+	  fprintf (stderr, "Out of memory\n");
+	  return -1;
 	}
-      ctx->fsockaddrlen = res->ai_addrlen;
-      return 0;
     }
-  return -1;
+  return 0;
 }
 
-/* init_samplicator: prepares receiving socket */
+/* init_samplicator: prepares receiving sockets */
 static int
 init_samplicator (ctx)
      struct samplicator_context *ctx;
@@ -210,6 +626,19 @@ init_samplicator (ctx)
   struct source_context *sctx;
   int i;
 
+  if ((ctx->workers = calloc_aligned (ctx->nworkers,
+				      sizeof (struct worker))) == 0
+      || (ctx->stats = calloc_aligned (ctx->nworkers,
+				       sizeof (struct worker_stats))) == 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return -1;
+    }
+  for (i = 0; i < ctx->nworkers; ++i)
+    {
+      ctx->workers[i].ctx = ctx;
+      ctx->workers[i].index = i;
+    }
   if (make_recv_socket (ctx) != 0)
     {
       return -1;
@@ -226,7 +655,44 @@ init_samplicator (ctx)
       return -1;
     }
 
-  if (make_send_sockets (ctx) != 0)
+  for (sctx = ctx->sources; sctx != NULL; sctx = sctx->next)
+    {
+      if (init_source_state (ctx, sctx) != 0)
+	return -1;
+    }
+
+  if ((ctx->source_table = make_source_table (ctx->sources)) == 0)
+    {
+      fprintf (stderr, "Out of memory building source table\n");
+      return -1;
+    }
+  for (i = 0; i < ctx->nworkers; ++i)
+    {
+      if ((ctx->workers[i].match_cache = make_match_cache ()) == 0
+	  || (ctx->workers[i].templates = make_template_cache ()) == 0
+	  || (ctx->workers[i].records = make_record_sampler ()) == 0)
+	{
+	  fprintf (stderr, "Out of memory\n");
+	  return -1;
+	}
+      ctx->workers[i].random_state = (uint64_t) monotonic_ns ()
+	^ ((uint64_t) (i + 1) * 0x9e3779b97f4a7c15ULL);
+      if (ctx->workers[i].random_state == 0)
+	ctx->workers[i].random_state = 1;
+      ctx->workers[i].table = ctx->source_table;
+      ctx->workers[i].generation = ctx->source_table->generation;
+    }
+
+  for (i = 0; i < 4; ++i)
+    ctx->send_socks[i / 2][i % 2] = -1;
+  ctx->health = 0;
+  ctx->health_prober_p = 0;
+  if (make_send_sockets (ctx, ctx->sources) != 0)
+    {
+      return -1;
+    }
+  if (ctx->stats_socket != 0
+      && (ctx->stats_fd = make_stats_socket (ctx->stats_socket)) == -1)
     {
       return -1;
     }
@@ -243,249 +709,2450 @@ init_samplicator (ctx)
   return 0;
 }
 
+/*
+ struct receive_batch
+
+ Preallocated buffers for up to SIZE datagrams, which are filled by
+ receive_pdus() with a single recvmmsg() call when batching is
+ enabled (-B).  PDUS[k].data points into BUFFERS, which holds SIZE
+ slots of CTX->pdulen bytes each.  With -i or -X, only PDUS is used,
+ and the datagrams stay in the worker's receive ring or UMEM.
+
+ With -I, the datagrams stay in the io_uring's receive buffers.  They
+ are collected in STAGED as their completions are seen, and become
+ the next batch, when the NHELD buffers of the current one are
+ released (see uring_receive_pdus()).  SIZE is the number of
+ buffers.
+ */
+struct receive_batch {
+  unsigned			size;
+  unsigned char		       *buffers;
+  struct pdu		       *pdus;
+  struct pdu		       *staged;
+  unsigned			nstaged;
+  unsigned			nheld;
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr	       *msgs;
+  struct iovec		       *iovs;
+  unsigned char		       *controls; /* RECV_CONTROL_SPACE each */
+#endif
+};
+
+/* Reading from a receive ring or AF_XDP socket costs no system
+   calls, so batches are bigger by default. */
+#define CAPTURE_BATCH_SIZE 64
+
+/* The minimum number of receive buffers of an io_uring, and the
+   maximum (a limit of the kernel's buffer rings). */
+#define URING_MIN_BUFFERS 64
+#define URING_MAX_BUFFERS 32768
+
+/* Room for the ancillary data we ask for on the receive socket. */
+#ifdef SO_RXQ_OVFL
+# define RXQ_OVFL_SPACE CMSG_SPACE (sizeof (uint32_t))
+#else
+# define RXQ_OVFL_SPACE 0
+#endif
+#ifdef UDP_GRO
+# define GRO_SPACE CMSG_SPACE (sizeof (int))
+#else
+# define GRO_SPACE 0
+#endif
+/* Plus an empty header, so that this is never zero. */
+#define RECV_CONTROL_SPACE (RXQ_OVFL_SPACE + GRO_SPACE + CMSG_SPACE (0))
+
 static int
-match_addr_p (struct sockaddr *input_generic,
-	      struct sockaddr *addr_generic,
-	      struct sockaddr *mask_generic)
+init_receive_batch (ctx, batch)
+     struct samplicator_context *ctx;
+     struct receive_batch *batch;
 {
-#define SPECIALIZE(VAR, STRUCT) \
-  struct STRUCT *VAR = (struct STRUCT *) VAR ## _generic
+  unsigned k;
 
-  if (addr_generic->sa_family == AF_INET)
+  if (ctx->capture_dev != 0 || ctx->xdp_dev != 0)
     {
-      SPECIALIZE (addr, sockaddr_in);
-      SPECIALIZE (mask, sockaddr_in);
-      if (addr->sin_addr.s_addr == 0)
-	return 1;
-      if (input_generic->sa_family == AF_INET)
+      batch->size = ctx->batch_size > 1 ? ctx->batch_size : CAPTURE_BATCH_SIZE;
+      if ((batch->pdus = calloc (batch->size, sizeof (struct pdu))) == 0)
 	{
-	  SPECIALIZE (input, sockaddr_in);
-	  if ((input->sin_addr.s_addr & mask->sin_addr.s_addr) == addr->sin_addr.s_addr)
-	    return 1;
-	  return 0;
+	  fprintf (stderr, "Out of memory allocating receive batch\n");
+	  return -1;
 	}
-      else if (input_generic->sa_family == AF_INET6)
+      return 0;
+    }
+  if (ctx->io_uring)
+    {
+      /* A power of two, as required for the buffer ring. */
+      for (batch->size = URING_MIN_BUFFERS;
+	   batch->size < (unsigned) ctx->batch_size
+	     && batch->size < URING_MAX_BUFFERS;
+	   batch->size *= 2)
+	;
+      batch->pdus = calloc (batch->size, sizeof (struct pdu));
+      batch->staged = calloc (batch->size, sizeof (struct pdu));
+      if (batch->pdus == 0 || batch->staged == 0)
 	{
-	  SPECIALIZE (input, sockaddr_in6);
-	  if (IN6_IS_ADDR_V4MAPPED (&input->sin6_addr))
-	    {
-	      abort ();		/* TODO */
-	    }
-	  else
-	    {
-	      return 0;
-	    }
+	  fprintf (stderr, "Out of memory allocating receive batch\n");
+	  return -1;
 	}
-      else
-	abort ();		/* Unexpected address family */
+      batch->nstaged = batch->nheld = 0;
+      return 0;
     }
-  else
+#ifdef HAVE_RECVMMSG
+  batch->size = ctx->batch_size > 1 ? ctx->batch_size : 1;
+#else
+  if (ctx->batch_size > 1)
+    fprintf (stderr, "Warning: recvmmsg() not available, ignoring -B %d\n",
+	     ctx->batch_size);
+  batch->size = 1;
+#endif
+  batch->buffers = malloc (batch->size * ctx->pdulen);
+  batch->pdus = calloc (batch->size, sizeof (struct pdu));
+  if (batch->buffers == 0 || batch->pdus == 0)
+    {
+      fprintf (stderr, "Out of memory allocating receive batch\n");
+      return -1;
+    }
+  for (k = 0; k < batch->size; ++k)
+    batch->pdus[k].data = batch->buffers + k * ctx->pdulen;
+#ifdef HAVE_RECVMMSG
+  batch->msgs = calloc (batch->size, sizeof (struct mmsghdr));
+  batch->iovs = calloc (batch->size, sizeof (struct iovec));
+  batch->controls = calloc (batch->size, RECV_CONTROL_SPACE);
+  if (batch->msgs == 0 || batch->iovs == 0 || batch->controls == 0)
+    {
+      fprintf (stderr, "Out of memory allocating receive batch\n");
+      return -1;
+    }
+  for (k = 0; k < batch->size; ++k)
     {
-      SPECIALIZE (addr, sockaddr_in6);
-      SPECIALIZE (mask, sockaddr_in6);
+      batch->iovs[k].iov_base = batch->pdus[k].data;
+      batch->iovs[k].iov_len = ctx->pdulen;
+      batch->msgs[k].msg_hdr.msg_name = &batch->pdus[k].addr;
+      batch->msgs[k].msg_hdr.msg_iov = &batch->iovs[k];
+      batch->msgs[k].msg_hdr.msg_iovlen = 1;
+      batch->msgs[k].msg_hdr.msg_control
+	= batch->controls + k * RECV_CONTROL_SPACE;
+    }
+#endif
+  return 0;
+}
 
-      if (IN6_IS_ADDR_UNSPECIFIED (&mask->sin6_addr))
-	{
-	  return 1;
-	}
-      else if (input_generic->sa_family == AF_INET)
-	{
-	  abort ();
-	}
-      else if (input_generic->sa_family == AF_INET6)
+/*
+ note_receive_drops(w, mh)
+
+ Look for an SO_RXQ_OVFL control message in MH, which was received
+ by worker W.  The kernel reports the total number of datagrams
+ dropped on the socket so far; the increase since the last report is
+ added to the worker's in_drops.  No control message means nothing has been
+ dropped yet.
+ */
+static void
+note_receive_drops (w, mh)
+     struct worker *w;
+     struct msghdr *mh;
+{
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR (mh); cmsg != 0; cmsg = CMSG_NXTHDR (mh, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
 	{
-	  SPECIALIZE (input, sockaddr_in6);
-	  unsigned k;
-	  for (k = 0; k < 16; ++k)
+	  uint32_t drops, delta;
+
+	  memcpy (&drops, CMSG_DATA (cmsg), sizeof drops);
+	  if ((delta = drops - w->in_drops_seen) != 0)
 	    {
-	      if ((input->sin6_addr.s6_addr[k] & mask->sin6_addr.s6_addr[k])
-		  != addr->sin6_addr.s6_addr[k])
-		{
-		  return 0;
-		}
-	      return 1;
+	      STAT_ADD (w->ctx->stats[w->index].in_drops, delta);
+	      w->in_drops_seen = drops;
+	      if (w->ctx->debug)
+		fprintf (stderr, "%lu datagrams dropped on receive socket\n",
+			 (unsigned long) delta);
 	    }
-	  abort ();
 	}
-      else
-	abort ();		/* Unexpected address family */
     }
-#undef SPECIALIZE
+#endif
 }
 
-static int
-samplicate (ctx)
-     struct samplicator_context *ctx;
+/*
+ gro_segment_size(mh)
+
+ Return the segment size from the UDP_GRO control message in MH, or
+ zero if there is none.  With UDP_GRO, a buffer may hold a run of
+ datagrams from the same sender, all of this size except that the
+ last one may be shorter (see samplicate_pdu()).
+ */
+static unsigned
+gro_segment_size (mh)
+     struct msghdr *mh;
 {
-  unsigned char fpdu[ctx->pdulen];
-  struct sockaddr_storage remote_address;
-  struct source_context *sctx;
-  unsigned i;
-  int n;
-  socklen_t addrlen;
-  char host[INET6_ADDRSTRLEN];
-  char serv[6];
+#ifdef UDP_GRO
+  struct cmsghdr *cmsg;
 
-  while (1)
+  for (cmsg = CMSG_FIRSTHDR (mh); cmsg != 0; cmsg = CMSG_NXTHDR (mh, cmsg))
     {
-      if (ctx->timeout)
-      {
-          struct pollfd fds[1];
-          fds[0].fd=ctx->fsockfd;
-          fds[0].events=POLLIN;
-          int rc=poll(fds, 1, ctx->timeout);
-          if (!rc)
-          {
-              fprintf (stderr, "Timeout, no data received in %d milliseconds.\n",
-                  ctx->timeout);
-              exit (5);
-          }
-      }
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+	{
+	  int size;
 
-      addrlen = sizeof remote_address;
-      if ((n = recvfrom (ctx->fsockfd, (char*)fpdu,
-			 sizeof (fpdu), MSG_TRUNC,
-			 (struct sockaddr *) &remote_address, &addrlen)) == -1)
+	  memcpy (&size, CMSG_DATA (cmsg), sizeof size);
+	  return size > 0 ? size : 0;
+	}
+    }
+#endif
+  return 0;
+}
+
+/*
+ receive_pdus(w)
+
+ Block until at least one datagram is available on the receive
+ socket of worker W, and read as many datagrams as are available, up
+ to the size of its batch.  Returns the number of datagrams stored in
+ W->batch->pdus, which is zero if the wait was interrupted by a
+ signal (see reload_config()).  With -i or -X, the datagrams are read
+ from the worker's receive ring or AF_XDP socket, and are only valid
+ until the next call.
+ */
+static unsigned
+receive_pdus (w)
+     struct worker *w;
+{
+  struct samplicator_context *ctx = w->ctx;
+  struct receive_batch *batch = w->batch;
+  unsigned npdus, k;
+
+  if (w->rx_ring != 0 || w->xsk != 0)
+    {
+      unsigned long drops;
+
+      while ((npdus = (w->rx_ring != 0
+		       ? rx_ring_receive (w->rx_ring, batch->pdus, batch->size)
+		       : xsk_receive (w->xsk, batch->pdus, batch->size))) == 0)
 	{
-	  fprintf (stderr, "recvfrom(): %s\n", strerror(errno));
-	  exit (1);
+	  struct pollfd pfd;
+
+	  pfd.fd = w->fsockfd;
+	  pfd.events = POLLIN;
+	  if (poll (&pfd, 1, -1) == -1)
+	    {
+	      if (errno == EINTR)
+		return 0;
+	      fprintf (stderr, "poll(): %s\n", strerror (errno));
+	      exit (1);
+	    }
 	}
-      if (n > ctx->pdulen)
+      if ((drops = (w->rx_ring != 0
+		    ? rx_ring_drops (w->rx_ring) : xsk_drops (w->xsk))) != 0)
 	{
-	  fprintf (stderr, "Warning: %ld excess bytes discarded\n",
-		   n-ctx->pdulen);
-	  n = ctx->pdulen;
+	  STAT_ADD (ctx->stats[w->index].in_drops, drops);
+	  if (ctx->debug)
+	    fprintf (stderr, "%lu packets dropped on receive ring\n", drops);
 	}
-      if (addrlen != ctx->fsockaddrlen)
+      return npdus;
+    }
+#ifdef HAVE_RECVMMSG
+  if (batch->size > 1)
+    {
+      int n;
+
+      for (k = 0; k < batch->size; ++k)
 	{
-	  fprintf (stderr, "recvfrom() return address length %lu - expected %lu\n",
-		   (unsigned long) addrlen, (unsigned long) ctx->fsockaddrlen);
-	  exit (1);
+	  batch->msgs[k].msg_hdr.msg_namelen = sizeof batch->pdus[k].addr;
+	  batch->msgs[k].msg_hdr.msg_controllen = RECV_CONTROL_SPACE;
 	}
-      if (ctx->debug)
+      if ((n = recvmmsg (w->fsockfd, batch->msgs, batch->size,
+			 MSG_WAITFORONE|MSG_TRUNC, 0)) == -1)
 	{
-	  if (getnameinfo ((struct sockaddr *) &remote_address, addrlen,
-			   host, INET6_ADDRSTRLEN,
-			   serv, 6,
-			   NI_NUMERICHOST|NI_NUMERICSERV) == -1)
-	    {
-	      strcpy (host, "???");
-	      strcpy (serv, "?????");
-	    }
-	  fprintf (stderr, "received %d bytes from %s:%s\n", n, host, serv);
+	  if (errno == EINTR)
+	    return 0;
+	  fprintf (stderr, "recvmmsg(): %s\n", strerror(errno));
+	  exit (1);
 	}
-
-      for (sctx = ctx->sources; sctx != NULL; sctx = sctx->next)
+      for (k = 0; k < (unsigned) n; ++k)
 	{
-	  if (match_addr_p ((struct sockaddr *) &remote_address,
-			    (struct sockaddr *) &sctx->source,
-			    (struct sockaddr *) &sctx->mask))
-	    {
-	      sctx->matched_packets += 1;
-	      sctx->matched_octets += n;
+	  batch->pdus[k].len = batch->msgs[k].msg_len;
+	  batch->pdus[k].addrlen = batch->msgs[k].msg_hdr.msg_namelen;
+	  batch->pdus[k].gro_size
+	    = gro_segment_size (&batch->msgs[k].msg_hdr);
+	}
+      /* The drop count only grows, so the last message has the most
+	 recent value. */
+      note_receive_drops (w, &batch->msgs[n-1].msg_hdr);
+      npdus = n;
+    }
+  else
+#endif
+    {
+      struct pdu *pdu = &batch->pdus[0];
+      union {
+	struct cmsghdr align;
+	unsigned char buf[RECV_CONTROL_SPACE];
+      } control;
+      struct msghdr mh;
+      struct iovec iov;
+      int n;
+
+      iov.iov_base = pdu->data;
+      iov.iov_len = ctx->pdulen;
+      bzero (&mh, sizeof mh);
+      mh.msg_name = &pdu->addr;
+      mh.msg_namelen = sizeof pdu->addr;
+      mh.msg_iov = &iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = control.buf;
+      mh.msg_controllen = sizeof control.buf;
+      if ((n = recvmsg (w->fsockfd, &mh, MSG_TRUNC)) == -1)
+	{
+	  if (errno == EINTR)
+	    return 0;
+	  fprintf (stderr, "recvmsg(): %s\n", strerror(errno));
+	  exit (1);
+	}
+      pdu->len = n;
+      pdu->addrlen = mh.msg_namelen;
+      pdu->gro_size = gro_segment_size (&mh);
+      note_receive_drops (w, &mh);
+      npdus = 1;
+    }
+  check_received_pdus (w, npdus);
+  return npdus;
+}
+
+/*
+ check_received_pdus(w, npdus)
+
+ Check the first NPDUS datagrams of the receive batch of worker W,
+ which have been received from a socket.  Truncated datagrams are
+ reported.
+ */
+static void
+check_received_pdus (w, npdus)
+     struct worker *w;
+     unsigned npdus;
+{
+  struct samplicator_context *ctx = w->ctx;
+  unsigned k;
+
+  for (k = 0; k < npdus; ++k)
+    {
+      struct pdu *pdu = &w->batch->pdus[k];
+
+      if (pdu->len > (size_t) ctx->pdulen)
+	{
+	  fprintf (stderr, "Warning: %ld excess bytes discarded\n",
+		   (long) pdu->len-ctx->pdulen);
+	  pdu->len = ctx->pdulen;
+	}
+      if (pdu->addrlen != ctx->fsockaddrlen)
+	{
+	  fprintf (stderr, "recvfrom() return address length %lu - expected %lu\n",
+		   (unsigned long) pdu->addrlen, (unsigned long) ctx->fsockaddrlen);
+	  exit (1);
+	}
+      pdu->payload_sum_p = 0;
+    }
+}
+
+/*
+ send_blocked_p(w, fd)
+
+ Return non-zero if send socket FD was found full by worker W, and
+ poll() hasn't reported it writable since.
+ */
+static int
+send_blocked_p (w, fd)
+     struct worker *w;
+     int fd;
+{
+  unsigned k;
+
+  for (k = 0; k < w->nblocked; ++k)
+    if (w->blocked_fds[k] == fd)
+      return 1;
+  return 0;
+}
+
+/*
+ note_send_blocked(w, fd)
+
+ Remember that send socket or ring FD is full, so that worker W waits
+ for it to become writable before sending through it again.  The set
+ of blocked descriptors grows as needed, since a worker may send
+ through any number of sockets and rings.
+ */
+static void
+note_send_blocked (w, fd)
+     struct worker *w;
+     int fd;
+{
+  if (send_blocked_p (w, fd))
+    return;
+  if (w->nblocked == w->max_blocked)
+    {
+      unsigned max = w->max_blocked ? 2 * w->max_blocked : 8;
+      int *fds;
+      struct pollfd *pfds;
+
+      if ((fds = realloc (w->blocked_fds, max * sizeof *fds)) == 0)
+	return;
+      w->blocked_fds = fds;
+      if ((pfds = realloc (w->pollfds, (max + 1) * sizeof *pfds)) == 0)
+	return;
+      w->pollfds = pfds;
+      w->max_blocked = max;
+    }
+  w->blocked_fds[w->nblocked++] = fd;
+}
+
+/*
+ check_send_errors(w)
+
+ Read the error queues of the cooked send sockets, so that receivers
+ that turn out to be unreachable are marked as down (see health.c).
+ Each worker that sends does this every SEND_ERROR_CHECK_NS, and
+ right away when a send reports such an error.
+ */
+static void
+check_send_errors (w)
+     struct worker *w;
+{
+  int k;
+
+  for (k = 0; k < 2; ++k)
+    if (w->ctx->send_socks[0][k] != -1)
+      health_check_errors (w->ctx, w->ctx->send_socks[0][k], w->now);
+  w->next_error_check = w->now + SEND_ERROR_CHECK_NS;
+}
+
+#ifdef HAVE_SENDMMSG
+/*
+ struct send_queue
+
+ Datagrams waiting to be sent over one of the shared cooked send
+ sockets (see make_send_sockets()).  The queue is flushed with
+ sendmmsg() at the end of each receive batch, or earlier when it is
+ full.  IOVS[d] references the data of datagram d in the receive
+ batch, so the queue must be flushed before that batch is reused.
+ RECEIVERS[d] records which receiver the datagram is for, so that
+ statistics can be kept per datagram.  If the socket is full, the
+ datagrams that could not be sent are moved to their receivers'
+ transmit queues.
+
+ When the queue is flushed, the datagrams are turned into NMSGS
+ messages in MSGS.  Where the kernel supports UDP_SEGMENT, datagrams
+ of the same size for the same receiver are coalesced into a single
+ message, which the kernel sends as one "super packet" through the
+ stack, and splits up only at the end (see build_send_msgs()).  The
+ iovecs of each message are in SEGS, and MSG_RECEIVERS[m] is the
+ receiver of message m.
+
+ With -I, the messages are submitted to the worker's io_uring as a
+ chain of linked sendmsg requests instead (see submit_send_queue()),
+ of which INFLIGHT have not completed yet.  The datagrams stay in the
+ queue until all have completed.  When a request fails, the rest of
+ the chain is cancelled; if that was because the socket is full
+ (BLOCKED), the remaining datagrams are moved to the transmit queues,
+ otherwise they are submitted again from message RESTART on.
+ */
+struct send_run;
+
+struct send_queue {
+  int				fd;
+  unsigned			size;
+  unsigned			count;
+  struct iovec		       *iovs;
+  struct receiver	      **receivers;
+  unsigned		       *next; /* see build_send_msgs() */
+  struct send_run	       *runs;
+  unsigned			nmsgs;
+  struct mmsghdr	       *msgs;
+  struct iovec		       *segs;
+  struct receiver	      **msg_receivers;
+  unsigned char		       *controls; /* GSO_CONTROL_SPACE each */
+  unsigned			inflight;
+  unsigned			restart;
+  int				blocked;
+};
+
+/* A run of datagrams for the same receiver that is to become one
+   message: NSEGS datagrams, linked through the queue's NEXT array
+   from FIRST to LAST, of SEG_SIZE bytes each except that the last
+   one may be shorter, in which case the run is CLOSED. */
+struct send_run {
+  unsigned			first;
+  unsigned			last;
+  unsigned			nsegs;
+  size_t			seg_size;
+  size_t			bytes;
+  int				closed;
+};
+
+#define MAX_SEND_QUEUE 1024	/* UIO_MAXIOV, the limit for sendmmsg() */
+
+/* The number of datagrams that may be coalesced into a message
+   (UDP_MAX_SEGMENTS of older kernels), and their maximum total size,
+   the largest UDP payload over IPv4. */
+#ifdef UDP_SEGMENT
+# define GSO_MAX_SEGMENTS 64
+#else
+# define GSO_MAX_SEGMENTS 1
+#endif
+#define GSO_MAX_BYTES 65507
+#define GSO_CONTROL_SPACE CMSG_SPACE (sizeof (uint16_t))
+
+/*
+ init_send_queues(w)
+
+ Allocate the send queues of worker W, with room for a copy of each
+ datagram of a receive batch to every receiver, so that a batch is
+ normally sent with one system call per queue.  The batch size is
+ W->batch->size rather than -B, since -i, -X and -I receive larger
+ batches than the default of one.
+ */
+static int
+init_send_queues (w)
+     struct worker *w;
+{
+  struct samplicator_context *ctx = w->ctx;
+  struct source_context *sctx;
+  unsigned nreceivers = 0, size, k;
+
+  for (sctx = ctx->sources; sctx != NULL; sctx = sctx->next)
+    nreceivers += sctx->nreceivers;
+  size = nreceivers * w->batch->size;
+  if (size > MAX_SEND_QUEUE)
+    size = MAX_SEND_QUEUE;
+
+  if ((w->send_queues = calloc (2, sizeof (struct send_queue))) == 0)
+    {
+      fprintf (stderr, "Out of memory allocating send queues\n");
+      return -1;
+    }
+  for (k = 0; k < 2; ++k)
+    {
+      struct send_queue *q = &w->send_queues[k];
+
+      q->fd = -1;
+      q->size = size;
+      q->iovs = calloc (size, sizeof (struct iovec));
+      q->receivers = calloc (size, sizeof (struct receiver *));
+      q->next = calloc (size, sizeof (unsigned));
+      q->runs = calloc (size, sizeof (struct send_run));
+      q->msgs = calloc (size, sizeof (struct mmsghdr));
+      q->segs = calloc (size, sizeof (struct iovec));
+      q->msg_receivers = calloc (size, sizeof (struct receiver *));
+      q->controls = calloc (size, GSO_CONTROL_SPACE);
+      if (q->iovs == 0 || q->receivers == 0 || q->next == 0 || q->runs == 0
+	  || q->msgs == 0 || q->segs == 0 || q->msg_receivers == 0
+	  || q->controls == 0)
+	{
+	  fprintf (stderr, "Out of memory allocating send queues\n");
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/*
+ build_send_msgs(w, q)
+
+ Turn the datagrams in send queue Q of worker W into messages.  A
+ datagram joins the most recent run of its receiver if it is no
+ larger than the run's first datagram, the run is not closed, and the
+ limits for coalescing allow it; otherwise it starts a new run.  The
+ receiver's state records its most recent run in GSO_RUN while the
+ runs are built.  Datagrams for the same receiver thus stay in order,
+ while those for different receivers may be reordered.
+
+ The segment size of each run must be smaller than the receiver's
+ GSO_TOO_BIG, if that is set (see send_segments()).
+ */
+static void
+build_send_msgs (w, q)
+     struct worker *w;
+     struct send_queue *q;
+{
+  unsigned d, m, k, nsegs = 0;
+
+  q->nmsgs = 0;
+  for (d = 0; d < q->count; ++d)
+    {
+      struct receiver_state *state = &q->receivers[d]->state[w->index];
+      size_t len = q->iovs[d].iov_len;
+      struct send_run *run
+	= state->gso_run != 0 ? &q->runs[state->gso_run - 1] : 0;
+
+      if (run != 0 && !run->closed
+	  && run->nsegs < GSO_MAX_SEGMENTS
+	  && len <= run->seg_size && run->seg_size > 0
+	  && run->bytes + len <= GSO_MAX_BYTES
+	  && (state->gso_too_big == 0 || run->seg_size < state->gso_too_big))
+	{
+	  q->next[run->last] = d;
+	  run->last = d;
+	  ++run->nsegs;
+	  run->bytes += len;
+	  run->closed = len < run->seg_size;
+	}
+      else
+	{
+	  run = &q->runs[q->nmsgs++];
+	  run->first = run->last = d;
+	  run->nsegs = 1;
+	  run->seg_size = run->bytes = len;
+	  run->closed = 0;
+	  state->gso_run = q->nmsgs;
+	}
+    }
+  for (m = 0; m < q->nmsgs; ++m)
+    {
+      struct send_run *run = &q->runs[m];
+      struct receiver *receiver = q->receivers[run->first];
+      struct msghdr *mh = &q->msgs[m].msg_hdr;
+
+      receiver->state[w->index].gso_run = 0;
+      q->msg_receivers[m] = receiver;
+      mh->msg_name = &receiver->addr;
+      mh->msg_namelen = receiver->addrlen;
+      mh->msg_iov = &q->segs[nsegs];
+      mh->msg_iovlen = run->nsegs;
+      for (k = 0, d = run->first; k < run->nsegs; ++k, d = q->next[d])
+	q->segs[nsegs++] = q->iovs[d];
+      mh->msg_control = 0;
+      mh->msg_controllen = 0;
+#ifdef UDP_SEGMENT
+      if (run->nsegs > 1)
+	{
+	  uint16_t gso_size = run->seg_size;
+	  struct cmsghdr *cmsg;
+
+	  mh->msg_control = q->controls + m * GSO_CONTROL_SPACE;
+	  mh->msg_controllen = GSO_CONTROL_SPACE;
+	  cmsg = CMSG_FIRSTHDR (mh);
+	  cmsg->cmsg_level = SOL_UDP;
+	  cmsg->cmsg_type = UDP_SEGMENT;
+	  cmsg->cmsg_len = CMSG_LEN (sizeof gso_size);
+	  memcpy (CMSG_DATA (cmsg), &gso_size, sizeof gso_size);
+	}
+#endif
+    }
+}
+
+/* Account for the attempt to send message M of send queue Q, see
+   note_send_result(). */
+static void
+note_msg_result (w, q, m, result)
+     struct worker *w;
+     struct send_queue *q;
+     unsigned m;
+     int result;
+{
+  struct msghdr *mh = &q->msgs[m].msg_hdr;
+  int saved_errno = errno;
+  size_t k;
+
+  for (k = 0; k < mh->msg_iovlen; ++k)
+    {
+      errno = saved_errno;
+      note_send_result (w, q->msg_receivers[m], mh->msg_iov[k].iov_len,
+			result);
+    }
+}
+
+/* Move the datagrams of message M of send queue Q from segment FROM
+   on to the transmit queue of its receiver, because the socket is
+   full. */
+static void
+defer_msg (w, q, m, from)
+     struct worker *w;
+     struct send_queue *q;
+     unsigned m;
+     size_t from;
+{
+  struct receiver *receiver = q->msg_receivers[m];
+  struct msghdr *mh = &q->msgs[m].msg_hdr;
+  size_t k;
+
+  for (k = from; k < mh->msg_iovlen; ++k)
+    {
+      struct pdu pdu;
+
+      pdu.data = mh->msg_iov[k].iov_base;
+      pdu.len = mh->msg_iov[k].iov_len;
+      pdu.addrlen = 0;	/* not needed for cooked receivers */
+      pdu.payload_sum_p = 0;
+      receiver_refund (receiver, pdu.len);
+      enqueue_pending_pdu (w, &receiver->state[w->index], &pdu);
+    }
+}
+
+/* Return non-zero if error ERR for message MH means that the kernel
+   or the outgoing interface cannot segment it. */
+static int
+gso_rejected_p (mh, err)
+     const struct msghdr *mh;
+     int err;
+{
+  return mh->msg_iovlen > 1
+    && (err == EINVAL || err == EMSGSIZE || err == EIO
+	|| err == ENOPROTOOPT || err == EOPNOTSUPP);
+}
+
+/*
+ send_segments(w, q, m, err)
+
+ Send the datagrams of message M of send queue Q one by one, after
+ the kernel rejected the message with ERR.  EINVAL and EMSGSIZE mean
+ that the segments don't fit the path MTU, so only smaller ones are
+ coalesced for the receiver from now on; otherwise, coalescing is
+ turned off for it.  Returns -1 if the socket became full, in which
+ case the rest of the datagrams have been queued, and 0 otherwise.
+ */
+static int
+send_segments (w, q, m, err)
+     struct worker *w;
+     struct send_queue *q;
+     unsigned m;
+     int err;
+{
+  struct receiver *receiver = q->msg_receivers[m];
+  struct receiver_state *state = &receiver->state[w->index];
+  struct msghdr *mh = &q->msgs[m].msg_hdr;
+  size_t k;
+
+  state->gso_too_big = err == EINVAL || err == EMSGSIZE
+    ? mh->msg_iov[0].iov_len : 1;
+  if (w->ctx->debug)
+    fprintf (stderr, "UDP_SEGMENT of %lu bytes rejected: %s\n",
+	     (unsigned long) mh->msg_iov[0].iov_len, strerror (err));
+  for (k = 0; k < mh->msg_iovlen; ++k)
+    {
+      int result = sendto (q->fd, mh->msg_iov[k].iov_base,
+			   mh->msg_iov[k].iov_len, 0,
+			   mh->msg_name, mh->msg_namelen);
+
+      if (result == -1 && WOULD_BLOCK_P (errno))
+	{
+	  note_send_blocked (w, q->fd);
+	  defer_msg (w, q, m, k);
+	  return -1;
+	}
+      note_send_result (w, receiver, mh->msg_iov[k].iov_len,
+			result == -1 ? -1 : 0);
+    }
+  return 0;
+}
+
+/*
+ resend_msg(w, q, m)
+
+ Send message M of send queue Q once more, after it failed with an
+ error that may have been about an earlier datagram (see
+ ASYNC_SEND_ERROR_P), which the socket has forgotten now.  Returns -1
+ if the socket is full, and 0 otherwise.
+ */
+static int
+resend_msg (w, q, m)
+     struct worker *w;
+     struct send_queue *q;
+     unsigned m;
+{
+  check_send_errors (w);
+  if (sendmsg (q->fd, &q->msgs[m].msg_hdr, 0) == -1)
+    {
+      if (WOULD_BLOCK_P (errno))
+	{
+	  note_send_blocked (w, q->fd);
+	  defer_msg (w, q, m, 0);
+	  return -1;
+	}
+      note_msg_result (w, q, m, -1);
+    }
+  else
+    note_msg_result (w, q, m, 0);
+  return 0;
+}
+
+/*
+ submit_send_queue(w, q)
+
+ Prepare the messages of send queue Q of worker W from Q->restart on
+ as a chain of sendmsg requests on the worker's io_uring.  They are
+ submitted with the next uring_submit().
+ */
+static void
+submit_send_queue (w, q)
+     struct worker *w;
+     struct send_queue *q;
+{
+  uint32_t qindex = q == &w->send_queues[0] ? 0 : 1;
+  unsigned m;
+
+  for (m = q->restart; m < q->nmsgs; ++m)
+    uring_sendmsg (w->uring, q->fd, &q->msgs[m].msg_hdr, qindex << 16 | m,
+		   m + 1 < q->nmsgs);
+  q->inflight += q->nmsgs - q->restart;
+  q->restart = q->nmsgs;
+  q->blocked = 0;
+}
+
+/*
+ note_uring_send(w, tag, res)
+
+ Account for the completion with result RES of the sendmsg request
+ with TAG (see submit_send_queue()) of worker W.
+ */
+static void
+note_uring_send (w, tag, res)
+     struct worker *w;
+     uint32_t tag;
+     int res;
+{
+  struct send_queue *q = &w->send_queues[tag >> 16];
+  unsigned m = tag & 0xffff;
+
+  --q->inflight;
+  if (res >= 0)
+    note_msg_result (w, q, m, 0);
+  else if (res == -ECANCELED && !q->blocked)
+    {
+      if (m < q->restart)
+	q->restart = m;
+    }
+  else if (res == -ECANCELED || WOULD_BLOCK_P (-res))
+    {
+      if (!q->blocked)
+	{
+	  q->blocked = 1;
+	  note_send_blocked (w, q->fd);
+	}
+      defer_msg (w, q, m, 0);
+    }
+  else if (gso_rejected_p (&q->msgs[m].msg_hdr, -res))
+    {
+      if (send_segments (w, q, m, -res) != 0)
+	q->blocked = 1;
+    }
+  else if (ASYNC_SEND_ERROR_P (-res))
+    {
+      if (resend_msg (w, q, m) != 0)
+	q->blocked = 1;
+    }
+  else
+    {
+      errno = -res;
+      note_msg_result (w, q, m, -1);
+    }
+  if (q->inflight == 0)
+    {
+      if (q->restart < q->nmsgs)
+	submit_send_queue (w, q);
+      else
+	q->count = q->nmsgs = q->restart = 0;
+    }
+}
+
+static void
+flush_send_queue (w, q)
+     struct worker *w;
+     struct send_queue *q;
+{
+  unsigned k = 0, j;
+  int n;
+
+  if (w->uring != 0)
+    {
+      if (q->inflight == 0)
+	{
+	  build_send_msgs (w, q);
+	  submit_send_queue (w, q);
+	}
+      wait_uring_sends (w);
+      return;
+    }
+  build_send_msgs (w, q);
+  while (k < q->nmsgs)
+    {
+      if ((n = sendmmsg (q->fd, &q->msgs[k], q->nmsgs - k, 0)) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (WOULD_BLOCK_P (errno))
+	    break;
+	  if (gso_rejected_p (&q->msgs[k].msg_hdr, errno))
+	    {
+	      if (send_segments (w, q, k++, errno) != 0)
+		break;
+	      continue;
+	    }
+	  if (ASYNC_SEND_ERROR_P (errno))
+	    {
+	      if (resend_msg (w, q, k++) != 0)
+		break;
+	      continue;
+	    }
+	  /* The first remaining message failed; skip it and go on
+	     with the rest. */
+	  note_msg_result (w, q, k, -1);
+	  ++k;
+	  continue;
+	}
+      for (j = k; j < k + n; ++j)
+	note_msg_result (w, q, j, 0);
+      k += n;
+    }
+  if (k < q->nmsgs)
+    {
+      note_send_blocked (w, q->fd);
+      for (; k < q->nmsgs; ++k)
+	defer_msg (w, q, k, 0);
+    }
+  q->count = q->nmsgs = 0;
+}
+
+/* At the end of a batch.  With -I, the sends are only prepared here,
+   and submitted together with the wait for the next batch. */
+static void
+flush_send_queues (w)
+     struct worker *w;
+{
+  unsigned k;
+
+  if (w->uring != 0)
+    {
+      for (k = 0; k < 2; ++k)
+	if (w->send_queues[k].inflight == 0)
+	  {
+	    build_send_msgs (w, &w->send_queues[k]);
+	    submit_send_queue (w, &w->send_queues[k]);
+	  }
+      return;
+    }
+  flush_send_queue (w, &w->send_queues[0]);
+  flush_send_queue (w, &w->send_queues[1]);
+}
+
+static void
+enqueue_pdu (w, receiver, pdu)
+     struct worker *w;
+     struct receiver *receiver;
+     struct pdu *pdu;
+{
+  struct send_queue *q
+    = &w->send_queues[receiver->addr.ss_family == AF_INET ? 0 : 1];
+
+  if (q->count == q->size)
+    flush_send_queue (w, q);
+  q->fd = receiver->fd;
+  q->iovs[q->count].iov_base = pdu->data;
+  q->iovs[q->count].iov_len = pdu->len;
+  q->receivers[q->count] = receiver;
+  ++q->count;
+}
+#endif /* HAVE_SENDMMSG */
+
+/*
+ note_send_result(w, receiver, length, result)
+
+ Update worker W's statistics of RECEIVER after an attempt to send
+ LENGTH bytes to it.  RESULT is -1 if the send failed (with errno
+ set), and 0 otherwise.
+ */
+static void
+note_send_result (w, receiver, length, result)
+     struct worker *w;
+     struct receiver *receiver;
+     size_t length;
+     int result;
+{
+  struct receiver_stats *stats = &receiver->state[w->index].stats;
+  char host[INET6_ADDRSTRLEN];
+  char serv[6];
+
+  if (result == -1)
+    {
+      int saved_errno = errno;
+
+      STAT_ADD (stats->out_errors, 1);
+      if (getnameinfo ((struct sockaddr *) &receiver->addr,
+		       receiver->addrlen,
+		       host, INET6_ADDRSTRLEN,
+		       serv, 6,
+		       NI_NUMERICHOST|NI_NUMERICSERV)
+	  == -1)
+	{
+	  strcpy (host, "???");
+	  strcpy (serv, "?????");
+	}
+      fprintf (stderr, "sending datagram to %s:%s failed: %s\n",
+	       host, serv, strerror (saved_errno));
+    }
+  else
+    {
+      STAT_ADD (stats->out_packets, 1);
+      STAT_ADD (stats->out_octets, length);
+
+      if (w->ctx->debug)
+	{
+	  if (getnameinfo ((struct sockaddr *) &receiver->addr,
+			   receiver->addrlen,
+			   host, INET6_ADDRSTRLEN,
+			   serv, 6,
+			   NI_NUMERICHOST|NI_NUMERICSERV)
+	      == -1)
+	    {
+	      strcpy (host, "???");
+	      strcpy (serv, "?????");
+	    }
+	  fprintf (stderr, "  sent to %s:%s\n", host, serv); 
+	}
+    }
+}
+
+/*
+ Paced and deferred transmission
+
+ A receiver with a rate limit (the pps= and bps= receiver options, or
+ -x) may not be able to take a datagram right away, and neither can a
+ receiver whose send socket is full.  In that case, the datagram is
+ copied to the receiver's transmit queue in the worker's
+ receiver_state, and the state is put on the worker's list of pending
+ states.  service_pending_queues() sends queued datagrams as the rate
+ limits and the send sockets allow.  When a queue is full, either the
+ new datagram or (with drop=head) the oldest queued one is dropped
+ and counted in out_drops.
+ */
+static int64_t
+receiver_conform (receiver, length, now)
+     struct receiver *receiver;
+     size_t length;
+     int64_t now;
+{
+  struct receiver_pacing *pacing = receiver->pacing;
+  int64_t t;
+
+  if ((t = rate_limit_conform (&receiver->pps_limit, &pacing->pps_tat_ns,
+			       1, now)) != 0)
+    return t;
+  if ((t = rate_limit_conform (&receiver->bps_limit, &pacing->bps_tat_ns,
+			       length * 8, now)) != 0)
+    {
+      rate_limit_refund (&receiver->pps_limit, &pacing->pps_tat_ns, 1);
+      return t;
+    }
+  return 0;
+}
+
+/*
+ receiver_refund(receiver, length)
+
+ Return the rate limit tokens taken for a datagram of LENGTH bytes to
+ RECEIVER that could not be sent after all.
+ */
+static void
+receiver_refund (receiver, length)
+     struct receiver *receiver;
+     size_t length;
+{
+  if (receiver->flags & pf_PACED)
+    {
+      rate_limit_refund (&receiver->pps_limit,
+			 &receiver->pacing->pps_tat_ns, 1);
+      rate_limit_refund (&receiver->bps_limit,
+			 &receiver->pacing->bps_tat_ns, length * 8);
+    }
+}
+
+static void
+enqueue_pending_pdu (w, state, pdu)
+     struct worker *w;
+     struct receiver_state *state;
+     const struct pdu *pdu;
+{
+  struct receiver *receiver = state->receiver;
+  int was_empty = state->queue_count == 0;
+  unsigned char *data;
+  struct pdu *qp;
+
+  if (state->queue == 0
+      && (state->queue = calloc (receiver->queue_limit,
+				 sizeof (struct pdu))) == 0)
+    {
+      STAT_ADD (state->stats.out_drops, 1);
+      return;
+    }
+  if (state->queue_count == receiver->queue_limit
+      && !(receiver->flags & pf_DROP_HEAD))
+    {
+      STAT_ADD (state->stats.out_drops, 1);
+      return;
+    }
+  if ((data = malloc (pdu->len)) == 0)
+    {
+      STAT_ADD (state->stats.out_drops, 1);
+      return;
+    }
+  if (state->queue_count == receiver->queue_limit)
+    {
+      /* drop=head: make room by discarding the oldest datagram. */
+      STAT_ADD (state->stats.out_drops, 1);
+      free (state->queue[state->queue_head].data);
+      state->queue_head = (state->queue_head + 1) % receiver->queue_limit;
+      --state->queue_count;
+    }
+  qp = &state->queue[(state->queue_head + state->queue_count)
+		     % receiver->queue_limit];
+  qp->data = data;
+  memcpy (qp->data, pdu->data, pdu->len);
+  qp->len = pdu->len;
+  memcpy (&qp->addr, &pdu->addr, pdu->addrlen);
+  qp->addrlen = pdu->addrlen;
+  qp->payload_sum = pdu->payload_sum;
+  qp->payload_sum_p = pdu->payload_sum_p;
+  ++state->queue_count;
+  if (was_empty)
+    {
+      state->next_pending = w->pending;
+      w->pending = state;
+    }
+}
+
+/*
+ receiver_send_fd(w, receiver)
+
+ Return the file descriptor through which worker W sends to
+ RECEIVER, for keeping track of blocked sockets.
+ */
+static int
+receiver_send_fd (w, receiver)
+     struct worker *w;
+     struct receiver *receiver;
+{
+  struct tx_ring *r = receiver->state[w->index].tx_ring;
+
+  if (w->xsk != 0 && receiver->ifindex == xsk_ifindex (w->xsk))
+    return xsk_fd (w->xsk);
+  return r != 0 ? tx_ring_fd (r) : receiver->fd;
+}
+
+/*
+ try_send_pdu(w, receiver, pdu)
+
+ Send PDU to RECEIVER right away, and account for the result.
+ Returns -1 without accounting if the send socket is full, 0
+ otherwise.
+ */
+static int
+try_send_pdu (w, receiver, pdu)
+     struct worker *w;
+     struct receiver *receiver;
+     struct pdu *pdu;
+{
+  int result = send_pdu_to_receiver (w, receiver, pdu);
+
+  if (result == -1 && ASYNC_SEND_ERROR_P (errno)
+      && !(receiver->flags & pf_SPOOF))
+    {
+      /* Probably about another datagram, see resend_msg(). */
+      check_send_errors (w);
+      result = send_pdu_to_receiver (w, receiver, pdu);
+    }
+  if (result == -1 && WOULD_BLOCK_P (errno))
+    {
+      note_send_blocked (w, receiver_send_fd (w, receiver));
+      return -1;
+    }
+  note_send_result (w, receiver, pdu->len, result);
+  return 0;
+}
+
+/*
+ service_pending_queues(w, now)
+
+ Send as many queued datagrams of worker W as the receivers' rate
+ limits and send sockets allow at time NOW.  Returns the earliest time
+ at which another queued datagram can be sent according to the rate
+ limits, or zero if there is no such time, because all queues are
+ empty or wait for a send socket to become writable.
+ */
+static int64_t
+service_pending_queues (w, now)
+     struct worker *w;
+     int64_t now;
+{
+  struct receiver_state **prev = &w->pending, *state;
+  int64_t next = 0, t;
+
+  while ((state = *prev) != 0)
+    {
+      struct receiver *receiver = state->receiver;
+
+      while (state->queue_count > 0
+	     && !send_blocked_p (w, receiver_send_fd (w, receiver)))
+	{
+	  struct pdu *qp = &state->queue[state->queue_head];
+
+	  if ((receiver->flags & pf_PACED)
+	      && (t = receiver_conform (receiver, qp->len, now)) != 0)
+	    {
+	      if (next == 0 || t < next)
+		next = t;
+	      break;
+	    }
+	  if (try_send_pdu (w, receiver, qp) != 0)
+	    {
+	      receiver_refund (receiver, qp->len);
+	      break;
+	    }
+	  free (qp->data);
+	  state->queue_head = (state->queue_head + 1) % receiver->queue_limit;
+	  --state->queue_count;
+	}
+      if (state->queue_count == 0)
+	*prev = state->next_pending;
+      else
+	prev = &state->next_pending;
+    }
+  return next;
+}
+
+/*
+ transmit_pdu(w, receiver, pdu)
+
+ Send PDU to RECEIVER.  Datagrams are queued if earlier datagrams for
+ the receiver are still waiting, or if the receiver's rate limit
+ doesn't allow them to be sent now.  Datagrams for cooked
+ (non-spoofing) receivers are queued for batched transmission with
+ sendmmsg(); everything else is sent right away.
+ */
+static void
+transmit_pdu (w, receiver, pdu)
+     struct worker *w;
+     struct receiver *receiver;
+     struct pdu *pdu;
+{
+  struct receiver_state *state = &receiver->state[w->index];
+
+  if (state->queue_count > 0
+      || ((receiver->flags & pf_PACED)
+	  && receiver_conform (receiver, pdu->len, w->now) != 0))
+    {
+      enqueue_pending_pdu (w, state, pdu);
+      return;
+    }
+#ifdef HAVE_SENDMMSG
+  if (!(receiver->flags & pf_SPOOF))
+    {
+      enqueue_pdu (w, receiver, pdu);
+      return;
+    }
+#endif
+  if (try_send_pdu (w, receiver, pdu) != 0)
+    {
+      receiver_refund (receiver, pdu->len);
+      enqueue_pending_pdu (w, state, pdu);
+    }
+}
+
+/*
+ debug_unmatched_sources(sources, matches, nmatches)
+
+ Print the source contexts in SOURCES that are not among the NMATCHES
+ entries of MATCHES, which must be in configuration order.
+ */
+static void
+debug_unmatched_sources (sources, matches, nmatches)
+     struct source_context *sources;
+     struct source_context **matches;
+     unsigned nmatches;
+{
+  struct source_context *sctx;
+  char host[INET6_ADDRSTRLEN];
+  unsigned m = 0;
+
+  for (sctx = sources; sctx != NULL; sctx = sctx->next)
+    {
+      if (m < nmatches && matches[m] == sctx)
+	{
+	  ++m;
+	  continue;
+	}
+      if (getnameinfo ((struct sockaddr *) &sctx->source,
+		       sctx->addrlen,
+		       host, INET6_ADDRSTRLEN,
+		       0, 0,
+		       NI_NUMERICHOST|NI_NUMERICSERV)
+	  == -1)
+	{
+	  strcpy (host, "???");
+	}
+      fprintf (stderr, "Not matching %s/", host);
+      if (getnameinfo ((struct sockaddr *) &sctx->mask,
+		       sctx->addrlen,
+		       host, INET6_ADDRSTRLEN,
+		       0, 0,
+		       NI_NUMERICHOST|NI_NUMERICSERV)
+	  == -1)
+	{
+	  strcpy (host, "???");
+	}
+      fprintf (stderr, "%s\n", host);
+    }
+}
+
+/*
+ replay_templates(w, receiver, pdu, scope)
+
+ Send the NetFlow v9 or IPFIX templates of SCOPE, the template scope
+ of PDU, to RECEIVER, if it has the templates= option and is due for
+ them (see template_replay_due()).  They are sent before PDU itself,
+ so that a receiver can decode the data records of PDU even if they
+ use a template that has only just appeared.
+
+ Each receiver gets its own copies of the replay datagrams, with the
+ header completed by template_stamp().  They are made in the arena of
+ the worker's record sampler, which is only reset once the sends of
+ the batch have completed, see run_worker().
+ */
+static void
+replay_templates (w, receiver, pdu, scope)
+     struct worker *w;
+     struct receiver *receiver;
+     struct pdu *pdu;
+     struct template_scope *scope;
+{
+  const struct iovec *datagrams;
+  struct pdu replay;
+  unsigned k, n;
+
+  if (!template_replay_due (scope, receiver, w->now,
+			    (int64_t) receiver->template_interval * 1000000000))
+    return;
+  n = template_replay (scope, &datagrams);
+  if (w->ctx->debug)
+    fprintf (stderr, "  replaying templates in %u datagrams\n", n);
+  replay = *pdu;
+  replay.gro_size = 0;
+  for (k = 0; k < n; ++k)
+    {
+      replay.len = datagrams[k].iov_len;
+      if ((replay.data = record_sampler_buffer (w->records, replay.len)) == 0)
+	{
+	  STAT_ADD (receiver->state[w->index].stats.out_drops, 1);
+	  continue;
+	}
+      memcpy (replay.data, datagrams[k].iov_base, replay.len);
+      template_stamp (scope, receiver, replay.data, pdu->data);
+      replay.payload_sum_p = 0;
+      transmit_pdu (w, receiver, &replay);
+    }
+}
+
+/*
+ transmit_renumbered(w, receiver, pdu, scope)
+
+ Send a NetFlow v9 datagram PDU of SCOPE to RECEIVER, which has the
+ templates= option, with the next sequence number of RECEIVER, so
+ that template replays fit in without taking one of the exporter's
+ numbers (see template_stamp()).
+ */
+static void
+transmit_renumbered (w, receiver, pdu, scope)
+     struct worker *w;
+     struct receiver *receiver;
+     struct pdu *pdu;
+     struct template_scope *scope;
+{
+  struct pdu copy;
+
+  copy = *pdu;
+  if ((copy.data = record_sampler_buffer (w->records, pdu->len)) == 0)
+    {
+      STAT_ADD (receiver->state[w->index].stats.out_drops, 1);
+      return;
+    }
+  memcpy (copy.data, pdu->data, pdu->len);
+  template_stamp (scope, receiver, copy.data, pdu->data);
+  copy.payload_sum_p = 0;
+  copy.gro_size = 0;
+  transmit_pdu (w, receiver, &copy);
+}
+
+/* What is known about the datagram that samplicate_datagram() is
+   sending, found out when a receiver first needs it: its template
+   scope, whether the worker's record sampler has taken it apart
+   (RECORDS_P is 1), or could not (-1), and its key for sampling=hash,
+   see datagram_sample_key(). */
+struct datagram_info {
+  struct template_scope	       *scope;
+  int				scope_p;
+  int				records_p;
+  uint64_t			sample_key;
+  int				sample_key_p;
+};
+
+/*
+ datagram_sample_key(pdu)
+
+ Return the key by which receivers with sampling=hash sample PDU: a
+ hash of the exporter's address, and for NetFlow v5, v9 and IPFIX,
+ the engine or observation domain and the sequence number from the
+ header; for anything else, the contents of PDU.  So any samplicator
+ that gets PDU picks it, or the same records of it, for a receiver
+ with the same sampling rate.
+ */
+static uint64_t
+datagram_sample_key (pdu)
+     struct pdu *pdu;
+{
+  const unsigned char *d = pdu->data;
+  unsigned char addr[16];
+  size_t off = 0, len = 0;
+
+  hash_address_bytes ((struct sockaddr *) &pdu->addr, addr);
+  /* The part of the header with the sequence number and the engine
+     or observation domain. */
+  if (pdu->len >= 2)
+    switch ((d[0] << 8) | d[1])
+      {
+      case 5:
+	off = 16, len = 6;
+	break;
+      case 9:
+	off = 12, len = 8;
+	break;
+      case 10:
+	off = 8, len = 8;
+	break;
+      }
+  if (len == 0 || pdu->len < off + len)
+    off = 0, len = pdu->len;
+  return hash_fnv1a (hash_fnv1a (FNV_OFFSET_BASIS, addr, sizeof addr),
+		     d + off, len);
+}
+
+/* Set up S for RECEIVER to sample PDU, see sampling.h. */
+static void
+init_sampler (struct sampler *s, struct worker *w, struct receiver *receiver,
+	      struct pdu *pdu, struct datagram_info *info)
+{
+  s->mode = receiver->sampling;
+  s->freq = receiver->freq;
+  s->freqcount = &receiver->state[w->index].freqcount;
+  s->threshold = receiver->sample_threshold;
+  s->random_state = &w->random_state;
+  if (s->mode == SAMPLING_HASH && !info->sample_key_p)
+    {
+      info->sample_key = datagram_sample_key (pdu);
+      info->sample_key_p = 1;
+    }
+  s->key = info->sample_key;
+}
+
+/*
+ transmit_records(w, receiver, pdu, info, member)
+
+ Send the records that RECEIVER samples from PDU, which has been
+ taken apart by record_sampler_parse(), see records.c.  Unless MEMBER
+ is negative, RECEIVER is that member of a receiver group, and only
+ gets the records assigned to it.
+ */
+static void
+transmit_records (w, receiver, pdu, info, member)
+     struct worker *w;
+     struct receiver *receiver;
+     struct pdu *pdu;
+     struct datagram_info *info;
+     int member;
+{
+  const unsigned char *data;
+  struct sampler sampler;
+  struct pdu sample;
+  size_t len;
+
+  init_sampler (&sampler, w, receiver, pdu, info);
+  if ((len = record_sampler_select (w->records, receiver, member,
+				    &sampler, &data)) == 0)
+    return;
+  sample = *pdu;
+  sample.data = (unsigned char *) data;
+  sample.len = len;
+  sample.payload_sum_p = 0;
+  sample.gro_size = 0;
+  transmit_pdu (w, receiver, &sample);
+}
+
+static struct template_scope *
+datagram_scope (struct worker *w, struct pdu *pdu, struct datagram_info *info)
+{
+  if (!info->scope_p)
+    {
+      info->scope = template_cache_update (w->templates,
+					   (struct sockaddr *) &pdu->addr,
+					   pdu->data, pdu->len);
+      info->scope_p = 1;
+    }
+  return info->scope;
+}
+
+static int
+datagram_records_p (struct worker *w, struct pdu *pdu,
+		    struct datagram_info *info)
+{
+  if (info->records_p == 0)
+    info->records_p = datagram_scope (w, pdu, info) != 0
+      && record_sampler_parse (w->records, info->scope,
+			       pdu->data, pdu->len) == 0 ? 1 : -1;
+  return info->records_p > 0;
+}
+
+/*
+ samplicate_to_receiver(w, receiver, pdu, info)
+
+ Send PDU to RECEIVER, or the records that it samples from PDU,
+ honoring its sampling rate, preceded by templates if it is due for
+ them.
+ */
+static void
+samplicate_to_receiver (w, receiver, pdu, info)
+     struct worker *w;
+     struct receiver *receiver;
+     struct pdu *pdu;
+     struct datagram_info *info;
+{
+  struct sampler sampler;
+
+  if (receiver->template_interval != 0 && datagram_scope (w, pdu, info) != 0)
+    replay_templates (w, receiver, pdu, info->scope);
+  if ((receiver->flags & pf_RECORDS) && datagram_records_p (w, pdu, info))
+    {
+      transmit_records (w, receiver, pdu, info, -1);
+      return;
+    }
+  init_sampler (&sampler, w, receiver, pdu, info);
+  if (!sample_p (&sampler, 0))
+    return;
+  if (receiver->template_interval != 0 && info->scope != 0
+      && pdu->len >= 20 && pdu->data[0] == 0 && pdu->data[1] == 9)
+    transmit_renumbered (w, receiver, pdu, info->scope);
+  else
+    transmit_pdu (w, receiver, pdu);
+}
+
+/* The argument of choose_member(). */
+struct member_choice {
+  const struct receiver_group  *group;
+  int64_t			now;
+};
+
+static unsigned
+choose_member (const void *arg, uint64_t key)
+{
+  const struct member_choice *choice = arg;
+
+  return receiver_group_choose (choice->group, key, choice->now);
+}
+
+/*
+ samplicate_to_group(w, group, pdu, info)
+
+ Send PDU to the member of GROUP that its exporter hashes to, or with
+ hash=flow, send each member the records of PDU whose flow key hashes
+ to it (see groups.c).  Members that are down (see health.c) get
+ nothing.  Members still sample by their own rates.
+ */
+static void
+samplicate_to_group (w, group, pdu, info)
+     struct worker *w;
+     struct receiver_group *group;
+     struct pdu *pdu;
+     struct datagram_info *info;
+{
+  uint64_t key = receiver_group_exporter_key ((struct sockaddr *) &pdu->addr);
+  struct member_choice choice;
+  unsigned k;
+
+  choice.group = group;
+  choice.now = w->now;
+  if (group->flow_p && datagram_records_p (w, pdu, info)
+      && record_sampler_assign (w->records, choose_member, &choice, key) == 0)
+    {
+      int any_up_p = 0;
+
+      for (k = 0; k < group->nmembers; ++k)
+	any_up_p |= receiver_up_p (group->members[k], w->now);
+      for (k = 0; k < group->nmembers; ++k)
+	{
+	  struct receiver *member = group->members[k];
+
+	  /* Not even template sets for members that are down, unless
+	     they all are, and share the records after all. */
+	  if (any_up_p && !receiver_up_p (member, w->now))
+	    continue;
+	  if (member->template_interval != 0)
+	    replay_templates (w, member, pdu, info->scope);
+	  transmit_records (w, member, pdu, info, k);
+	}
+      return;
+    }
+  samplicate_to_receiver (w, group->members[receiver_group_choose (group, key,
+								   w->now)],
+			  pdu, info);
+}
+
+/*
+ samplicate_datagram(w, pdu, matches, nmatches)
+
+ Send a copy of the single datagram PDU to every receiver of the
+ NMATCHES source contexts in MATCHES, honoring per-receiver sampling,
+ and to one member of each receiver group.
+ */
+static void
+samplicate_datagram (w, pdu, matches, nmatches)
+     struct worker *w;
+     struct pdu *pdu;
+     struct source_context **matches;
+     unsigned nmatches;
+{
+  struct samplicator_context *ctx = w->ctx;
+  struct source_context *sctx;
+  struct datagram_info info;
+  unsigned i, m;
+
+  if (nmatches == 0)
+    STAT_ADD (ctx->stats[w->index].unmatched_packets, 1);
+
+  info.scope = 0;
+  info.scope_p = info.records_p = info.sample_key_p = 0;
+  for (m = 0; m < nmatches; ++m)
+    {
+      sctx = matches[m];
+      STAT_ADD (sctx->stats[w->index].matched_packets, 1);
+      STAT_ADD (sctx->stats[w->index].matched_octets, pdu->len);
+
+      for (i = 0; i < sctx->nreceivers; ++i)
+	{
+	  struct receiver *receiver = &(sctx->receivers[i]);
+
+	  if (receiver->group == 0)
+	    samplicate_to_receiver (w, receiver, pdu, &info);
+	  else if (receiver == receiver->group->members[0])
+	    samplicate_to_group (w, receiver->group, pdu, &info);
+	}
+    }
+}
+
+/*
+ samplicate_pdu(w, pdu)
+
+ Send a copy of PDU to every receiver of every source context that
+ matches its sender address, honoring per-receiver sampling.
+
+ If PDU is a UDP_GRO buffer (see gro_segment_size()), it holds a run
+ of datagrams from the same sender, which are split up here.  The
+ sender is only matched once for the whole run.
+ */
+static void
+samplicate_pdu (w, pdu)
+     struct worker *w;
+     struct pdu *pdu;
+{
+  struct samplicator_context *ctx = w->ctx;
+  struct source_context **matches;
+  unsigned nmatches;
+  struct pdu seg;
+  size_t off;
+  char host[INET6_ADDRSTRLEN];
+  char serv[6];
+
+  if (ctx->debug)
+    {
+      if (getnameinfo ((struct sockaddr *) &pdu->addr, pdu->addrlen,
+		       host, INET6_ADDRSTRLEN,
+		       serv, 6,
+		       NI_NUMERICHOST|NI_NUMERICSERV) == -1)
+	{
+	  strcpy (host, "???");
+	  strcpy (serv, "?????");
+	}
+      if (pdu->gro_size != 0 && pdu->len > pdu->gro_size)
+	fprintf (stderr, "received %lu bytes in %lu datagrams from %s:%s\n",
+		 (unsigned long) pdu->len,
+		 (unsigned long) ((pdu->len + pdu->gro_size - 1)
+				  / pdu->gro_size),
+		 host, serv);
+      else
+	fprintf (stderr, "received %lu bytes from %s:%s\n",
+		 (unsigned long) pdu->len, host, serv);
+    }
+
+  nmatches = match_cache_lookup (w->match_cache, w->table,
+				 (struct sockaddr *) &pdu->addr, &matches);
+  if (ctx->debug)
+    debug_unmatched_sources (w->table->sources, matches, nmatches);
+
+  if (pdu->gro_size == 0 || pdu->len <= pdu->gro_size)
+    {
+      samplicate_datagram (w, pdu, matches, nmatches);
+      return;
+    }
+  seg = *pdu;
+  seg.gro_size = 0;
+  for (off = 0; off < pdu->len; off += seg.len)
+    {
+      seg.data = pdu->data + off;
+      seg.len = pdu->len - off < pdu->gro_size
+	? pdu->len - off : pdu->gro_size;
+      seg.payload_sum_p = 0;
+      samplicate_datagram (w, &seg, matches, nmatches);
+    }
+}
+
+/*
+ wait_for_input(w, deadline)
+
+ Wait until the receive socket of worker W is readable, or until time
+ DEADLINE (see monotonic_ns()) if that is non-zero.  Returns 1 if the
+ socket is readable, and 0 if the deadline has passed, the wait was
+ interrupted by a signal, or one of the worker's blocked send sockets
+ has become writable; such sockets are removed from W->blocked_fds.
+
+ This also implements the -t option: if no worker has received
+ anything for CTX->timeout milliseconds, exit with status 5.  With
+ several workers, a worker that receives no traffic of its own keeps
+ waiting as long as some other worker does.
+ */
+static int
+wait_for_input (w, deadline)
+     struct worker *w;
+     int64_t deadline;
+{
+  struct samplicator_context *ctx = w->ctx;
+  struct pollfd one, *fds = w->pollfds ? w->pollfds : &one;
+  unsigned nfds, k;
+  int64_t now;
+  int timeout, rc;
+
+  fds[0].fd = w->fsockfd;
+  fds[0].events = POLLIN;
+  for (nfds = 1; nfds <= w->nblocked; ++nfds)
+    {
+      fds[nfds].fd = w->blocked_fds[nfds-1];
+      fds[nfds].events = POLLOUT;
+    }
+  while (1)
+    {
+      timeout = -1;
+      if (deadline != 0)
+	{
+	  if ((now = monotonic_ns ()) >= deadline)
+	    return 0;
+	  timeout = (deadline - now + 999999) / 1000000;
+	}
+      if (ctx->timeout && (timeout == -1 || ctx->timeout < timeout))
+	timeout = ctx->timeout;
+      if ((rc = poll (fds, nfds, timeout)) > 0)
+	{
+	  for (k = nfds - 1; k > 0; --k)
+	    if (fds[k].revents)
+	      w->blocked_fds[k-1] = w->blocked_fds[--w->nblocked];
+	  return fds[0].revents != 0;
+	}
+      if (rc == -1 && errno == EINTR)
+	return 0;
+      if (rc == -1)
+	{
+	  fprintf (stderr, "poll(): %s\n", strerror (errno));
+	  exit (1);
+	}
+      exit_if_timed_out (ctx);
+    }
+}
 
-	      for (i = 0; i < sctx->nreceivers; ++i)
-		{
-		  struct receiver *receiver = &(sctx->receivers[i]);
+/* The -t option, see wait_for_input(). */
+static void
+exit_if_timed_out (ctx)
+     struct samplicator_context *ctx;
+{
+  if (ctx->timeout
+      && monotonic_ns () / 1000000
+	 - __atomic_load_n (&ctx->last_receive_ms, __ATOMIC_RELAXED)
+	 >= ctx->timeout)
+    {
+      fprintf (stderr, "Timeout, no data received in %d milliseconds.\n",
+	       ctx->timeout);
+      exit (5);
+    }
+}
 
-		  if (receiver->freqcount == 0)
-		    {
-		      if (send_pdu_to_receiver (receiver, fpdu, n, (struct sockaddr *) &remote_address)
-			  == -1)
-			{
-			  receiver->out_errors += 1;
-			  if (getnameinfo ((struct sockaddr *) &receiver->addr,
-					   receiver->addrlen,
-					   host, INET6_ADDRSTRLEN,
-					   serv, 6,
-					   NI_NUMERICHOST|NI_NUMERICSERV)
-			      == -1)
-			    {
-			      strcpy (host, "???");
-			      strcpy (serv, "?????");
-			    }
-			  fprintf (stderr, "sending datagram to %s:%s failed: %s\n",
-				   host, serv, strerror (errno));
-			}
-		      else
-			{
-			  receiver->out_packets += 1;
-			  receiver->out_octets += n;
-
-			  if (ctx->debug)
-			    {
-			      if (getnameinfo ((struct sockaddr *) &receiver->addr,
-					       receiver->addrlen,
-					       host, INET6_ADDRSTRLEN,
-					       serv, 6,
-					       NI_NUMERICHOST|NI_NUMERICSERV)
-				  == -1)
-				{
-				  strcpy (host, "???");
-				  strcpy (serv, "?????");
-				}
-			      fprintf (stderr, "  sent to %s:%s\n", host, serv); 
-			    }
-			}
-		      receiver->freqcount = receiver->freq-1;
-		    }
-		  else
-		    {
-		      receiver->freqcount -= 1;
-		    }
-		  if (sctx->tx_delay)
-		    usleep (sctx->tx_delay);
-		}
+/*
+ reap_uring(w, min_complete)
+
+ Submit the requests prepared on the io_uring of worker W, wait until
+ at least MIN_COMPLETE completions are available, and process all
+ completions.  Received datagrams are added to W->batch->staged.
+ Returns -1 if the wait was interrupted by a signal, and 0 otherwise.
+ */
+static int
+reap_uring (w, min_complete)
+     struct worker *w;
+     unsigned min_complete;
+{
+  struct receive_batch *batch = w->batch;
+  struct uring_completion c;
+  struct pdu *pdu;
+  unsigned k;
+
+  if (uring_submit (w->uring, min_complete) == -1)
+    {
+      if (errno == EINTR)
+	return -1;
+      fprintf (stderr, "io_uring_enter(): %s\n", strerror (errno));
+      exit (1);
+    }
+  while (uring_next (w->uring, &c))
+    {
+      switch (c.event)
+	{
+	case URING_RECV:
+	  if (c.res < 0)
+	    {
+	      fprintf (stderr, "io_uring recvmsg(): %s\n", strerror (-c.res));
+	      exit (1);
 	    }
-	  else
+	  /* Each staged datagram holds one of BATCH->size buffers. */
+	  pdu = &batch->staged[batch->nstaged++];
+	  pdu->data = c.data;
+	  pdu->len = c.len;
+	  memcpy (&pdu->addr, c.addr, c.addrlen);
+	  pdu->addrlen = c.addrlen;
+	  pdu->gro_size = gro_segment_size (&c.control);
+	  note_receive_drops (w, &c.control);
+	  break;
+	case URING_SEND:
+#ifdef HAVE_SENDMMSG
+	  note_uring_send (w, c.tag, c.res);
+#endif
+	  break;
+	case URING_POLL:
+	  for (k = 0; k < w->nblocked; ++k)
+	    if (w->blocked_fds[k] == (int) c.tag)
+	      w->blocked_fds[k--] = w->blocked_fds[--w->nblocked];
+	  break;
+	case URING_TIMEOUT:
+	  exit_if_timed_out (w->ctx);
+	  break;
+	}
+    }
+  return 0;
+}
+
+static unsigned
+uring_sends_inflight (w)
+     struct worker *w;
+{
+#ifdef HAVE_SENDMMSG
+  return w->send_queues[0].inflight + w->send_queues[1].inflight;
+#else
+  return 0;
+#endif
+}
+
+/* Wait until all sends submitted on the io_uring of worker W have
+   completed. */
+static void
+wait_uring_sends (w)
+     struct worker *w;
+{
+  unsigned n;
+
+  while ((n = uring_sends_inflight (w)) != 0)
+    reap_uring (w, n);
+}
+
+/*
+ uring_receive_pdus(w, deadline)
+
+ What wait_for_input() and receive_pdus() do for a worker W with an
+ io_uring.  The sends prepared for the previous batch are submitted,
+ and the worker waits until datagrams have been received, time
+ DEADLINE (if non-zero) has come, or one of its blocked send sockets
+ has become writable.  This takes a single io_uring_enter(), unless
+ the kernel could not complete the sends right away.
+
+ Once all sends have completed, the receive buffers of the previous
+ batch are released, and the datagrams received since become the new
+ batch.  Returns their number, which is zero if there are none or the
+ wait was interrupted by a signal.
+ */
+static unsigned
+uring_receive_pdus (w, deadline)
+     struct worker *w;
+     int64_t deadline;
+{
+  struct samplicator_context *ctx = w->ctx;
+  struct receive_batch *batch = w->batch;
+  struct pdu *pdus;
+  int64_t at = deadline;
+  unsigned npdus, k;
+
+  if (ctx->timeout)
+    {
+      int64_t t = monotonic_ns () + (int64_t) ctx->timeout * 1000000;
+
+      if (at == 0 || t < at)
+	at = t;
+    }
+  if (at != 0)
+    uring_set_timeout (w->uring, at);
+  for (k = 0; k < w->nblocked; ++k)
+    uring_poll_out (w->uring, w->blocked_fds[k]);
+  if (reap_uring (w, batch->nstaged == 0
+		     ? uring_sends_inflight (w) + 1 : 0) != 0)
+    return 0;
+  wait_uring_sends (w);
+  uring_release_buffers (w->uring, batch->nheld);
+  pdus = batch->pdus;
+  batch->pdus = batch->staged;
+  batch->staged = pdus;
+  npdus = batch->nheld = batch->nstaged;
+  batch->nstaged = 0;
+  check_received_pdus (w, npdus);
+  return npdus;
+}
+
+/*
+ Configuration reload
+
+ On SIGHUP, reload_config() parses the command line and configuration
+ file again into a new source list, and builds a new source table
+ from it, away from the forwarding path.  Receivers that are unchanged
+ in the new configuration take over the per-worker state of their
+ predecessors (sampling counters, queued datagrams and statistics),
+ and unchanged sources keep their statistics.
+
+ The new table is then published in CTX->source_table.  Each worker
+ switches to it at the top of its loop (see switch_source_table()),
+ and then records the table's generation in W->generation.  Workers
+ that are waiting for input are woken up with WAKEUP_SIGNAL.  Once
+ all workers and the statistics server have moved on, nothing refers
+ to the old configuration any more, and it is freed.
+ */
+#define WAKEUP_SIGNAL SIGUSR1
+
+static void
+wakeup_handler (int sig)
+{
+  /* Only here to interrupt system calls. */
+  (void) sig;
+}
+
+static int
+same_source_p (a, b)
+     const struct source_context *a;
+     const struct source_context *b;
+{
+  return a->addrlen == b->addrlen
+    && memcmp (&a->source, &b->source, a->addrlen) == 0
+    && memcmp (&a->mask, &b->mask, a->addrlen) == 0;
+}
+
+static int
+same_string_p (const char *a, const char *b)
+{
+  return a == 0 || b == 0 ? a == b : strcmp (a, b) == 0;
+}
+
+/* Receivers are the same if they have the same address and options,
+   so that the sampling and pacing state of one is right for the
+   other. */
+static int
+same_receiver_p (a, b)
+     const struct receiver *a;
+     const struct receiver *b;
+{
+  return a->addrlen == b->addrlen
+    && memcmp (&a->addr, &b->addr, a->addrlen) == 0
+    && a->freq == b->freq
+    && a->sampling == b->sampling
+    && a->health_port == b->health_port
+    && same_string_p (a->group_name, b->group_name)
+    && a->ttl == b->ttl
+    && a->flags == b->flags
+    && a->queue_limit == b->queue_limit
+    && a->template_interval == b->template_interval
+    && a->ifindex == b->ifindex
+    && memcmp (a->lladdr, b->lladdr, sizeof a->lladdr) == 0
+    && a->pps_limit.ns_per_unit == b->pps_limit.ns_per_unit
+    && a->pps_limit.tolerance_ns == b->pps_limit.tolerance_ns
+    && a->bps_limit.ns_per_unit == b->bps_limit.ns_per_unit
+    && a->bps_limit.tolerance_ns == b->bps_limit.tolerance_ns;
+}
+
+/*
+ take_over_state(old_sources, new_sources)
+
+ Let sources and receivers in NEW_SOURCES take over the statistics
+ and state of their unchanged counterparts in OLD_SOURCES, and link
+ each such predecessor to its successor.
+ */
+static void
+take_over_state (old_sources, new_sources)
+     struct source_context *old_sources;
+     struct source_context *new_sources;
+{
+  struct source_context *op, *np;
+  unsigned i, j;
+
+  for (np = new_sources; np != 0; np = np->next)
+    {
+      for (op = old_sources; op != 0; op = op->next)
+	if (op->successor == 0 && same_source_p (op, np))
+	  break;
+      if (op == 0)
+	continue;
+      op->successor = np;
+      np->stats = op->stats;
+      for (i = 0; i < np->nreceivers; ++i)
+	{
+	  struct receiver *nrcv = &np->receivers[i];
+
+	  for (j = 0; j < op->nreceivers; ++j)
 	    {
-	      if (ctx->debug)
+	      struct receiver *orcv = &op->receivers[j];
+
+	      if (orcv->successor == 0 && same_receiver_p (orcv, nrcv))
 		{
-		  if (getnameinfo ((struct sockaddr *) &sctx->source,
-				   sctx->addrlen,
-				   host, INET6_ADDRSTRLEN,
-				   0, 0,
-				   NI_NUMERICHOST|NI_NUMERICSERV)
-		      == -1)
-		    {
-		      strcpy (host, "???");
-		    }
-		  fprintf (stderr, "Not matching %s/", host);
-		  if (getnameinfo ((struct sockaddr *) &sctx->mask,
-				   sctx->addrlen,
-				   host, INET6_ADDRSTRLEN,
-				   0, 0,
-				   NI_NUMERICHOST|NI_NUMERICSERV)
-		      == -1)
-		    {
-		      strcpy (host, "???");
-		    }
-		  fprintf (stderr, "%s\n", host);
+		  orcv->successor = nrcv;
+		  nrcv->state = orcv->state;
+		  nrcv->pacing = orcv->pacing;
+		  break;
 		}
 	    }
 	}
     }
 }
 
+/*
+ undo_take_over(old_sources)
+
+ Undo take_over_state(), leaving the state with OLD_SOURCES.
+ */
+static void
+undo_take_over (old_sources)
+     struct source_context *old_sources;
+{
+  struct source_context *op;
+  unsigned j;
+
+  for (op = old_sources; op != 0; op = op->next)
+    {
+      if (op->successor == 0)
+	continue;
+      for (j = 0; j < op->nreceivers; ++j)
+	{
+	  struct receiver *orcv = &op->receivers[j];
+
+	  if (orcv->successor != 0)
+	    {
+	      orcv->successor->state = 0;
+	      orcv->successor->pacing = 0;
+	      orcv->successor = 0;
+	    }
+	}
+      op->successor->stats = 0;
+      op->successor = 0;
+    }
+}
+
+/*
+ free_sources(ctx, sources)
+
+ Free the source list SOURCES, including the per-worker state that
+ hasn't been taken over by a successor.
+ */
+static void
+free_sources (ctx, sources)
+     struct samplicator_context *ctx;
+     struct source_context *sources;
+{
+  struct source_context *sctx;
+  unsigned i;
+  int k;
+
+  while ((sctx = sources) != 0)
+    {
+      sources = sctx->next;
+      for (i = 0; i < sctx->nreceivers; ++i)
+	{
+	  struct receiver *receiver = &sctx->receivers[i];
+
+	  free (receiver->raw_template);
+	  free (receiver->group_name);
+	  if (receiver->successor != 0 || receiver->state == 0)
+	    continue;
+	  for (k = 0; k < ctx->nworkers; ++k)
+	    free (receiver->state[k].queue);
+	  free (receiver->state);
+	  free (receiver->pacing);
+	}
+      for (i = 0; i < sctx->ngroups; ++i)
+	free (sctx->groups[i].members);
+      free (sctx->groups);
+      free (sctx->receivers);
+      if (sctx->successor == 0)
+	free (sctx->stats);
+      free (sctx);
+    }
+}
+
+/*
+ switch_source_table(w, table)
+
+ Make worker W use TABLE instead of W->table.  Datagrams still queued
+ for receivers that have no successor are dropped, and the
+ receiver_state entries of W are pointed to their new receivers.
+ With -I, sends that are still in flight refer to the old receivers,
+ so they are completed first.
+ */
+static void
+switch_source_table (w, table)
+     struct worker *w;
+     struct source_table *table;
+{
+  struct receiver_state **prev = &w->pending, *state;
+  struct source_context *sctx;
+  unsigned i;
+
+  wait_uring_sends (w);
+  template_cache_forget_receivers (w->templates);
+  while ((state = *prev) != 0)
+    {
+      struct receiver *receiver = state->receiver;
+
+      if (receiver->successor != 0)
+	{
+	  prev = &state->next_pending;
+	  continue;
+	}
+      while (state->queue_count > 0)
+	{
+	  free (state->queue[state->queue_head].data);
+	  state->queue_head = (state->queue_head + 1) % receiver->queue_limit;
+	  --state->queue_count;
+	}
+      *prev = state->next_pending;
+    }
+  for (sctx = table->sources; sctx != 0; sctx = sctx->next)
+    for (i = 0; i < sctx->nreceivers; ++i)
+      sctx->receivers[i].state[w->index].receiver = &sctx->receivers[i];
+  w->table = table;
+  __atomic_store_n (&w->generation, table->generation, __ATOMIC_RELEASE);
+}
+
+/*
+ reload_config(ctx)
+
+ Re-read the configuration, and switch all workers to it.  If the new
+ configuration cannot be used, the old one stays in effect.
+ */
+static void
+reload_config (ctx)
+     struct samplicator_context *ctx;
+{
+  struct samplicator_context new_ctx = *ctx;
+  struct source_table *old_table = ctx->source_table, *table;
+  struct source_context *sctx;
+  unsigned long g;
+  int k, waiting;
+
+  if (parse_args (ctx->argc, ctx->argv, &new_ctx) != 0)
+    {
+      fprintf (stderr, "Errors in configuration, not reloaded\n");
+      free_sources (ctx, new_ctx.sources);
+      return;
+    }
+  if (make_send_sockets (ctx, new_ctx.sources) != 0
+      || (table = make_source_table (new_ctx.sources)) == 0)
+    {
+      fprintf (stderr, "Cannot use new configuration, not reloaded\n");
+      free_sources (ctx, new_ctx.sources);
+      return;
+    }
+  take_over_state (ctx->sources, new_ctx.sources);
+  for (sctx = new_ctx.sources; sctx != 0; sctx = sctx->next)
+    {
+      if (init_source_state (ctx, sctx) != 0)
+	{
+	  undo_take_over (ctx->sources);
+	  free_sources (ctx, new_ctx.sources);
+	  free_source_table (table);
+	  return;
+	}
+    }
+
+  ctx->sources = new_ctx.sources;
+  __atomic_store_n (&ctx->source_table, table, __ATOMIC_SEQ_CST);
+  do
+    {
+      waiting = 0;
+      for (k = 0; k < ctx->nworkers; ++k)
+	{
+	  if (__atomic_load_n (&ctx->workers[k].generation, __ATOMIC_ACQUIRE)
+	      != table->generation)
+	    {
+	      waiting = 1;
+	      pthread_kill (ctx->workers[k].thread, WAKEUP_SIGNAL);
+	    }
+	}
+      g = __atomic_load_n (&ctx->stats_generation, __ATOMIC_SEQ_CST);
+      if (g != 0 && g != table->generation)
+	waiting = 1;
+      if (waiting)
+	{
+	  struct timespec ts = { 0, 10000000 };
+
+	  nanosleep (&ts, 0);
+	}
+    }
+  while (waiting);
+
+  free_sources (ctx, old_table->sources);
+  free_source_table (old_table);
+  start_health_prober (ctx);
+  if (ctx->debug)
+    fprintf (stderr, "Configuration reloaded, %u sources\n", table->nsources);
+}
+
+static void *
+run_reloader (arg)
+     void *arg;
+{
+  struct samplicator_context *ctx = arg;
+  sigset_t set;
+  int sig;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGHUP);
+  while (1)
+    {
+      if (sigwait (&set, &sig) == 0)
+	reload_config (ctx);
+    }
+  return 0;
+}
+
+/* Tell the kernel to send what worker W has put into its transmit
+   rings and AF_XDP socket. */
+static void
+flush_rings (w)
+     struct worker *w;
+{
+  flush_tx_rings (__atomic_load_n (&w->tx_rings, __ATOMIC_ACQUIRE));
+  if (w->xsk != 0)
+    flush_xsk (w->xsk);
+}
+
+static void *
+run_worker (arg)
+     void *arg;
+{
+  struct worker *w = arg;
+  struct samplicator_context *ctx = w->ctx;
+  struct source_table *table;
+  unsigned npdus, k;
+  int64_t deadline;
+  sigset_t set;
+
+  sigemptyset (&set);
+  sigaddset (&set, WAKEUP_SIGNAL);
+  pthread_sigmask (SIG_UNBLOCK, &set, 0);
+  if (w->uring != 0 && uring_start (w->uring) != 0)
+    exit (1);
+  while (1)
+    {
+      table = __atomic_load_n (&ctx->source_table, __ATOMIC_ACQUIRE);
+      if (table != w->table)
+	switch_source_table (w, table);
+
+      deadline = 0;
+      if (w->pending)
+	{
+	  deadline = service_pending_queues (w, monotonic_ns ());
+	  flush_rings (w);
+	}
+      if (w->uring != 0)
+	{
+	  if ((npdus = uring_receive_pdus (w, deadline)) == 0)
+	    continue;
+	}
+      else
+	{
+	  if (ctx->timeout || deadline != 0 || w->nblocked)
+	    {
+	      if (!wait_for_input (w, deadline))
+		continue;
+	    }
+	  if ((npdus = receive_pdus (w)) == 0)
+	    continue;
+	}
+      /* All sends of the previous batch have completed or have been
+	 copied to transmit queues, so outdated template replays and
+	 sampled records can go. */
+      template_cache_collect (w->templates);
+      record_sampler_reset (w->records);
+      w->now = monotonic_ns ();
+      if (ctx->timeout)
+	__atomic_store_n (&ctx->last_receive_ms, w->now / 1000000,
+			  __ATOMIC_RELAXED);
+      for (k = 0; k < npdus; ++k)
+	samplicate_pdu (w, &w->batch->pdus[k]);
+#ifdef HAVE_SENDMMSG
+      flush_send_queues (w);
+#endif
+      flush_rings (w);
+      if (w->now >= w->next_error_check)
+	check_send_errors (w);
+    }
+  return 0;
+}
+
+static int
+samplicate (ctx)
+     struct samplicator_context *ctx;
+{
+  struct sigaction sa;
+  sigset_t set;
+  pthread_t reloader;
+  int k, result;
+
+  /* SIGHUP is only handled by the reloader thread, and WAKEUP_SIGNAL
+     only interrupts workers (see run_worker()).  Block both before
+     creating any threads, so that they inherit that mask. */
+  bzero (&sa, sizeof sa);
+  sa.sa_handler = wakeup_handler;	/* without SA_RESTART */
+  sigemptyset (&sa.sa_mask);
+  sigaction (WAKEUP_SIGNAL, &sa, 0);
+  sigemptyset (&set);
+  sigaddset (&set, SIGHUP);
+  sigaddset (&set, WAKEUP_SIGNAL);
+  pthread_sigmask (SIG_BLOCK, &set, 0);
+  ctx->workers[0].thread = pthread_self ();
+
+  for (k = 0; k < ctx->nworkers; ++k)
+    {
+      struct worker *w = &ctx->workers[k];
+
+      if ((w->batch = malloc (sizeof (struct receive_batch))) == 0
+	  || init_receive_batch (ctx, w->batch) != 0)
+	return -1;
+#ifdef HAVE_SENDMMSG
+      if (init_send_queues (w) != 0)
+	return -1;
+#endif
+      if (ctx->io_uring)
+	{
+	  /* Room for both send queues, plus the receive request, the
+	     timeout and the polls. */
+	  unsigned entries = 32;
+
+#ifdef HAVE_SENDMMSG
+	  entries += w->send_queues[0].size + w->send_queues[1].size;
+#endif
+	  if ((w->uring = make_uring (w->fsockfd, entries, w->batch->size,
+				      ctx->pdulen, RECV_CONTROL_SPACE)) == 0)
+	    return -1;
+	}
+    }
+  ctx->last_receive_ms = monotonic_ns () / 1000000;
+  if (ctx->stats_fd != -1 && start_stats_server (ctx) != 0)
+    return -1;
+  if (start_health_prober (ctx) != 0)
+    return -1;
+  if ((result = pthread_create (&reloader, 0, run_reloader, ctx)) != 0)
+    {
+      fprintf (stderr, "pthread_create(): %s\n", strerror (result));
+      return -1;
+    }
+  for (k = 1; k < ctx->nworkers; ++k)
+    {
+      if ((result = pthread_create (&ctx->workers[k].thread, 0,
+				    run_worker, &ctx->workers[k])) != 0)
+	{
+	  fprintf (stderr, "pthread_create(): %s\n", strerror (result));
+	  return -1;
+	}
+    }
+  run_worker (&ctx->workers[0]);
+  return 0;
+}
+
+/*
+ send_pdu_to_receiver(w, receiver, pdu)
+
+ Send PDU to RECEIVER from worker W.  A spoofing receiver with the
+ dev= option gets its datagrams through the worker's transmit ring
+ for that interface, or its AF_XDP socket if that is on the same
+ interface, except for those that are too large for it.
+ */
 static int
-send_pdu_to_receiver (receiver, fpdu, length, source_addr)
+send_pdu_to_receiver (w, receiver, pdu)
+     struct worker * w;
      struct receiver * receiver;
-     const void * fpdu;
-     size_t length;
-     struct sockaddr * source_addr;
+     struct pdu * pdu;
 {
   if (receiver->flags & pf_SPOOF)
     {
-      int rawsend_flags
-	= ((receiver->flags & pf_CHECKSUM) ? RAWSEND_COMPUTE_UDP_CHECKSUM : 0);
-      return raw_send_from_to (receiver->fd, fpdu, length,
-			       (struct sockaddr *) source_addr,
-			       (struct sockaddr *) &receiver->addr,
-			       receiver->ttl, rawsend_flags);
+      struct receiver_state *state = &receiver->state[w->index];
+      int rawsend_flags = 0;
+
+      /* IPv6 always needs the UDP checksum. */
+      if ((receiver->flags & pf_CHECKSUM)
+	  || receiver->addr.ss_family == AF_INET6)
+	{
+	  rawsend_flags |= RAWSEND_COMPUTE_UDP_CHECKSUM;
+	  if (!pdu->payload_sum_p)
+	    {
+	      pdu->payload_sum = raw_payload_sum (pdu->data, pdu->len);
+	      pdu->payload_sum_p = 1;
+	    }
+	}
+      if (w->xsk != 0 && receiver->ifindex == xsk_ifindex (w->xsk))
+	{
+	  if (xsk_send (w->xsk, receiver->lladdr, receiver->raw_template,
+			pdu->data, pdu->len, pdu->payload_sum,
+			(struct sockaddr *) &pdu->addr,
+			rawsend_flags) == 0)
+	    return 0;
+	  if (errno != EMSGSIZE)
+	    return -1;
+	}
+      else if (receiver->ifindex != 0)
+	{
+	  if (state->tx_ring == 0)
+	    state->tx_ring
+	      = find_tx_ring (__atomic_load_n (&w->tx_rings, __ATOMIC_ACQUIRE),
+			      receiver->ifindex);
+	  if (state->tx_ring != 0)
+	    {
+	      if (tx_ring_send (state->tx_ring, receiver->lladdr,
+				receiver->raw_template,
+				pdu->data, pdu->len, pdu->payload_sum,
+				(struct sockaddr *) &pdu->addr,
+				rawsend_flags) == 0)
+		return 0;
+	      if (errno != EMSGSIZE)
+		return -1;
+	    }
+	}
+      return raw_send_with_template (receiver->fd, receiver->raw_template,
+				     pdu->data, pdu->len, pdu->payload_sum,
+				     (struct sockaddr *) &pdu->addr,
+				     rawsend_flags);
     }
   else
     {
-      return sendto (receiver->fd, (char*) fpdu, length, 0,
+      return sendto (receiver->fd, (char*) pdu->data, pdu->len, 0,
 		     (struct sockaddr*) &receiver->addr, receiver->addrlen);
     }
 }
@@ -505,6 +3172,7 @@ make_cooked_udp_socket (long sockbuflen, int af)
 		   sockbuflen, strerror (errno));
 	}
     }
+  health_watch_socket (s, af);
   return s;
 }
 
@@ -517,22 +3185,27 @@ make_udp_socket (long sockbuflen, int raw, int af)
 }
 
 static int
-make_send_sockets (struct samplicator_context *ctx)
+make_send_sockets (struct samplicator_context *ctx,
+		   struct source_context *sources)
 {
-  /* Array of four sockets:
+  /* Array of four sockets in CTX->send_socks:
 
      First index: cooked(0)/raw(1)
      Second index: IPv4(0)/IPv6(1)
 
      At a maximum, we need one socket of each kind.  These sockets can
-     be used by multiple receivers of the same type.
+     be used by multiple receivers of the same type, and are kept
+     across configuration reloads.  They are made non-blocking, so
+     that a full socket buffer doesn't stall the forwarding loop (see
+     struct worker).
    */
-  int socks[2][2] = { { -1, -1 }, { -1, -1 } };
+  int (*socks)[2] = ctx->send_socks;
 
   struct source_context *sctx;
   unsigned i;
+  int k;
 
-  for (sctx = ctx->sources; sctx != 0; sctx = sctx->next)
+  for (sctx = sources; sctx != 0; sctx = sctx->next)
     {
       for (i = 0; i < sctx->nreceivers; ++i)
 	{
@@ -557,8 +3230,41 @@ make_send_sockets (struct samplicator_context *ctx)
 		    }
 		  return -1;
 		}
+	      if (fcntl (socks[spoof_p][af_index], F_SETFL,
+			 fcntl (socks[spoof_p][af_index], F_GETFL)
+			 | O_NONBLOCK) == -1)
+		{
+		  fprintf (stderr, "fcntl(O_NONBLOCK): %s\n", strerror (errno));
+		  return -1;
+		}
 	    }
 	  receiver->fd = socks[spoof_p][af_index];
+	  if (health_attach (ctx, receiver) != 0)
+	    return -1;
+	  if (spoof_p && receiver->raw_template == 0
+	      && (receiver->raw_template
+		  = make_raw_send_template ((struct sockaddr *) &receiver->addr,
+					    receiver->ttl)) == 0)
+	    {
+	      fprintf (stderr, "Out of memory\n");
+	      return -1;
+	    }
+	  if (receiver->ifindex != 0)
+	    {
+	      if (!spoof_p)
+		{
+		  fprintf (stderr, "The dev= receiver option requires -S\n");
+		  return -1;
+		}
+	      /* Sent through the AF_XDP sockets instead. */
+	      if (ctx->workers[0].xsk != 0
+		  && receiver->ifindex == xsk_ifindex (ctx->workers[0].xsk))
+		continue;
+	      for (k = 0; k < ctx->nworkers; ++k)
+		if (get_tx_ring (&ctx->workers[k].tx_rings,
+				 receiver->ifindex) == 0)
+		  return -1;
+	    }
 	}
     }
   return 0;
@@ -8,66 +8,206 @@
 #ifndef _SAMPLICATOR_H_
 #define _SAMPLICATOR_H_
 
+#include "pacing.h"
+
+/* Statistics are kept in 64-bit counters per worker thread, in blocks
+   that only their worker writes, and that are summed up when read
+   (see stats.c).  Blocks are aligned to cache lines so that workers
+   don't contend for them.  Since each counter has a single writer,
+   STAT_ADD needs no atomic read-modify-write; the relaxed store only
+   keeps readers from seeing a torn value. */
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__ ((aligned (CACHE_LINE_SIZE)))
+#define STAT_ADD(counter, n) \
+  __atomic_store_n (&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_READ(counter) __atomic_load_n (&(counter), __ATOMIC_RELAXED)
+
+struct worker_stats {
+  uint64_t			unmatched_packets;
+  uint64_t			in_drops; /* receive queue overflows */
+} CACHE_ALIGNED;
+
+struct source_stats {
+  uint64_t			matched_packets;
+  uint64_t			matched_octets;
+} CACHE_ALIGNED;
+
+#define LLADDR_LEN 6	/* an Ethernet address */
+
+struct receiver_stats {
+  uint64_t			out_packets;
+  uint64_t			out_octets;
+  uint64_t			out_errors;
+  uint64_t			out_drops;
+};
+
 enum receiver_flags
 {
   pf_SPOOF	= 0x0001,
   pf_CHECKSUM	= 0x0002,
+  pf_PACED	= 0x0004,
+  pf_DROP_HEAD	= 0x0008,
+  pf_RECORDS	= 0x0010,	/* unit=records, see records.c */
+  pf_HASH_FLOW	= 0x0020,	/* hash=flow, see groups.c */
+};
+
+/* How a receiver picks one in freq datagrams or records, the
+   sampling= receiver option: by counting, at random, or by a hash of
+   the exporter and sequence number (see sampling.h). */
+enum sampling_mode
+{
+  SAMPLING_COUNT,
+  SAMPLING_RANDOM,
+  SAMPLING_HASH,
 };
 
 struct samplicator_context {
   struct source_context        *sources;
+  struct source_table	       *source_table;
   const char		       *faddr_spec;
   struct sockaddr_storage	faddr;
   const char		       *fport_spec;
+  const char		       *capture_dev; /* -i, see rxring.c */
+  const char		       *xdp_dev; /* -X, see xsk.c */
+  int				io_uring; /* -I, see uring.c */
   long				sockbuflen;
   long				pdulen;
+  int				batch_size;
   int				debug;
   int				timeout;
   int				fork;
   int				ipv4_only;
   int				ipv6_only;
   const char		       *pid_file;
+  const char		       *stats_socket;
+  int				stats_fd;
   enum receiver_flags		default_receiver_flags;
 
-  int				fsockfd;
   socklen_t			fsockaddrlen;
 
+  struct worker		       *workers;
+  int				nworkers;
+  int64_t			last_receive_ms;
+
+  /* for reloading the configuration, see reload_config() */
+  int				argc;
+  const char		      **argv;
+  int				send_socks[2][2]; /* see make_send_sockets() */
+  struct receiver_health       *health; /* see health.c */
+  int				health_prober_p;
+  unsigned long			stats_generation; /* table in use by stats */
+
   const char		       *config_file_name;
   int				config_file_lineno;
 
-  /* statistics */
-  uint32_t			unmatched_packets;
+  struct worker_stats	       *stats; /* one per worker */
 };
 
+/* A datagram as handed from the receive path to the matching and
+   fan-out code.  PAYLOAD_SUM is computed when the first spoofing
+   receiver needs a UDP checksum, and then reused for the others (see
+   raw_payload_sum()). */
+struct pdu {
+  unsigned char		       *data;
+  size_t			len;
+  struct sockaddr_storage	addr;
+  socklen_t			addrlen;
+  uint32_t			payload_sum;
+  int				payload_sum_p;
+  unsigned			gro_size; /* see samplicate_pdu() */
+};
+
+/* Mutable per-worker state of a receiver, see struct worker. */
+struct receiver_state {
+  struct receiver	       *receiver;
+  int				freqcount;
+  struct receiver_stats		stats;
+
+  /* Datagrams waiting for transmission to a receiver that is over
+     its rate or whose send socket is full: a ring of
+     RECEIVER->queue_limit entries, allocated when first needed.
+     While the queue is non-empty, the state is on the worker's list
+     of pending states. */
+  struct pdu		       *queue;
+  unsigned			queue_head;
+  unsigned			queue_count;
+  struct receiver_state	       *next_pending;
+  struct tx_ring	       *tx_ring; /* for dev=, see send_pdu_to_receiver() */
+  unsigned			gso_run; /* see build_send_msgs() */
+  unsigned			gso_too_big; /* see send_segments() */
+} CACHE_ALIGNED;
+
+/* The rate limit state of a paced receiver: the theoretical arrival
+   times of its pps_limit and bps_limit (see pacing.c).  These are
+   updated by every worker on every send, so they are kept in a cache
+   line of their own rather than in struct receiver, which the workers
+   only read. */
+struct receiver_pacing {
+  int64_t			pps_tat_ns;
+  int64_t			bps_tat_ns;
+} CACHE_ALIGNED;
+
 struct receiver {
   int				fd;
   struct sockaddr_storage	addr;
   socklen_t			addrlen;
   int				port;
   int				freq;
-  int				freqcount;
   int				ttl;
   enum receiver_flags		flags;
+  enum sampling_mode		sampling; /* sampling= */
+  uint64_t			sample_threshold; /* see sample_p() */
+  struct rate_limit		pps_limit;
+  struct rate_limit		bps_limit;
+  unsigned			queue_limit;
+  unsigned			template_interval; /* templates=, seconds */
+  int				ifindex; /* dev=, or 0 */
+  unsigned char			lladdr[LLADDR_LEN]; /* lladdr= */
+  struct receiver_state	       *state; /* one per worker */
+  struct receiver_pacing       *pacing; /* for pf_PACED */
+  struct raw_send_template     *raw_template; /* for spoofing receivers */
+  struct receiver	       *successor; /* set by reload_config() */
+  char			       *group_name; /* group=, or 0 */
+  struct receiver_group	       *group;
+  uint64_t			group_key; /* see receiver_group_choose() */
+  unsigned			health_port; /* health=, or 0 */
+  struct receiver_health       *health; /* see health.c */
+};
 
-  /* statistics */
-  uint32_t			out_packets;
-  uint32_t			out_errors;
-  uint64_t			out_octets;
+/* The liveness of a receiver address and port, see health.c: the
+   receiver is considered down until DOWN_UNTIL (see monotonic_ns()),
+   which is zero for a receiver that is up. */
+struct receiver_health {
+  struct receiver_health       *next;
+  struct sockaddr_storage	addr;
+  socklen_t			addrlen;
+  unsigned			probe_port; /* health=, or 0 */
+  int64_t			down_until;
+};
+
+/* The receivers of a source context that have the same group=
+   option, see groups.c. */
+struct receiver_group {
+  const char		       *name;
+  int				flow_p; /* hash=flow */
+  struct receiver	      **members;
+  unsigned			nmembers;
 };
 
 struct source_context {
   struct source_context	       *next;
+  unsigned			index; /* position in the source list */
   struct sockaddr_storage	source;
   struct sockaddr_storage	mask;
   socklen_t			addrlen;
   struct receiver	       *receivers;
   unsigned			nreceivers;
+  struct receiver_group	       *groups;
+  unsigned			ngroups;
   unsigned			tx_delay;
   int				debug;
-
-  /* statistics */
-  uint32_t			matched_packets;
-  uint64_t			matched_octets;
+  struct source_stats	       *stats; /* one per worker */
+  struct source_context	       *successor; /* set by reload_config() */
 };
 
 #endif /* not _SAMPLICATOR_H_ */
@@ -0,0 +1,68 @@
+/*
+ sampling.h
+
+ Date Created: Mon Oct 26 09:15:42 2026
+
+ The sampling modes of the sampling= receiver option, see enum
+ sampling_mode.  They are decided for every datagram or record that a
+ receiver could get, so the decision is inlined where it is made, in
+ samplicate.c and records.c.  Include after samplicator.h.
+ */
+
+#include "hashing.h"
+
+/* What a receiver samples from for one datagram: its sampling mode,
+   its counter for SAMPLING_COUNT, the worker's random state for
+   SAMPLING_RANDOM, and for SAMPLING_HASH, the hash of the exporter and
+   sequence number of the datagram (see datagram_sample_key() in
+   samplicate.c).  THRESHOLD is RECEIVER->sample_threshold. */
+struct sampler {
+  enum sampling_mode		mode;
+  unsigned			freq;
+  int			       *freqcount;
+  uint64_t			threshold;
+  uint64_t		       *random_state;
+  uint64_t			key;
+};
+
+/* xorshift64*, from Vigna, "An experimental exploration of
+   Marsaglia's xorshift generators, scrambled".  *STATE must not be
+   zero. */
+static inline uint64_t
+sampling_random (uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Return non-zero if S selects UNIT, the datagram itself (0) or its
+   UNITth record. */
+static inline int
+sample_p (struct sampler *s, unsigned unit)
+{
+  uint64_t x;
+
+  switch (s->mode)
+    {
+    case SAMPLING_COUNT:
+      if (*s->freqcount == 0)
+	{
+	  *s->freqcount = s->freq - 1;
+	  return 1;
+	}
+      --*s->freqcount;
+      return 0;
+    case SAMPLING_RANDOM:
+      x = sampling_random (s->random_state);
+      break;
+    default:
+      x = hash_mix64 (s->key + unit);
+      break;
+    }
+  return (x >> 32) < s->threshold;
+}
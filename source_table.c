@@ -0,0 +1,573 @@
+/*
+ source_table.c
+
+ Date Created: Fri Oct 16 21:10:12 2026
+
+ Find the source contexts (config file lines) that match the sender
+ address of a datagram.
+
+ The source list is compiled into one path-compressed binary trie per
+ address family, so that a lookup takes time proportional to the
+ address length rather than to the number of configured sources.
+ Every node on the path from the root to the longest matching prefix
+ contributes its sources.  Because all matching lines must be served
+ in the order in which they appear in the configuration, the matches
+ are then sorted by their position in the source list.
+
+ Two kinds of sources don't fit into the tries:
+
+ - Sources with an all-zeros address (such as the implicit source for
+   receivers given on the command line) or a zero-length prefix match
+   any sender, whatever its address family.  These are kept in the
+   MATCH_ALL list.
+
+ - IPv4 sources with a non-contiguous netmask such as
+   255.0.255.0 cannot be represented as a prefix.  These are kept in
+   the RESIDUAL list and compared one by one.
+
+ IPv4-mapped IPv6 sender addresses, as returned by an IPv6 receive
+ socket for IPv4 packets, are looked up as IPv4 addresses.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdio.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+# ifndef HAVE_MEMCPY
+#  define memcpy(d, s, n) bcopy ((s), (d), (n))
+# endif
+#endif
+
+#include "samplicator.h"
+#include "source_table.h"
+
+struct prefix_node {
+  uint8_t			key[16];
+  unsigned			plen;
+  struct prefix_node	       *child[2];
+  struct source_context	      **sources;
+  unsigned			nsources;
+};
+
+#define KEY_BIT(key, k) (((key)[(k) >> 3] >> (7 - ((k) & 7))) & 1)
+
+/* Return non-zero iff the first PLEN bits of A and B are equal. */
+static int
+prefix_equal_p (const uint8_t *a, const uint8_t *b, unsigned plen)
+{
+  unsigned bytes = plen >> 3, bits = plen & 7;
+
+  if (memcmp (a, b, bytes) != 0)
+    return 0;
+  if (bits == 0)
+    return 1;
+  return ((a[bytes] ^ b[bytes]) & (0xff00 >> bits)) == 0;
+}
+
+/* Return the length of the common prefix of A and B, up to MAXLEN. */
+static unsigned
+common_prefix_length (const uint8_t *a, const uint8_t *b, unsigned maxlen)
+{
+  unsigned k;
+
+  for (k = 0; k < maxlen; ++k)
+    if (KEY_BIT (a, k) != KEY_BIT (b, k))
+      break;
+  return k;
+}
+
+/* Return non-zero iff all bits of KEY after the first PLEN are zero. */
+static int
+host_bits_zero_p (const uint8_t *key, unsigned plen, unsigned maxlen)
+{
+  unsigned k;
+
+  for (k = plen; k < maxlen; ++k)
+    if (KEY_BIT (key, k))
+      return 0;
+  return 1;
+}
+
+static int
+add_source (struct source_context ***vecp, unsigned *countp,
+	    struct source_context *sctx)
+{
+  struct source_context **vec
+    = realloc (*vecp, (*countp + 1) * sizeof (struct source_context *));
+
+  if (vec == 0)
+    return -1;
+  vec[(*countp)++] = sctx;
+  *vecp = vec;
+  return 0;
+}
+
+static struct prefix_node *
+make_node (const uint8_t *key, unsigned plen)
+{
+  struct prefix_node *node = calloc (1, sizeof (struct prefix_node));
+  unsigned k;
+
+  if (node == 0)
+    return 0;
+  for (k = 0; k < plen; ++k)
+    if (KEY_BIT (key, k))
+      node->key[k >> 3] |= 0x80 >> (k & 7);
+  node->plen = plen;
+  return node;
+}
+
+static int
+insert_prefix (struct prefix_node **np, const uint8_t *key, unsigned plen,
+	       struct source_context *sctx)
+{
+  struct prefix_node *n, *new;
+
+  while ((n = *np) != 0)
+    {
+      unsigned common
+	= common_prefix_length (n->key, key, n->plen < plen ? n->plen : plen);
+
+      if (common < n->plen)
+	{
+	  /* The new prefix diverges from N, or is a prefix of N: insert
+	     a node above N. */
+	  if ((new = make_node (key, common)) == 0)
+	    return -1;
+	  new->child[KEY_BIT (n->key, common)] = n;
+	  *np = new;
+	  if (common < plen)
+	    {
+	      struct prefix_node *leaf = make_node (key, plen);
+
+	      if (leaf == 0)
+		return -1;
+	      new->child[KEY_BIT (key, common)] = leaf;
+	      new = leaf;
+	    }
+	  return add_source (&new->sources, &new->nsources, sctx);
+	}
+      if (n->plen == plen)
+	return add_source (&n->sources, &n->nsources, sctx);
+      np = &n->child[KEY_BIT (key, n->plen)];
+    }
+  if ((new = make_node (key, plen)) == 0)
+    return -1;
+  *np = new;
+  return add_source (&new->sources, &new->nsources, sctx);
+}
+
+/* Return the prefix length of a contiguous IPv4 netmask in network
+   byte order, or -1 if the mask isn't contiguous. */
+static int
+ipv4_mask_length (uint32_t mask)
+{
+  uint32_t hmask = ntohl (mask);
+  uint32_t inverted = ~hmask;
+  int len = 0;
+
+  if ((inverted & (inverted + 1)) != 0)
+    return -1;
+  while (hmask != 0)
+    {
+      ++len;
+      hmask <<= 1;
+    }
+  return len;
+}
+
+static int
+ipv6_mask_length (const struct in6_addr *mask)
+{
+  int len = 0;
+  unsigned k;
+
+  for (k = 0; k < 128 && KEY_BIT (mask->s6_addr, k); ++k)
+    ++len;
+  return len;
+}
+
+static int
+add_to_table (struct source_table *table, struct source_context *sctx)
+{
+  if (sctx->source.ss_family == AF_INET)
+    {
+      struct sockaddr_in *addr = (struct sockaddr_in *) &sctx->source;
+      struct sockaddr_in *mask = (struct sockaddr_in *) &sctx->mask;
+      int plen;
+
+      if (addr->sin_addr.s_addr == 0)
+	return add_source (&table->match_all, &table->nmatch_all, sctx);
+      if ((addr->sin_addr.s_addr & mask->sin_addr.s_addr)
+	  != addr->sin_addr.s_addr)
+	return 0;		/* can never match */
+      if ((plen = ipv4_mask_length (mask->sin_addr.s_addr)) < 0)
+	return add_source (&table->residual, &table->nresidual, sctx);
+      return insert_prefix (&table->ipv4_root,
+			    (const uint8_t *) &addr->sin_addr, plen, sctx);
+    }
+  else if (sctx->source.ss_family == AF_INET6)
+    {
+      struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &sctx->source;
+      struct sockaddr_in6 *mask = (struct sockaddr_in6 *) &sctx->mask;
+      int plen = ipv6_mask_length (&mask->sin6_addr);
+
+      if (plen == 0)
+	return add_source (&table->match_all, &table->nmatch_all, sctx);
+      if (!host_bits_zero_p (addr->sin6_addr.s6_addr, plen, 128))
+	return 0;		/* can never match */
+      return insert_prefix (&table->ipv6_root,
+			    addr->sin6_addr.s6_addr, plen, sctx);
+    }
+  fprintf (stderr, "Unexpected address family %d in source list\n",
+	   sctx->source.ss_family);
+  return -1;
+}
+
+/*
+ make_source_table(sources)
+
+ Compile the linked list of source contexts SOURCES into a lookup
+ table.  Each source context's INDEX is set to its position in the
+ list.  Every table gets a new GENERATION number, so that caches can
+ tell tables apart even if one is allocated at the address of another
+ that has been freed.  Returns a null pointer if memory runs out.
+ */
+struct source_table *
+make_source_table (sources)
+     struct source_context *sources;
+{
+  static unsigned long generation = 0;
+  struct source_table *table = calloc (1, sizeof (struct source_table));
+  struct source_context *sctx;
+
+  if (table == 0)
+    return 0;
+  table->generation = ++generation;
+  table->sources = sources;
+  for (sctx = sources; sctx != 0; sctx = sctx->next)
+    {
+      sctx->index = table->nsources++;
+      if (add_to_table (table, sctx) != 0)
+	{
+	  free_source_table (table);
+	  return 0;
+	}
+    }
+  return table;
+}
+
+static void
+free_prefix_node (struct prefix_node *n)
+{
+  if (n == 0)
+    return;
+  free_prefix_node (n->child[0]);
+  free_prefix_node (n->child[1]);
+  free (n->sources);
+  free (n);
+}
+
+void
+free_source_table (table)
+     struct source_table *table;
+{
+  free_prefix_node (table->ipv4_root);
+  free_prefix_node (table->ipv6_root);
+  free (table->match_all);
+  free (table->residual);
+  free (table);
+}
+
+static unsigned
+collect_prefix_matches (const struct prefix_node *n, const uint8_t *key,
+			unsigned maxlen, struct source_context **matches,
+			unsigned nmatches)
+{
+  unsigned k;
+
+  while (n != 0)
+    {
+      if (!prefix_equal_p (n->key, key, n->plen))
+	break;
+      for (k = 0; k < n->nsources; ++k)
+	matches[nmatches++] = n->sources[k];
+      if (n->plen == maxlen)
+	break;
+      n = n->child[KEY_BIT (key, n->plen)];
+    }
+  return nmatches;
+}
+
+/*
+ source_table_lookup(table, addr, matches)
+
+ Store the source contexts in TABLE that match the sender address
+ ADDR into MATCHES, in the order in which they were configured.
+ MATCHES must have room for TABLE->nsources entries.  Returns the
+ number of matching source contexts.
+ */
+unsigned
+source_table_lookup (table, addr, matches)
+     const struct source_table *table;
+     const struct sockaddr *addr;
+     struct source_context **matches;
+{
+  unsigned nmatches = 0, k, j;
+  const uint8_t *ipv4_key = 0;
+
+  for (k = 0; k < table->nmatch_all; ++k)
+    matches[nmatches++] = table->match_all[k];
+
+  if (addr->sa_family == AF_INET)
+    {
+      ipv4_key = (const uint8_t *) &((struct sockaddr_in *) addr)->sin_addr;
+    }
+  else if (addr->sa_family == AF_INET6)
+    {
+      const struct in6_addr *a6 = &((struct sockaddr_in6 *) addr)->sin6_addr;
+
+      if (IN6_IS_ADDR_V4MAPPED (a6))
+	ipv4_key = &a6->s6_addr[12];
+      else
+	nmatches = collect_prefix_matches (table->ipv6_root, a6->s6_addr, 128,
+					   matches, nmatches);
+    }
+  if (ipv4_key != 0)
+    {
+      uint32_t a4;
+
+      nmatches = collect_prefix_matches (table->ipv4_root, ipv4_key, 32,
+					 matches, nmatches);
+      memcpy (&a4, ipv4_key, 4);
+      for (k = 0; k < table->nresidual; ++k)
+	{
+	  struct source_context *sctx = table->residual[k];
+	  struct sockaddr_in *saddr = (struct sockaddr_in *) &sctx->source;
+	  struct sockaddr_in *smask = (struct sockaddr_in *) &sctx->mask;
+
+	  if ((a4 & smask->sin_addr.s_addr) == saddr->sin_addr.s_addr)
+	    matches[nmatches++] = sctx;
+	}
+    }
+
+  /* Restore configuration order.  There are usually only a few
+     matches, so insertion sort is fine. */
+  for (k = 1; k < nmatches; ++k)
+    {
+      struct source_context *sctx = matches[k];
+
+      for (j = k; j > 0 && matches[j-1]->index > sctx->index; --j)
+	matches[j] = matches[j-1];
+      matches[j] = sctx;
+    }
+  return nmatches;
+}
+
+/*
+ Match cache
+
+ Flow exporters send continuously, so the same sender addresses come
+ up over and over again.  A match cache maps a sender address to the
+ result of source_table_lookup() for it.  It is an open-addressing
+ hash table with linear probing, indexed by the sender's IPv6 (or
+ IPv4-mapped) address; the port is not part of the key, because
+ matching doesn't depend on it.
+
+ A cache belongs to a single worker and is not locked.  It remembers
+ the generation of the source table its entries were computed from,
+ and is emptied when it is used with a different table, e.g. after
+ the configuration has been reloaded.  When the cache fills up beyond
+ three quarters, it is doubled in size, up to MAX_MATCH_CACHE_SIZE
+ entries; beyond that, it is simply emptied.
+ */
+
+#define INITIAL_MATCH_CACHE_SIZE 1024
+#define MAX_MATCH_CACHE_SIZE (1024*1024)
+
+struct match_cache_entry {
+  uint8_t			key[16];
+  int				used;
+  unsigned			nmatches;
+  struct source_context	      **matches;
+};
+
+struct match_cache {
+  unsigned long			generation;
+  struct match_cache_entry     *entries;
+  unsigned			size;
+  unsigned			count;
+  struct source_context	      **scratch;
+};
+
+static uint32_t
+match_cache_hash (const uint8_t *key)
+{
+  uint64_t a, b;
+
+  memcpy (&a, key, 8);
+  memcpy (&b, key + 8, 8);
+  a ^= b * 0x9e3779b97f4a7c15ULL;
+  a ^= a >> 29;
+  a *= 0xbf58476d1ce4e5b9ULL;
+  return (uint32_t) (a >> 32);
+}
+
+static void
+clear_match_cache (struct match_cache *cache)
+{
+  unsigned k;
+
+  for (k = 0; k < cache->size; ++k)
+    {
+      if (cache->entries[k].used)
+	free (cache->entries[k].matches);
+    }
+  bzero (cache->entries, cache->size * sizeof (struct match_cache_entry));
+  cache->count = 0;
+}
+
+static int
+grow_match_cache (struct match_cache *cache)
+{
+  struct match_cache_entry *old = cache->entries;
+  unsigned old_size = cache->size, k;
+  unsigned size = old_size * 2;
+  struct match_cache_entry *entries
+    = calloc (size, sizeof (struct match_cache_entry));
+
+  if (entries == 0)
+    return -1;
+  for (k = 0; k < old_size; ++k)
+    {
+      if (old[k].used)
+	{
+	  unsigned i = match_cache_hash (old[k].key) & (size - 1);
+
+	  while (entries[i].used)
+	    i = (i + 1) & (size - 1);
+	  entries[i] = old[k];
+	}
+    }
+  free (old);
+  cache->entries = entries;
+  cache->size = size;
+  return 0;
+}
+
+struct match_cache *
+make_match_cache ()
+{
+  struct match_cache *cache = calloc (1, sizeof (struct match_cache));
+
+  if (cache == 0)
+    return 0;
+  cache->size = INITIAL_MATCH_CACHE_SIZE;
+  if ((cache->entries
+       = calloc (cache->size, sizeof (struct match_cache_entry))) == 0)
+    {
+      free (cache);
+      return 0;
+    }
+  return cache;
+}
+
+/*
+ match_cache_lookup(cache, table, addr, matchesp)
+
+ Like source_table_lookup(), but consult CACHE first, and remember the
+ result there.  A pointer to the vector of matching source contexts
+ is stored in *MATCHESP; it remains valid until the next call with
+ the same CACHE.  Returns the number of matching source contexts.
+ */
+unsigned
+match_cache_lookup (cache, table, addr, matchesp)
+     struct match_cache *cache;
+     const struct source_table *table;
+     const struct sockaddr *addr;
+     struct source_context ***matchesp;
+{
+  struct match_cache_entry *e;
+  uint8_t key[16];
+  unsigned i, nmatches;
+
+  if (cache->generation != table->generation)
+    {
+      struct source_context **scratch
+	= realloc (cache->scratch,
+		   (table->nsources ? table->nsources : 1)
+		   * sizeof (struct source_context *));
+
+      if (scratch == 0)
+	{
+	  fprintf (stderr, "Out of memory\n");
+	  exit (1);
+	}
+      cache->scratch = scratch;
+      clear_match_cache (cache);
+      cache->generation = table->generation;
+    }
+
+  if (addr->sa_family == AF_INET6)
+    {
+      memcpy (key, &((struct sockaddr_in6 *) addr)->sin6_addr, 16);
+    }
+  else if (addr->sa_family == AF_INET)
+    {
+      bzero (key, 10);
+      key[10] = key[11] = 0xff;
+      memcpy (key + 12, &((struct sockaddr_in *) addr)->sin_addr, 4);
+    }
+  else
+    {
+      *matchesp = cache->scratch;
+      return source_table_lookup (table, addr, cache->scratch);
+    }
+
+  for (i = match_cache_hash (key) & (cache->size - 1);
+       cache->entries[i].used;
+       i = (i + 1) & (cache->size - 1))
+    {
+      e = &cache->entries[i];
+      if (memcmp (e->key, key, 16) == 0)
+	{
+	  *matchesp = e->matches;
+	  return e->nmatches;
+	}
+    }
+
+  /* Not found: look it up, and remember the result. */
+  nmatches = source_table_lookup (table, addr, cache->scratch);
+  *matchesp = cache->scratch;
+  if ((cache->count + 1) * 4 > cache->size * 3)
+    {
+      if (cache->size >= MAX_MATCH_CACHE_SIZE
+	  || grow_match_cache (cache) != 0)
+	clear_match_cache (cache);
+      for (i = match_cache_hash (key) & (cache->size - 1);
+	   cache->entries[i].used;
+	   i = (i + 1) & (cache->size - 1))
+	;
+    }
+  e = &cache->entries[i];
+  if ((e->matches = malloc ((nmatches ? nmatches : 1)
+			    * sizeof (struct source_context *))) == 0)
+    return nmatches;
+  memcpy (e->matches, cache->scratch,
+	  nmatches * sizeof (struct source_context *));
+  memcpy (e->key, key, 16);
+  e->nmatches = nmatches;
+  e->used = 1;
+  ++cache->count;
+  return nmatches;
+}
@@ -0,0 +1,34 @@
+/*
+ source_table.h
+
+ Date Created: Fri Oct 16 21:10:12 2026
+ */
+
+struct prefix_node;
+struct match_cache;
+
+/* A lookup structure compiled from a list of source contexts, see
+   source_table.c. */
+struct source_table {
+  struct source_context	       *sources; /* the list the table was made from */
+  struct prefix_node	       *ipv4_root;
+  struct prefix_node	       *ipv6_root;
+  struct source_context	      **match_all;
+  unsigned			nmatch_all;
+  struct source_context	      **residual;
+  unsigned			nresidual;
+  unsigned			nsources;
+  unsigned long			generation;
+};
+
+extern struct source_table *make_source_table (struct source_context *);
+extern void free_source_table (struct source_table *);
+extern unsigned source_table_lookup (const struct source_table *,
+				     const struct sockaddr *,
+				     struct source_context **);
+
+extern struct match_cache *make_match_cache (void);
+extern unsigned match_cache_lookup (struct match_cache *,
+				    const struct source_table *,
+				    const struct sockaddr *,
+				    struct source_context ***);
@@ -0,0 +1,267 @@
+/*
+ stats.c
+
+ Date Created: Sat Oct 17 14:05:51 2026
+
+ Statistics reporting over a Unix domain socket (the -U option).
+
+ A client that connects to the socket receives a snapshot of all
+ counters in a line-oriented text format, one "NAME{LABELS} VALUE"
+ line per counter (the Prometheus text exposition format), and then
+ end-of-file.  For example:
+
+   socat - UNIX-CONNECT:/run/samplicator.sock
+
+ The socket is served by a thread of its own, so a slow client never
+ holds up forwarding.  The workers' counter blocks (see samplicator.h)
+ are summed up without locking while the workers update them.  While
+ the snapshot is taken, CTX->stats_generation tells reload_config()
+ not to free the configuration being reported on.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+#endif
+
+#include "samplicator.h"
+#include "source_table.h"
+#include "groups.h"
+#include "stats.h"
+
+/*
+ make_stats_socket(path)
+
+ Create a listening Unix domain socket at PATH, replacing any stale
+ socket left there by an earlier instance.  Returns the socket, or -1
+ on error.
+ */
+int
+make_stats_socket (path)
+     const char *path;
+{
+  struct sockaddr_un addr;
+  int s;
+
+  if (strlen (path) >= sizeof addr.sun_path)
+    {
+      fprintf (stderr, "Statistics socket name too long: %s\n", path);
+      return -1;
+    }
+  bzero (&addr, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  if ((s = socket (PF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+      fprintf (stderr, "socket(PF_UNIX): %s\n", strerror (errno));
+      return -1;
+    }
+  unlink (path);	/* Ignore results - the old socket may not exist. */
+  if (bind (s, (struct sockaddr *) &addr, sizeof addr) == -1
+      || listen (s, 5) == -1)
+    {
+      fprintf (stderr, "Cannot listen on statistics socket %s: %s\n",
+	       path, strerror (errno));
+      close (s);
+      return -1;
+    }
+  return s;
+}
+
+static const char *
+address_string (addr, addrlen, buf, buflen)
+     const struct sockaddr_storage *addr;
+     socklen_t addrlen;
+     char *buf;
+     size_t buflen;
+{
+  /* Receivers from the command line have a source that matches
+     everything, and no address length. */
+  if (addrlen == 0)
+    strcpy (buf, "0.0.0.0");
+  else if (getnameinfo ((const struct sockaddr *) addr, addrlen,
+			buf, buflen, 0, 0, NI_NUMERICHOST) != 0)
+    strcpy (buf, "???");
+  return buf;
+}
+
+/*
+ write_stats(fp, ctx, sources)
+
+ Write a snapshot of the statistics of CTX, with the source list
+ SOURCES, to FP.
+ */
+void
+write_stats (fp, ctx, sources)
+     FILE *fp;
+     struct samplicator_context *ctx;
+     struct source_context *sources;
+{
+  struct source_context *sctx;
+  char source[INET6_ADDRSTRLEN], mask[INET6_ADDRSTRLEN];
+  char host[INET6_ADDRSTRLEN];
+  char serv[6];
+  uint64_t unmatched_packets = 0, in_drops = 0;
+  int64_t now = monotonic_ns ();
+  unsigned i;
+  int k;
+
+  for (k = 0; k < ctx->nworkers; ++k)
+    {
+      unmatched_packets += STAT_READ (ctx->stats[k].unmatched_packets);
+      in_drops += STAT_READ (ctx->stats[k].in_drops);
+    }
+  fprintf (fp, "samplicator_workers %d\n", ctx->nworkers);
+  fprintf (fp, "samplicator_in_drops %llu\n",
+	   (unsigned long long) in_drops);
+  fprintf (fp, "samplicator_unmatched_packets %llu\n",
+	   (unsigned long long) unmatched_packets);
+  for (sctx = sources; sctx != 0; sctx = sctx->next)
+    {
+      char labels[2*INET6_ADDRSTRLEN + 40];
+      struct source_stats ss;
+
+      bzero (&ss, sizeof ss);
+      for (k = 0; k < ctx->nworkers; ++k)
+	{
+	  ss.matched_packets += STAT_READ (sctx->stats[k].matched_packets);
+	  ss.matched_octets += STAT_READ (sctx->stats[k].matched_octets);
+	}
+
+      address_string (&sctx->source, sctx->addrlen, source, sizeof source);
+      address_string (&sctx->mask, sctx->addrlen, mask, sizeof mask);
+      snprintf (labels, sizeof labels, "source_index=\"%u\",source=\"%s/%s\"",
+		sctx->index, source, mask);
+      fprintf (fp, "samplicator_matched_packets{%s} %llu\n",
+	       labels, (unsigned long long) ss.matched_packets);
+      fprintf (fp, "samplicator_matched_octets{%s} %llu\n",
+	       labels, (unsigned long long) ss.matched_octets);
+      for (i = 0; i < sctx->nreceivers; ++i)
+	{
+	  struct receiver *receiver = &sctx->receivers[i];
+	  struct receiver_stats rs;
+
+	  bzero (&rs, sizeof rs);
+	  for (k = 0; k < ctx->nworkers; ++k)
+	    {
+	      struct receiver_stats *s = &receiver->state[k].stats;
+
+	      rs.out_packets += STAT_READ (s->out_packets);
+	      rs.out_octets += STAT_READ (s->out_octets);
+	      rs.out_errors += STAT_READ (s->out_errors);
+	      rs.out_drops += STAT_READ (s->out_drops);
+	    }
+
+	  if (getnameinfo ((struct sockaddr *) &receiver->addr,
+			   receiver->addrlen,
+			   host, sizeof host, serv, sizeof serv,
+			   NI_NUMERICHOST|NI_NUMERICSERV) != 0)
+	    {
+	      strcpy (host, "???");
+	      strcpy (serv, "?????");
+	    }
+	  fprintf (fp, "samplicator_out_packets{%s,receiver=\"%s/%s\"} %llu\n",
+		   labels, host, serv,
+		   (unsigned long long) rs.out_packets);
+	  fprintf (fp, "samplicator_out_octets{%s,receiver=\"%s/%s\"} %llu\n",
+		   labels, host, serv,
+		   (unsigned long long) rs.out_octets);
+	  fprintf (fp, "samplicator_out_errors{%s,receiver=\"%s/%s\"} %llu\n",
+		   labels, host, serv,
+		   (unsigned long long) rs.out_errors);
+	  fprintf (fp, "samplicator_out_drops{%s,receiver=\"%s/%s\"} %llu\n",
+		   labels, host, serv,
+		   (unsigned long long) rs.out_drops);
+	  fprintf (fp, "samplicator_receiver_up{%s,receiver=\"%s/%s\"} %d\n",
+		   labels, host, serv, receiver_up_p (receiver, now) != 0);
+	}
+    }
+}
+
+static void *
+run_stats_server (arg)
+     void *arg;
+{
+  struct samplicator_context *ctx = arg;
+  struct source_table *table;
+  char *buf;
+  size_t len, off;
+  ssize_t n;
+  FILE *fp;
+  int s;
+
+  while (1)
+    {
+      if ((s = accept (ctx->stats_fd, 0, 0)) == -1)
+	{
+	  if (errno != EINTR && errno != ECONNABORTED)
+	    fprintf (stderr, "accept(): %s\n", strerror (errno));
+	  continue;
+	}
+      if ((fp = open_memstream (&buf, &len)) == 0)
+	{
+	  close (s);
+	  continue;
+	}
+      /* Announce that we are about to use a table before looking at
+	 CTX->source_table, so that reload_config() cannot miss us. */
+      __atomic_store_n (&ctx->stats_generation, ~0UL, __ATOMIC_SEQ_CST);
+      table = __atomic_load_n (&ctx->source_table, __ATOMIC_SEQ_CST);
+      __atomic_store_n (&ctx->stats_generation, table->generation,
+			__ATOMIC_SEQ_CST);
+      write_stats (fp, ctx, table->sources);
+      __atomic_store_n (&ctx->stats_generation, 0, __ATOMIC_RELEASE);
+      fclose (fp);
+
+      /* Only now talk to the client, which may be slow. */
+      for (off = 0; off < len; off += n)
+	if ((n = write (s, buf + off, len - off)) <= 0)
+	  break;
+      free (buf);
+      close (s);
+    }
+  return 0;
+}
+
+/*
+ start_stats_server(ctx)
+
+ Start the thread that serves CTX->stats_fd.  Returns 0 on success,
+ and -1 on error.
+ */
+int
+start_stats_server (ctx)
+     struct samplicator_context *ctx;
+{
+  pthread_t thread;
+  int result;
+
+  /* A client that goes away early must not kill us. */
+  signal (SIGPIPE, SIG_IGN);
+  if ((result = pthread_create (&thread, 0, run_stats_server, ctx)) != 0)
+    {
+      fprintf (stderr, "pthread_create(): %s\n", strerror (result));
+      return -1;
+    }
+  pthread_detach (thread);
+  return 0;
+}
@@ -0,0 +1,10 @@
+/*
+ stats.h
+
+ Date Created: Sat Oct 17 14:05:51 2026
+ */
+
+extern int make_stats_socket (const char *);
+extern int start_stats_server (struct samplicator_context *);
+extern void write_stats (FILE *, struct samplicator_context *,
+			 struct source_context *);
@@ -0,0 +1,954 @@
+/*
+ templates.c
+
+ Date Created: Thu Oct 22 10:12:48 2026
+
+ A cache of the NetFlow v9 (RFC 3954) and IPFIX (RFC 7011) templates
+ of the exporters whose datagrams we forward, for receivers with the
+ templates= option.
+
+ In both protocols, data records are described by templates, which
+ exporters only send every so often.  A receiver that gets one
+ datagram in N may miss them for a long time, and cannot decode the
+ data records it does get in the meantime.  So the templates in the
+ datagrams are remembered per template scope, i.e. exporter address
+ and port, protocol version and observation domain (the source ID of
+ NetFlow v9).  For each scope, they are turned into template-only
+ datagrams when needed, which are then sent to such receivers (see
+ replay_templates() in samplicate.c).
+
+ The templates also tell where the data records in a datagram begin
+ and end, which the record-level sampling of the unit=records option
+ needs (see records.c).  For that, NetFlow v5 datagrams have scopes,
+ too, by exporter and engine, and a scope keeps the sequence numbers
+ of the datagrams sent to each such receiver.
+
+ NetFlow v9 sequence numbers count datagrams, so a replay datagram
+ cannot share a number with the exporter's datagrams, and there is no
+ unused one between them if the receiver gets them all.  So NetFlow v9
+ datagrams to receivers with templates= are numbered per receiver as
+ well, and replays take the next number (see template_stamp()).
+
+ The scopes are kept in an open-addressing hash table with linear
+ probing, like the match cache (see source_table.c).  A cache belongs
+ to a single worker and is not locked; the datagrams of an exporter
+ are all handled by the same worker.  The table grows up to
+ MAX_TEMPLATE_TABLE_SIZE slots, and a scope holds up to MAX_TEMPLATES
+ templates; beyond that, new scopes or templates are ignored.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <netinet/in.h>
+#include <string.h>
+#include <stdint.h>
+#if STDC_HEADERS
+# define bzero(b,n) memset(b,0,n)
+#else
+# include <strings.h>
+# ifndef HAVE_MEMCPY
+#  define memcpy(d, s, n) bcopy ((s), (d), (n))
+# endif
+#endif
+
+#include "templates.h"
+
+#define INITIAL_TEMPLATE_TABLE_SIZE 64
+#define MAX_TEMPLATE_TABLE_SIZE 8192
+#define MAX_TEMPLATES 512
+
+/* The size of the replay datagrams we make, unless a single template
+   is larger; this fits into an Ethernet frame with room to spare. */
+#define REPLAY_DATAGRAM_SIZE 1400
+
+/* The key of a scope: exporter address (IPv4 addresses mapped to
+   IPv6), port, protocol version and observation domain. */
+#define SCOPE_KEY_LEN 24
+
+#define NETFLOW_V5_HEADER_LEN 24
+#define NETFLOW_V9_HEADER_LEN 20
+#define IPFIX_HEADER_LEN 16
+
+/* Set IDs of template and options template sets, NetFlow v9 calls
+   them FlowSet IDs.  Data sets have IDs from 256 on, and so do
+   templates. */
+#define V9_TEMPLATE_SET 0
+#define V9_OPTIONS_TEMPLATE_SET 1
+#define IPFIX_TEMPLATE_SET 2
+#define IPFIX_OPTIONS_TEMPLATE_SET 3
+#define MIN_TEMPLATE_ID 256
+
+/* Information elements (field types in NetFlow v9) of the flow key */
+#define IE_PROTOCOL_IDENTIFIER 4
+#define IE_SOURCE_TRANSPORT_PORT 7
+#define IE_SOURCE_IPV4_ADDRESS 8
+#define IE_DESTINATION_TRANSPORT_PORT 11
+#define IE_DESTINATION_IPV4_ADDRESS 12
+#define IE_SOURCE_IPV6_ADDRESS 27
+#define IE_DESTINATION_IPV6_ADDRESS 28
+
+struct template {
+  uint16_t			id;
+  uint16_t			set_id;
+  uint16_t			len;
+  uint16_t			record_len; /* of data records, 0 if variable */
+  struct flow_key		flow_key;
+  unsigned char		       *record;
+};
+
+/* Replay datagrams made from the templates of a scope, all in one
+   allocation. */
+struct replay {
+  struct replay		       *next; /* on the list of retired replays */
+  unsigned			ndatagrams;
+  struct iovec		       *datagrams;
+};
+
+/* What a scope knows about a receiver: when it last got the
+   templates, and the next sequence number for it.  RECEIVER only
+   identifies it, and is never dereferenced. */
+struct scope_receiver {
+  const void		       *receiver;
+  unsigned			generation;
+  int64_t			next;
+  int				sequence_p;
+  uint32_t			sequence;
+};
+
+struct template_scope {
+  uint8_t			key[SCOPE_KEY_LEN];
+  unsigned			version;
+  struct template	       *templates;
+  unsigned			ntemplates;
+  unsigned			generation; /* changes with TEMPLATES */
+  struct replay		       *replay; /* or 0 if not made yet */
+  struct scope_receiver	       *receivers;
+  unsigned			nreceivers;
+};
+
+struct template_cache {
+  struct template_scope	      **scopes;
+  unsigned			size;
+  unsigned			count;
+  struct replay		       *retired;
+};
+
+static uint32_t
+scope_hash (const uint8_t *key)
+{
+  uint64_t a, b, c;
+
+  memcpy (&a, key, 8);
+  memcpy (&b, key + 8, 8);
+  memcpy (&c, key + 16, 8);
+  a ^= b * 0x9e3779b97f4a7c15ULL;
+  a ^= c * 0xc2b2ae3d27d4eb4fULL;
+  a ^= a >> 29;
+  a *= 0xbf58476d1ce4e5b9ULL;
+  return (uint32_t) (a >> 32);
+}
+
+/* Put the replay of SCOPE on the retired list of CACHE, see
+   template_cache_collect(). */
+static void
+retire_replay (struct template_cache *cache, struct template_scope *scope)
+{
+  if (scope->replay != 0)
+    {
+      scope->replay->next = cache->retired;
+      cache->retired = scope->replay;
+      scope->replay = 0;
+    }
+}
+
+static int
+grow_template_cache (struct template_cache *cache)
+{
+  struct template_scope **old = cache->scopes;
+  unsigned old_size = cache->size, k;
+  unsigned size = old_size * 2;
+  struct template_scope **scopes
+    = calloc (size, sizeof (struct template_scope *));
+
+  if (scopes == 0)
+    return -1;
+  for (k = 0; k < old_size; ++k)
+    {
+      if (old[k] != 0)
+	{
+	  unsigned i = scope_hash (old[k]->key) & (size - 1);
+
+	  while (scopes[i] != 0)
+	    i = (i + 1) & (size - 1);
+	  scopes[i] = old[k];
+	}
+    }
+  free (old);
+  cache->scopes = scopes;
+  cache->size = size;
+  return 0;
+}
+
+struct template_cache *
+make_template_cache ()
+{
+  struct template_cache *cache = calloc (1, sizeof (struct template_cache));
+
+  if (cache == 0)
+    return 0;
+  cache->size = INITIAL_TEMPLATE_TABLE_SIZE;
+  if ((cache->scopes
+       = calloc (cache->size, sizeof (struct template_scope *))) == 0)
+    {
+      free (cache);
+      return 0;
+    }
+  return cache;
+}
+
+/* Find the scope with KEY in CACHE, or add it.  Returns 0 if the
+   cache is full. */
+static struct template_scope *
+find_scope (struct template_cache *cache, const uint8_t *key,
+	    unsigned version)
+{
+  struct template_scope *scope;
+  unsigned i;
+
+  for (i = scope_hash (key) & (cache->size - 1);
+       cache->scopes[i] != 0;
+       i = (i + 1) & (cache->size - 1))
+    {
+      if (memcmp (cache->scopes[i]->key, key, SCOPE_KEY_LEN) == 0)
+	return cache->scopes[i];
+    }
+  if ((cache->count + 1) * 4 > cache->size * 3)
+    {
+      if (cache->size >= MAX_TEMPLATE_TABLE_SIZE
+	  || grow_template_cache (cache) != 0)
+	return 0;
+      for (i = scope_hash (key) & (cache->size - 1);
+	   cache->scopes[i] != 0;
+	   i = (i + 1) & (cache->size - 1))
+	;
+    }
+  if ((scope = calloc (1, sizeof (struct template_scope))) == 0)
+    return 0;
+  memcpy (scope->key, key, SCOPE_KEY_LEN);
+  scope->version = version;
+  cache->scopes[i] = scope;
+  ++cache->count;
+  return scope;
+}
+
+/* The length of the data records described by the template record
+   REC of LEN bytes, which came in a set with SET_ID, or 0 if it
+   varies (IPFIX variable-length fields) or is out of range. */
+static unsigned
+data_record_len (unsigned set_id, const unsigned char *rec, unsigned len)
+{
+  const unsigned char *p, *end = rec + len;
+  unsigned sum = 0;
+
+  for (p = rec + (set_id == V9_TEMPLATE_SET || set_id == IPFIX_TEMPLATE_SET
+		  ? 4 : 6);
+       end - p >= 4;
+       p += (set_id >= IPFIX_TEMPLATE_SET && (get16 (p) & 0x8000)) ? 8 : 4)
+    {
+      if (set_id >= IPFIX_TEMPLATE_SET && get16 (p + 2) == 65535)
+	return 0;
+      sum += get16 (p + 2);
+    }
+  return sum <= 65535 ? sum : 0;
+}
+
+/* Find the flow key fields among those of the template record REC
+   of LEN bytes, which came in a set with SET_ID, and store their
+   offsets in KEY.  Only fixed-length templates are looked at. */
+static void
+find_flow_key (unsigned set_id, const unsigned char *rec, unsigned len,
+	       struct flow_key *key)
+{
+  const unsigned char *p, *end = rec + len;
+  unsigned off = 0;
+
+  memset (key, 0, sizeof *key);
+  if (set_id != V9_TEMPLATE_SET && set_id != IPFIX_TEMPLATE_SET)
+    return;
+  for (p = rec + 4;
+       end - p >= 4;
+       p += (set_id == IPFIX_TEMPLATE_SET && (get16 (p) & 0x8000)) ? 8 : 4)
+    {
+      unsigned type = get16 (p), field_len = get16 (p + 2);
+      int k = -1;
+
+      /* Enterprise-specific IPFIX elements have the top bit set,
+	 and never match. */
+      switch (type)
+	{
+	case IE_SOURCE_IPV4_ADDRESS:
+	case IE_SOURCE_IPV6_ADDRESS:
+	  k = FK_SRC_ADDR;
+	  break;
+	case IE_DESTINATION_IPV4_ADDRESS:
+	case IE_DESTINATION_IPV6_ADDRESS:
+	  k = FK_DST_ADDR;
+	  break;
+	case IE_SOURCE_TRANSPORT_PORT:
+	  k = FK_SRC_PORT;
+	  break;
+	case IE_DESTINATION_TRANSPORT_PORT:
+	  k = FK_DST_PORT;
+	  break;
+	case IE_PROTOCOL_IDENTIFIER:
+	  k = FK_PROTOCOL;
+	  break;
+	}
+      if (k >= 0 && field_len <= 16)
+	{
+	  key->off[k] = off;
+	  key->len[k] = field_len;
+	}
+      off += field_len;
+    }
+}
+
+/* Remember the template record REC of LEN bytes, which came in a set
+   with SET_ID, in SCOPE.  A changed template retires the replay. */
+static void
+learn_template (struct template_cache *cache, struct template_scope *scope,
+		unsigned set_id, const unsigned char *rec, unsigned len)
+{
+  unsigned id = get16 (rec), k;
+  struct template *t;
+  unsigned char *record;
+
+  for (k = 0; k < scope->ntemplates; ++k)
+    if (scope->templates[k].id == id)
+      break;
+  if (k < scope->ntemplates)
+    {
+      t = &scope->templates[k];
+      if (t->set_id == set_id && t->len == len
+	  && memcmp (t->record, rec, len) == 0)
+	return;
+    }
+  else
+    {
+      if (k == MAX_TEMPLATES
+	  || (t = realloc (scope->templates,
+			   (k + 1) * sizeof (struct template))) == 0)
+	return;
+      scope->templates = t;
+      t = &scope->templates[k];
+      t->record = 0;
+    }
+  if ((record = malloc (len)) == 0)
+    return;
+  memcpy (record, rec, len);
+  free (t->record);
+  t->id = id;
+  t->set_id = set_id;
+  t->len = len;
+  t->record_len = data_record_len (set_id, rec, len);
+  if (t->record_len != 0)
+    find_flow_key (set_id, rec, len, &t->flow_key);
+  else
+    memset (&t->flow_key, 0, sizeof t->flow_key);
+  t->record = record;
+  if (k == scope->ntemplates)
+    ++scope->ntemplates;
+  ++scope->generation;
+  retire_replay (cache, scope);
+}
+
+/* Forget the template with ID in SCOPE, or all templates that came in
+   sets with SET_ID if ID is SET_ID (IPFIX template withdrawal). */
+static void
+withdraw_template (struct template_cache *cache,
+		   struct template_scope *scope,
+		   unsigned set_id, unsigned id)
+{
+  unsigned k = 0;
+
+  while (k < scope->ntemplates)
+    {
+      struct template *t = &scope->templates[k];
+
+      if (t->id == id || (id == set_id && t->set_id == set_id))
+	{
+	  free (t->record);
+	  *t = scope->templates[--scope->ntemplates];
+	  ++scope->generation;
+	  retire_replay (cache, scope);
+	}
+      else
+	++k;
+    }
+}
+
+/* The length of the IPFIX field specifiers at P, N of them, that end
+   before END, or 0 if they don't. */
+static unsigned
+ipfix_fields_len (const unsigned char *p, const unsigned char *end,
+		  unsigned n)
+{
+  const unsigned char *q = p;
+
+  while (n-- > 0)
+    {
+      if (end - q < 4)
+	return 0;
+      q += (get16 (q) & 0x8000) ? 8 : 4; /* with an enterprise number */
+    }
+  return q > end ? 0 : q - p;
+}
+
+/* The length of the template record at P, before END, in a set with
+   SET_ID, or 0 if there is none, e.g. because the rest of the set is
+   padding.  An IPFIX template withdrawal has a length of 4. */
+static unsigned
+template_record_size (unsigned set_id, const unsigned char *p,
+		      const unsigned char *end)
+{
+  unsigned id, count, len;
+
+  if (end - p < 4)
+    return 0;
+  id = get16 (p);
+  count = get16 (p + 2);
+  switch (set_id)
+    {
+    case V9_TEMPLATE_SET:
+      len = 4 + 4 * count;
+      break;
+    case V9_OPTIONS_TEMPLATE_SET:
+      /* scope and option field lengths, in bytes */
+      if (end - p < 6)
+	return 0;
+      len = 6 + count + get16 (p + 4);
+      break;
+    case IPFIX_TEMPLATE_SET:
+    case IPFIX_OPTIONS_TEMPLATE_SET:
+      if (count == 0 && (id >= MIN_TEMPLATE_ID || id == set_id))
+	return 4;
+      len = set_id == IPFIX_TEMPLATE_SET ? 4 : 6;
+      if (end - p < len
+	  || (set_id == IPFIX_OPTIONS_TEMPLATE_SET
+	      && (get16 (p + 4) == 0 || get16 (p + 4) > count)))
+	return 0;
+      {
+	unsigned flen = ipfix_fields_len (p + len, end, count);
+
+	if (flen == 0)
+	  return 0;
+	len += flen;
+      }
+      break;
+    default:
+      return 0;
+    }
+  if (id < MIN_TEMPLATE_ID || len > (unsigned) (end - p))
+    return 0;
+  return len;
+}
+
+/* Learn the template records in the set with SET_ID between P and
+   END of a datagram for SCOPE.  Anything that doesn't parse ends the
+   set, which covers padding. */
+static void
+learn_template_set (struct template_cache *cache,
+		    struct template_scope *scope, unsigned set_id,
+		    const unsigned char *p, const unsigned char *end)
+{
+  unsigned len;
+
+  while ((len = template_record_size (set_id, p, end)) != 0)
+    {
+      if (set_id >= IPFIX_TEMPLATE_SET && get16 (p + 2) == 0)
+	withdraw_template (cache, scope, set_id, get16 (p));
+      else
+	learn_template (cache, scope, set_id, p, len);
+      p += len;
+    }
+}
+
+/* The number of data records between P and END described by the
+   template T, which has variable-length fields.  Anything after the
+   last complete record is padding. */
+static unsigned
+count_variable_records (const struct template *t, const unsigned char *p,
+			const unsigned char *end)
+{
+  const unsigned char *fields = t->record
+    + (t->set_id == IPFIX_TEMPLATE_SET ? 4 : 6);
+  const unsigned char *fields_end = t->record + t->len;
+  unsigned n = 0;
+
+  while (p < end)
+    {
+      const unsigned char *f, *q = p;
+
+      for (f = fields; fields_end - f >= 4; f += (get16 (f) & 0x8000) ? 8 : 4)
+	{
+	  unsigned len = get16 (f + 2);
+
+	  if (len == 65535)
+	    {
+	      /* RFC 7011, section 7 */
+	      if (end - q < 1)
+		return n;
+	      if (q[0] < 255)
+		len = 1 + q[0];
+	      else if (end - q < 3)
+		return n;
+	      else
+		len = 3 + get16 (q + 1);
+	    }
+	  if ((unsigned) (end - q) < len)
+	    return n;
+	  q += len;
+	}
+      if (q == p)
+	return n;
+      p = q;
+      ++n;
+    }
+  return n;
+}
+
+/*
+ template_set_records(scope, set_id, p, len)
+
+ Return the number of records in the LEN bytes at P that follow the
+ header of a set with SET_ID in a datagram of SCOPE: template records
+ in a template set, and otherwise data records described by template
+ SET_ID.  Returns -1 if that template is not known.
+ */
+int
+template_set_records (scope, set_id, p, len)
+     struct template_scope *scope;
+     unsigned set_id;
+     const unsigned char *p;
+     unsigned len;
+{
+  const unsigned char *end = p + len;
+  unsigned k, n = 0, size;
+
+  if (set_id < MIN_TEMPLATE_ID)
+    {
+      for (; (size = template_record_size (set_id, p, end)) != 0; p += size)
+	++n;
+      return n;
+    }
+  for (k = 0; k < scope->ntemplates; ++k)
+    {
+      const struct template *t = &scope->templates[k];
+
+      if (t->id == set_id)
+	return t->record_len != 0 ? (int) (len / t->record_len)
+	  : (int) count_variable_records (t, p, end);
+    }
+  return -1;
+}
+
+/*
+ template_cache_update(cache, addr, data, len)
+
+ Learn the templates in the datagram DATA of LEN bytes from ADDR, if
+ it is a NetFlow v9 or IPFIX datagram.  Returns its template scope,
+ or 0 if it is something else than that or NetFlow v5, or the cache
+ is full.
+ */
+struct template_scope *
+template_cache_update (cache, addr, data, len)
+     struct template_cache *cache;
+     const struct sockaddr *addr;
+     const unsigned char *data;
+     size_t len;
+{
+  struct template_scope *scope;
+  const unsigned char *p, *end;
+  uint8_t key[SCOPE_KEY_LEN];
+  unsigned version;
+  const unsigned char *domain;
+  unsigned char engine[4];
+
+  if (len < 2)
+    return 0;
+  version = get16 (data);
+  if (version == 5 && len >= NETFLOW_V5_HEADER_LEN)
+    {
+      /* engine type and ID */
+      engine[0] = data[20];
+      engine[1] = data[21];
+      engine[2] = engine[3] = 0;
+      domain = engine;
+      p = data + len;		/* no templates */
+    }
+  else if (version == 9 && len >= NETFLOW_V9_HEADER_LEN)
+    {
+      domain = data + 16;
+      p = data + NETFLOW_V9_HEADER_LEN;
+    }
+  else if (version == 10 && len >= IPFIX_HEADER_LEN
+	   && get16 (data + 2) >= IPFIX_HEADER_LEN)
+    {
+      if (get16 (data + 2) < len)
+	len = get16 (data + 2);	/* the IPFIX message length */
+      domain = data + 12;
+      p = data + IPFIX_HEADER_LEN;
+    }
+  else
+    return 0;
+  end = data + len;
+
+  if (addr->sa_family == AF_INET6)
+    {
+      memcpy (key, &((struct sockaddr_in6 *) addr)->sin6_addr, 16);
+      memcpy (key + 16, &((struct sockaddr_in6 *) addr)->sin6_port, 2);
+    }
+  else if (addr->sa_family == AF_INET)
+    {
+      bzero (key, 10);
+      key[10] = key[11] = 0xff;
+      memcpy (key + 12, &((struct sockaddr_in *) addr)->sin_addr, 4);
+      memcpy (key + 16, &((struct sockaddr_in *) addr)->sin_port, 2);
+    }
+  else
+    return 0;
+  put16 (key + 18, version);
+  memcpy (key + 20, domain, 4);
+  if ((scope = find_scope (cache, key, version)) == 0)
+    return 0;
+
+  while (end - p >= 4)
+    {
+      unsigned set_id = get16 (p), set_len = get16 (p + 2);
+
+      if (set_len < 4 || set_len > (unsigned) (end - p))
+	break;
+      if (version == 9
+	  ? set_id == V9_TEMPLATE_SET || set_id == V9_OPTIONS_TEMPLATE_SET
+	  : set_id == IPFIX_TEMPLATE_SET || set_id == IPFIX_OPTIONS_TEMPLATE_SET)
+	learn_template_set (cache, scope, set_id, p + 4, p + set_len);
+      p += set_len;
+    }
+  return scope;
+}
+
+/* The entry for RECEIVER in SCOPE, which is added if needed.  Returns
+   0 if out of memory. */
+static struct scope_receiver *
+find_scope_receiver (struct template_scope *scope, const void *receiver)
+{
+  struct scope_receiver *r;
+  unsigned k;
+
+  for (k = 0; k < scope->nreceivers; ++k)
+    if (scope->receivers[k].receiver == receiver)
+      return &scope->receivers[k];
+  r = realloc (scope->receivers, (k + 1) * sizeof (struct scope_receiver));
+  if (r == 0)
+    return 0;
+  scope->receivers = r;
+  ++scope->nreceivers;
+  r = &scope->receivers[k];
+  r->receiver = receiver;
+  r->generation = scope->generation - 1;
+  r->next = 0;
+  r->sequence_p = 0;
+  return r;
+}
+
+/*
+ template_replay_due(scope, receiver, now, interval)
+
+ Return non-zero if the templates of SCOPE should be sent to RECEIVER
+ at time NOW: because it hasn't got them yet, they have changed since,
+ or INTERVAL has passed since it last got them.  The caller is
+ expected to send them then.
+ */
+int
+template_replay_due (scope, receiver, now, interval)
+     struct template_scope *scope;
+     const void *receiver;
+     int64_t now;
+     int64_t interval;
+{
+  struct scope_receiver *r;
+
+  if (scope->ntemplates == 0
+      || (r = find_scope_receiver (scope, receiver)) == 0)
+    return 0;
+  if (r->generation == scope->generation && now < r->next)
+    return 0;
+  r->generation = scope->generation;
+  r->next = now + interval;
+  return 1;
+}
+
+/*
+ template_scope_sequence(scope, receiver, initial, n)
+
+ Return the sequence number of the next datagram of SCOPE for
+ RECEIVER, and advance it by N.  The first sequence number is
+ INITIAL, normally that of the exporter's current datagram.
+ */
+uint32_t
+template_scope_sequence (scope, receiver, initial, n)
+     struct template_scope *scope;
+     const void *receiver;
+     uint32_t initial;
+     uint32_t n;
+{
+  struct scope_receiver *r = find_scope_receiver (scope, receiver);
+  uint32_t sequence;
+
+  if (r == 0)
+    return initial;
+  if (!r->sequence_p)
+    {
+      r->sequence = initial;
+      r->sequence_p = 1;
+    }
+  sequence = r->sequence;
+  r->sequence += n;
+  return sequence;
+}
+
+/*
+ template_record_length(scope, id, options_p, key)
+
+ Return the length of the data records that template ID of SCOPE
+ describes, or 0 if it is unknown or varies.  *OPTIONS_P is set if it
+ is an options template.  If KEY is not null, the positions of the
+ flow key fields in the records are stored there.
+ */
+unsigned
+template_record_length (scope, id, options_p, key)
+     struct template_scope *scope;
+     unsigned id;
+     int *options_p;
+     struct flow_key *key;
+{
+  unsigned k;
+
+  *options_p = 0;
+  for (k = 0; k < scope->ntemplates; ++k)
+    {
+      struct template *t = &scope->templates[k];
+
+      if (t->id == id)
+	{
+	  *options_p = t->set_id == V9_OPTIONS_TEMPLATE_SET
+	    || t->set_id == IPFIX_OPTIONS_TEMPLATE_SET;
+	  if (key != 0)
+	    *key = t->flow_key;
+	  return t->record_len;
+	}
+    }
+  return 0;
+}
+
+/* Close the set that starts at SET and ends at END, padding it to a
+   multiple of four bytes for NetFlow v9.  Returns the new end. */
+static unsigned char *
+close_set (unsigned version, unsigned char *set, unsigned char *end)
+{
+  if (version == 9)
+    while ((end - set) % 4 != 0)
+      *end++ = 0;
+  put16 (set + 2, end - set);
+  return end;
+}
+
+/* Close the datagram D, with NRECORDS template records, which ends at
+   END.  The header of a NetFlow v9 datagram counts its records, and
+   that of an IPFIX datagram has its length. */
+static void
+close_datagram (unsigned version, struct iovec *d, unsigned char *end,
+		unsigned nrecords)
+{
+  d->iov_len = end - (unsigned char *) d->iov_base;
+  put16 ((unsigned char *) d->iov_base + 2,
+	 version == 9 ? nrecords : d->iov_len);
+}
+
+/* Make the replay datagrams of SCOPE: a header, followed by a
+   template set and an options template set, as far as there are such
+   templates, in as many datagrams as needed. */
+static struct replay *
+make_replay (struct template_scope *scope)
+{
+  unsigned hdrlen
+    = scope->version == 9 ? NETFLOW_V9_HEADER_LEN : IPFIX_HEADER_LEN;
+  unsigned set_ids[2], kind, k, nrecords = 0;
+  size_t size = sizeof (struct replay);
+  struct replay *r;
+  struct iovec *d = 0;
+  unsigned char *p, *set = 0;
+
+  set_ids[0] = scope->version == 9 ? V9_TEMPLATE_SET : IPFIX_TEMPLATE_SET;
+  set_ids[1] = scope->version == 9
+    ? V9_OPTIONS_TEMPLATE_SET : IPFIX_OPTIONS_TEMPLATE_SET;
+  /* At worst, each template needs a datagram of its own. */
+  for (k = 0; k < scope->ntemplates; ++k)
+    size += sizeof (struct iovec) + hdrlen + 4 + scope->templates[k].len + 3;
+  if ((r = malloc (size)) == 0)
+    return 0;
+  r->datagrams = (struct iovec *) (r + 1);
+  r->ndatagrams = 0;
+  p = (unsigned char *) (r->datagrams + scope->ntemplates);
+
+  for (kind = 0; kind < 2; ++kind)
+    {
+      for (k = 0; k < scope->ntemplates; ++k)
+	{
+	  struct template *t = &scope->templates[k];
+
+	  if (t->set_id != set_ids[kind])
+	    continue;
+	  if (d != 0
+	      && (p - (unsigned char *) d->iov_base) + (set == 0 ? 4 : 0)
+		 + t->len + 3 > REPLAY_DATAGRAM_SIZE)
+	    {
+	      if (set != 0)
+		p = close_set (scope->version, set, p);
+	      close_datagram (scope->version, d, p, nrecords);
+	      d = 0;
+	    }
+	  if (d == 0)
+	    {
+	      /* Time and sequence number are filled in by
+		 template_replay(). */
+	      d = &r->datagrams[r->ndatagrams++];
+	      d->iov_base = p;
+	      bzero (p, hdrlen);
+	      put16 (p, scope->version);
+	      memcpy (p + hdrlen - 4, scope->key + 20, 4);
+	      p += hdrlen;
+	      set = 0;
+	      nrecords = 0;
+	    }
+	  if (set == 0)
+	    {
+	      set = p;
+	      put16 (set, set_ids[kind]);
+	      p += 4;
+	    }
+	  memcpy (p, t->record, t->len);
+	  p += t->len;
+	  ++nrecords;
+	}
+      if (set != 0)
+	p = close_set (scope->version, set, p);
+      set = 0;
+    }
+  if (d != 0)
+    close_datagram (scope->version, d, p, nrecords);
+  return r;
+}
+
+/*
+ template_replay(scope, datagramsp)
+
+ Store a pointer to the replay datagrams of SCOPE in *DATAGRAMSP, and
+ return their number.  The datagrams remain valid until the next
+ template_cache_collect().  They are shared by all receivers, and
+ their headers lack the export time and sequence number: each
+ receiver is sent a copy completed by template_stamp().
+ */
+unsigned
+template_replay (scope, datagramsp)
+     struct template_scope *scope;
+     const struct iovec **datagramsp;
+{
+  if (scope->replay == 0 && (scope->replay = make_replay (scope)) == 0)
+    return 0;
+  *datagramsp = scope->replay->datagrams;
+  return scope->replay->ndatagrams;
+}
+
+/*
+ template_stamp(scope, receiver, out, data)
+
+ Complete the header of OUT, a copy of a replay datagram of SCOPE or
+ of a NetFlow v9 datagram of its exporter, for RECEIVER: the export
+ time is that of DATA, the exporter's current datagram, and for
+ NetFlow v9, the sequence number is the next one of RECEIVER.  IPFIX
+ sequence numbers count data records, which replays don't have, so
+ they take that of the receiver's next record (see records.c) if it
+ has its own numbering, and that of DATA otherwise.
+ */
+void
+template_stamp (scope, receiver, out, data)
+     struct template_scope *scope;
+     const void *receiver;
+     unsigned char *out;
+     const unsigned char *data;
+{
+  struct scope_receiver *r;
+
+  if (scope->version == 9)
+    {
+      /* system uptime and UNIX seconds */
+      memcpy (out + 4, data + 4, 8);
+      put32 (out + 12, template_scope_sequence (scope, receiver,
+						get32 (data + 12), 1));
+    }
+  else
+    {
+      memcpy (out + 4, data + 4, 4);
+      r = find_scope_receiver (scope, receiver);
+      put32 (out + 8, r != 0 && r->sequence_p
+	     ? r->sequence : get32 (data + 8));
+    }
+}
+
+/*
+ template_cache_forget_receivers(cache)
+
+ Forget which receivers have got which templates, so that all of them
+ get the templates again when due, and their sequence numbers.  This
+ is used when the configuration has changed, since the receivers may
+ not exist any more.
+ */
+void
+template_cache_forget_receivers (cache)
+     struct template_cache *cache;
+{
+  unsigned k;
+
+  for (k = 0; k < cache->size; ++k)
+    if (cache->scopes[k] != 0)
+      cache->scopes[k]->nreceivers = 0;
+}
+
+/*
+ template_cache_collect(cache)
+
+ Free the replay datagrams of CACHE that have been replaced because
+ templates changed.  The caller must make sure that no sends that
+ refer to them are pending.
+ */
+void
+template_cache_collect (cache)
+     struct template_cache *cache;
+{
+  struct replay *r;
+
+  while ((r = cache->retired) != 0)
+    {
+      cache->retired = r->next;
+      free (r);
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ templates.h
+
+ Date Created: Thu Oct 22 10:12:48 2026
+ */
+
+struct template_cache;
+struct template_scope;
+
+/* Where the fields that identify a flow are in its data records, see
+   template_record_length(); a LEN of 0 means the field is missing. */
+enum flow_key_field
+{
+  FK_SRC_ADDR,
+  FK_DST_ADDR,
+  FK_SRC_PORT,
+  FK_DST_PORT,
+  FK_PROTOCOL,
+  FK_NFIELDS
+};
+
+struct flow_key {
+  uint16_t			off[FK_NFIELDS];
+  uint8_t			len[FK_NFIELDS];
+};
+
+/* The fields of NetFlow and IPFIX datagrams, in network byte order */
+static inline unsigned
+get16 (const unsigned char *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+get32 (const unsigned char *p)
+{
+  return ((uint32_t) get16 (p) << 16) | get16 (p + 2);
+}
+
+static inline void
+put16 (unsigned char *p, unsigned v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static inline void
+put32 (unsigned char *p, uint32_t v)
+{
+  put16 (p, v >> 16);
+  put16 (p + 2, v);
+}
+
+extern struct template_cache *make_template_cache (void);
+extern struct template_scope *template_cache_update (struct template_cache *,
+						     const struct sockaddr *,
+						     const unsigned char *,
+						     size_t);
+extern int template_replay_due (struct template_scope *, const void *,
+				int64_t, int64_t);
+extern uint32_t template_scope_sequence (struct template_scope *,
+					 const void *, uint32_t, uint32_t);
+extern unsigned template_record_length (struct template_scope *, unsigned,
+					int *, struct flow_key *);
+extern int template_set_records (struct template_scope *, unsigned,
+				 const unsigned char *, unsigned);
+extern unsigned template_replay (struct template_scope *,
+				 const struct iovec **);
+extern void template_stamp (struct template_scope *, const void *,
+			    unsigned char *, const unsigned char *);
+extern void template_cache_forget_receivers (struct template_cache *);
+extern void template_cache_collect (struct template_cache *);
@@ -0,0 +1,388 @@
+/*
+ txring.c
+
+ Date Created: Sun Oct 18 10:02:17 2026
+
+ Transmission of spoofed datagrams through a packet socket with a
+ memory-mapped transmit ring (PACKET_TX_RING).  Instead of a system
+ call per datagram that goes through the IP output path, complete
+ Ethernet frames are written into a ring shared with the kernel, and
+ the kernel is told to send all of them with a single send() per
+ batch.  With PACKET_QDISC_BYPASS, the frames are handed to the
+ driver directly.
+
+ Frames are addressed to the link-layer address given for the
+ receiver (the lladdr= receiver option), since there is no neighbor
+ resolution on this path.  Datagrams that don't fit into the
+ interface's MTU cannot be fragmented here; tx_ring_send() fails
+ with EMSGSIZE for them, and the caller sends them over the raw IP
+ socket instead.
+
+ Rings are not shared between threads: each worker has its own list
+ of rings, one per interface.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_IF_PACKET_H
+# include <sys/ioctl.h>
+# include <sys/mman.h>
+# include <net/if.h>
+# include <net/if_arp.h>
+# include <linux/if_packet.h>
+# include <linux/if_ether.h>
+#endif
+
+#include "rawsend.h"
+#include "txring.h"
+
+#if defined (HAVE_LINUX_IF_PACKET_H) && defined (PACKET_TX_RING)
+
+/* Number of frames in each ring. */
+#define TX_RING_FRAMES 512
+
+/* Offset of the frame data from the start of a TPACKET_V2 frame. */
+#define TX_DATA_OFFSET (TPACKET2_HDRLEN - sizeof (struct sockaddr_ll))
+
+/*
+ struct tx_ring
+
+ A transmit ring on interface IFINDEX.  HEAD is the next frame to be
+ filled, and UNSENT the number of frames filled since the kernel was
+ last told to send (see flush_tx_rings()).  MTU is the largest IP
+ datagram that fits into a frame.
+ */
+struct tx_ring {
+  struct tx_ring	       *next;
+  int				ifindex;
+  int				fd;
+  unsigned char		       *frames;
+  size_t			ring_size;
+  unsigned			frame_size;
+  unsigned			nframes;
+  unsigned			head;
+  unsigned			unsent;
+  size_t			mtu;
+  unsigned char			lladdr[ETH_ALEN]; /* our own address */
+};
+
+static struct tx_ring *
+make_tx_ring (ifindex)
+     int ifindex;
+{
+  struct tx_ring *r;
+  struct tpacket_req req;
+  struct sockaddr_ll sll;
+  struct ifreq ifr;
+  int version = TPACKET_V2, on = 1;
+  unsigned block_size;
+  long page_size = sysconf (_SC_PAGESIZE);
+
+  if ((r = calloc (1, sizeof (struct tx_ring))) == 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return 0;
+    }
+  r->ifindex = ifindex;
+  memset (&ifr, 0, sizeof ifr);
+  if (if_indextoname (ifindex, ifr.ifr_name) == 0)
+    {
+      fprintf (stderr, "Unknown interface index %d: %s\n",
+	       ifindex, strerror (errno));
+      free (r);
+      return 0;
+    }
+  if ((r->fd = socket (PF_PACKET, SOCK_RAW, 0)) == -1)
+    {
+      fprintf (stderr, "socket(PF_PACKET): %s\n", strerror (errno));
+      free (r);
+      return 0;
+    }
+  if (ioctl (r->fd, SIOCGIFHWADDR, &ifr) == -1
+      || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+    {
+      fprintf (stderr, "%s is not an Ethernet interface\n", ifr.ifr_name);
+      goto fail;
+    }
+  memcpy (r->lladdr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+  if (ioctl (r->fd, SIOCGIFMTU, &ifr) == -1)
+    {
+      fprintf (stderr, "ioctl(SIOCGIFMTU, %s): %s\n",
+	       ifr.ifr_name, strerror (errno));
+      goto fail;
+    }
+  r->mtu = ifr.ifr_mtu;
+
+  if (setsockopt (r->fd, SOL_PACKET, PACKET_VERSION,
+		  (char *) &version, sizeof version) == -1)
+    {
+      fprintf (stderr, "setsockopt(PACKET_VERSION): %s\n", strerror (errno));
+      goto fail;
+    }
+  /* Skip malformed frames instead of stopping at them. */
+  if (setsockopt (r->fd, SOL_PACKET, PACKET_LOSS,
+		  (char *) &on, sizeof on) == -1)
+    {
+      fprintf (stderr, "setsockopt(PACKET_LOSS): %s\n", strerror (errno));
+      goto fail;
+    }
+#ifdef PACKET_QDISC_BYPASS
+  if (setsockopt (r->fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+		  (char *) &on, sizeof on) == -1)
+    {
+      fprintf (stderr, "Warning: setsockopt(PACKET_QDISC_BYPASS) failed: %s\n",
+	       strerror (errno));
+    }
+#endif
+
+  /* Frames are a power of two in size, so that they pack into
+     blocks, which must be a multiple of the page size. */
+  for (r->frame_size = TPACKET_ALIGNMENT;
+       r->frame_size < TX_DATA_OFFSET + ETH_HLEN + r->mtu;
+       r->frame_size *= 2)
+    ;
+  block_size = r->frame_size < page_size ? page_size : r->frame_size;
+  r->nframes = TX_RING_FRAMES;
+  if (r->nframes % (block_size / r->frame_size) != 0)
+    r->nframes += block_size / r->frame_size
+      - r->nframes % (block_size / r->frame_size);
+  req.tp_block_size = block_size;
+  req.tp_frame_size = r->frame_size;
+  req.tp_frame_nr = r->nframes;
+  req.tp_block_nr = r->nframes / (block_size / r->frame_size);
+  if (setsockopt (r->fd, SOL_PACKET, PACKET_TX_RING,
+		  (char *) &req, sizeof req) == -1)
+    {
+      fprintf (stderr, "setsockopt(PACKET_TX_RING): %s\n", strerror (errno));
+      goto fail;
+    }
+  r->ring_size = (size_t) req.tp_block_size * req.tp_block_nr;
+  if ((r->frames = mmap (0, r->ring_size, PROT_READ|PROT_WRITE,
+			 MAP_SHARED, r->fd, 0)) == MAP_FAILED)
+    {
+      fprintf (stderr, "mmap(PACKET_TX_RING): %s\n", strerror (errno));
+      goto fail;
+    }
+
+  /* Protocol 0, so that nothing is received on this socket. */
+  memset (&sll, 0, sizeof sll);
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = 0;
+  sll.sll_ifindex = ifindex;
+  if (bind (r->fd, (struct sockaddr *) &sll, sizeof sll) == -1)
+    {
+      fprintf (stderr, "bind(%s): %s\n", ifr.ifr_name, strerror (errno));
+      munmap (r->frames, r->ring_size);
+      goto fail;
+    }
+  return r;
+
+ fail:
+  close (r->fd);
+  free (r);
+  return 0;
+}
+
+/*
+ find_tx_ring(list, ifindex)
+
+ Return the ring for interface IFINDEX from LIST, or 0 if there is
+ none.
+ */
+struct tx_ring *
+find_tx_ring (list, ifindex)
+     struct tx_ring *list;
+     int ifindex;
+{
+  struct tx_ring *r;
+
+  for (r = list; r != 0; r = r->next)
+    if (r->ifindex == ifindex)
+      return r;
+  return 0;
+}
+
+/*
+ get_tx_ring(list, ifindex)
+
+ Return the ring for interface IFINDEX from LIST, creating it and
+ adding it to LIST if necessary.  Returns 0 after printing an error
+ message if the ring cannot be created.
+
+ Rings are only ever added to a list, and a new ring is published
+ with a release store, so the owner of LIST can use it while another
+ thread adds rings (see make_send_sockets()).
+ */
+struct tx_ring *
+get_tx_ring (list, ifindex)
+     struct tx_ring **list;
+     int ifindex;
+{
+  struct tx_ring *r;
+
+  if ((r = find_tx_ring (__atomic_load_n (list, __ATOMIC_ACQUIRE), ifindex)) != 0)
+    return r;
+  if ((r = make_tx_ring (ifindex)) == 0)
+    return 0;
+  r->next = *list;
+  __atomic_store_n (list, r, __ATOMIC_RELEASE);
+  return r;
+}
+
+int
+tx_ring_fd (r)
+     const struct tx_ring *r;
+{
+  return r->fd;
+}
+
+/* Tell the kernel to send the frames that have been put into ring R. */
+static void
+kick_tx_ring (r)
+     struct tx_ring *r;
+{
+  if (send (r->fd, 0, 0, MSG_DONTWAIT) == -1
+      && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+    return;			/* try again on the next flush */
+  r->unsent = 0;
+}
+
+static int
+frame_available_p (hdr)
+     struct tpacket2_hdr *hdr;
+{
+  unsigned status = __atomic_load_n (&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+  return status == TP_STATUS_AVAILABLE || status == TP_STATUS_WRONG_FORMAT;
+}
+
+/*
+ tx_ring_send(r, lladdr, t, msg, msglen, payload_sum, saddr, flags)
+
+ Put a frame to link-layer address LLADDR into ring R, containing the
+ datagram that raw_send_with_template() would send with the same
+ arguments.  The frame is only sent on the next flush_tx_rings().
+ Returns 0 on success.  Returns -1 with errno set to EAGAIN if the
+ ring is full, or to EMSGSIZE if the datagram doesn't fit into a
+ frame.
+ */
+int
+tx_ring_send (r, lladdr, t, msg, msglen, payload_sum, saddr, flags)
+     struct tx_ring *r;
+     const unsigned char *lladdr;
+     const struct raw_send_template *t;
+     const void *msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr;
+     int flags;
+{
+  struct tpacket2_hdr *hdr
+    = (struct tpacket2_hdr *) (r->frames + (size_t) r->head * r->frame_size);
+  unsigned char *frame = (unsigned char *) hdr + TX_DATA_OFFSET;
+  uint16_t type;
+  int n;
+
+  if (!frame_available_p (hdr))
+    {
+      /* Maybe the kernel just hasn't been asked to send yet. */
+      if (r->unsent > 0)
+	kick_tx_ring (r);
+      if (!frame_available_p (hdr))
+	{
+	  errno = EAGAIN;
+	  return -1;
+	}
+    }
+  if ((n = raw_build_datagram (frame + ETH_HLEN, r->mtu, t, msg, msglen,
+			       payload_sum, saddr, flags)) == -1)
+    return -1;
+  type = htons ((frame[ETH_HLEN] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP);
+  memcpy (frame, lladdr, ETH_ALEN);
+  memcpy (frame + ETH_ALEN, r->lladdr, ETH_ALEN);
+  memcpy (frame + 2 * ETH_ALEN, &type, sizeof type);
+  hdr->tp_len = ETH_HLEN + n;
+  __atomic_store_n (&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+  r->head = (r->head + 1) % r->nframes;
+  ++r->unsent;
+  return 0;
+}
+
+/*
+ flush_tx_rings(list)
+
+ Tell the kernel to send the frames that have been put into the
+ rings of LIST.
+ */
+void
+flush_tx_rings (list)
+     struct tx_ring *list;
+{
+  struct tx_ring *r;
+
+  for (r = list; r != 0; r = r->next)
+    if (r->unsent > 0)
+      kick_tx_ring (r);
+}
+
+#else /* not (HAVE_LINUX_IF_PACKET_H && PACKET_TX_RING) */
+
+struct tx_ring *
+find_tx_ring (list, ifindex)
+     struct tx_ring *list;
+     int ifindex;
+{
+  return 0;
+}
+
+struct tx_ring *
+get_tx_ring (list, ifindex)
+     struct tx_ring **list;
+     int ifindex;
+{
+  fprintf (stderr, "Transmit rings (dev=) are not supported on this system\n");
+  return 0;
+}
+
+int
+tx_ring_fd (r)
+     const struct tx_ring *r;
+{
+  return -1;
+}
+
+int
+tx_ring_send (r, lladdr, t, msg, msglen, payload_sum, saddr, flags)
+     struct tx_ring *r;
+     const unsigned char *lladdr;
+     const struct raw_send_template *t;
+     const void *msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr;
+     int flags;
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+flush_tx_rings (list)
+     struct tx_ring *list;
+{
+}
+
+#endif /* not (HAVE_LINUX_IF_PACKET_H && PACKET_TX_RING) */
@@ -0,0 +1,19 @@
+/*
+ txring.h
+
+ Date Created: Sun Oct 18 10:02:17 2026
+ */
+
+struct tx_ring;
+struct raw_send_template;
+
+extern struct tx_ring *get_tx_ring (struct tx_ring **, int);
+extern struct tx_ring *find_tx_ring (struct tx_ring *, int);
+extern int tx_ring_fd (const struct tx_ring *);
+extern int tx_ring_send (struct tx_ring *, const unsigned char *,
+			 const struct raw_send_template *,
+			 const void *, size_t,
+			 uint32_t,
+			 const struct sockaddr *,
+			 int);
+extern void flush_tx_rings (struct tx_ring *);
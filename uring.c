@@ -0,0 +1,803 @@
+/*
+ uring.c
+
+ Date Created: Wed Oct 21 14:37:05 2026
+
+ An io_uring for the receive socket of a worker (the -I option).
+
+ Datagrams are received with a single multishot recvmsg request into
+ a ring of buffers provided to the kernel, so that a busy socket
+ needs no system call per datagram, or even per batch, to be read.
+ Each buffer holds the struct io_uring_recvmsg_out header, the
+ sender's address, the ancillary data and the datagram.  Buffers that
+ have been handed out by uring_next() are given back to the kernel,
+ oldest first, with uring_release_buffers().
+
+ Sends over the cooked sockets, one-shot polls for full send sockets,
+ and a timeout are submitted on the same ring, so that submitting a
+ batch of sends and waiting for the next datagrams takes a single
+ io_uring_enter() (see uring_submit()).
+
+ The ring is created disabled, and enabled by uring_start() in the
+ thread that will use it, because where the kernel supports it, the
+ ring is restricted to a single submitter thread, and completions are
+ only processed when that thread asks for them.  There is no liburing
+ dependency.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_IO_URING_H
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <linux/io_uring.h>
+#endif
+
+#include "uring.h"
+
+#if defined (HAVE_LINUX_IO_URING_H) \
+  && HAVE_DECL_IORING_REGISTER_PBUF_RING && HAVE_DECL_IORING_RECV_MULTISHOT
+
+/* Single submitter and deferred task work (Linux 6.1), missing from
+   older headers.  The ring is set up without them if the kernel
+   doesn't know them. */
+#ifndef IORING_SETUP_SINGLE_ISSUER
+# define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#endif
+#ifndef IORING_SETUP_DEFER_TASKRUN
+# define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+
+/* The kind of request is in the top byte of its user_data, the tag
+   of a send or the file descriptor of a poll in the low 32 bits. */
+#define UD_RECV			((uint64_t) 1 << 56)
+#define UD_SEND			((uint64_t) 2 << 56)
+#define UD_POLL			((uint64_t) 3 << 56)
+#define UD_TIMEOUT		((uint64_t) 4 << 56)
+#define UD_TIMEOUT_UPDATE	((uint64_t) 5 << 56)
+#define UD_KIND(ud)		((ud) & ((uint64_t) 0xff << 56))
+
+/* Send sockets that can be polled at the same time, see
+   uring_poll_out(). */
+#define URING_MAX_POLLS 16
+
+/* The group ID of our provided buffers. */
+#define URING_BUFFER_GROUP 0
+
+/*
+ struct uring
+
+ An io_uring on receive socket SOCK, with the submission queue (SQ)
+ and completion queue (CQ) shared with the kernel.  SQ_TAIL_LOCAL
+ counts the prepared entries, of which SQ_SUBMITTED have been
+ submitted.
+
+ BUFS holds NBUFS receive buffers of BUF_SIZE bytes each, provided
+ to the kernel through the buffer ring BR.  HELD is a FIFO of the
+ NHELD buffers that have been handed out by uring_next().  RECV_MSG
+ describes the layout of a buffer to the multishot recvmsg request,
+ which is re-armed when the kernel has terminated it (RECV_ARMED is
+ zero).  If the kernel ran out of buffers (RECV_STALLED), this waits
+ until some have been released.
+
+ At most one timeout is pending; it expires at TIMEOUT_AT (see
+ monotonic_ns()).  POLLED lists the NPOLLED file descriptors with a
+ pending poll.
+ */
+struct uring {
+  int				fd;
+  int				sock;
+  unsigned char		       *sq_ring;
+  size_t			sq_ring_size;
+  unsigned char		       *cq_ring;
+  size_t			cq_ring_size;
+  uint32_t		       *sq_head;
+  uint32_t		       *sq_tail;
+  uint32_t			sq_mask;
+  uint32_t			sq_entries;
+  uint32_t		       *sq_array;
+  struct io_uring_sqe	       *sqes;
+  size_t			sqes_size;
+  uint32_t			sq_tail_local;
+  uint32_t			sq_submitted;
+  uint32_t		       *cq_head;
+  uint32_t		       *cq_tail;
+  uint32_t			cq_mask;
+  struct io_uring_cqe	       *cqes;
+
+  struct io_uring_buf_ring     *br;
+  size_t			br_size;
+  unsigned char		       *bufs;
+  unsigned			nbufs;
+  size_t			buf_size;
+  uint16_t			br_tail;
+  uint16_t		       *held;
+  unsigned			held_head;
+  unsigned			nheld;
+  struct msghdr			recv_msg;
+  int				recv_armed;
+  int				recv_stalled;
+
+  int				timeout_armed;
+  int64_t			timeout_at;
+  struct __kernel_timespec	timeout_ts;
+  int				polled[URING_MAX_POLLS];
+  unsigned			npolled;
+};
+
+static int
+sys_io_uring_setup (entries, p)
+     unsigned entries;
+     struct io_uring_params *p;
+{
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (fd, to_submit, min_complete, flags)
+     int fd;
+     unsigned to_submit;
+     unsigned min_complete;
+     unsigned flags;
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		  0, 0);
+}
+
+static int
+sys_io_uring_register (fd, opcode, arg, nr_args)
+     int fd;
+     unsigned opcode;
+     void *arg;
+     unsigned nr_args;
+{
+  return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ map_uring(u, p)
+
+ Map the rings of the io_uring set up with parameters P into U.
+ Returns 0 on success, or -1 after printing an error message.
+ */
+static int
+map_uring (u, p)
+     struct uring *u;
+     struct io_uring_params *p;
+{
+  u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof (uint32_t);
+  u->cq_ring_size
+    = p->cq_off.cqes + p->cq_entries * sizeof (struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (u->cq_ring_size > u->sq_ring_size)
+	u->sq_ring_size = u->cq_ring_size;
+      u->cq_ring_size = 0;
+    }
+  if ((u->sq_ring = mmap (0, u->sq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd,
+			  IORING_OFF_SQ_RING)) == MAP_FAILED)
+    {
+      u->sq_ring = 0;
+      fprintf (stderr, "mmap(io_uring): %s\n", strerror (errno));
+      return -1;
+    }
+  if (u->cq_ring_size == 0)
+    u->cq_ring = u->sq_ring;
+  else if ((u->cq_ring = mmap (0, u->cq_ring_size, PROT_READ|PROT_WRITE,
+			       MAP_SHARED|MAP_POPULATE, u->fd,
+			       IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+      u->cq_ring = 0;
+      fprintf (stderr, "mmap(io_uring): %s\n", strerror (errno));
+      return -1;
+    }
+  u->sqes_size = p->sq_entries * sizeof (struct io_uring_sqe);
+  if ((u->sqes = mmap (0, u->sqes_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, u->fd,
+		       IORING_OFF_SQES)) == MAP_FAILED)
+    {
+      u->sqes = 0;
+      fprintf (stderr, "mmap(io_uring): %s\n", strerror (errno));
+      return -1;
+    }
+  u->sq_head = (uint32_t *) (u->sq_ring + p->sq_off.head);
+  u->sq_tail = (uint32_t *) (u->sq_ring + p->sq_off.tail);
+  u->sq_mask = *(uint32_t *) (u->sq_ring + p->sq_off.ring_mask);
+  u->sq_entries = p->sq_entries;
+  u->sq_array = (uint32_t *) (u->sq_ring + p->sq_off.array);
+  u->cq_head = (uint32_t *) (u->cq_ring + p->cq_off.head);
+  u->cq_tail = (uint32_t *) (u->cq_ring + p->cq_off.tail);
+  u->cq_mask = *(uint32_t *) (u->cq_ring + p->cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (u->cq_ring + p->cq_off.cqes);
+  return 0;
+}
+
+/*
+ provide_buffer(u, bid)
+
+ Put receive buffer BID of U into the buffer ring.  The kernel sees
+ it after commit_buffers().
+ */
+static void
+provide_buffer (u, bid)
+     struct uring *u;
+     unsigned bid;
+{
+  struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+
+  b->addr = (uintptr_t) (u->bufs + (size_t) bid * u->buf_size);
+  b->len = u->buf_size;
+  b->bid = bid;
+  ++u->br_tail;
+}
+
+static void
+commit_buffers (u)
+     struct uring *u;
+{
+  __atomic_store_n (&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ setup_buffers(u, nbufs, pdulen, controllen)
+
+ Allocate NBUFS receive buffers for datagrams of up to PDULEN bytes
+ with CONTROLLEN bytes of ancillary data, and register them with the
+ kernel as a ring of provided buffers.  NBUFS must be a power of two.
+ Returns 0 on success, or -1 after printing an error message.
+ */
+static int
+setup_buffers (u, nbufs, pdulen, controllen)
+     struct uring *u;
+     unsigned nbufs;
+     size_t pdulen;
+     size_t controllen;
+{
+  struct io_uring_buf_reg reg;
+  unsigned k;
+
+  u->nbufs = nbufs;
+  u->recv_msg.msg_namelen = sizeof (struct sockaddr_storage);
+  u->recv_msg.msg_controllen = controllen;
+  u->buf_size = sizeof (struct io_uring_recvmsg_out)
+    + u->recv_msg.msg_namelen + controllen + pdulen;
+  u->br_size = nbufs * sizeof (struct io_uring_buf);
+  if ((u->br = mmap (0, u->br_size, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+      u->br = 0;
+      fprintf (stderr, "mmap(buffer ring): %s\n", strerror (errno));
+      return -1;
+    }
+  if ((u->bufs = malloc ((size_t) nbufs * u->buf_size)) == 0
+      || (u->held = malloc (nbufs * sizeof (uint16_t))) == 0)
+    {
+      fprintf (stderr, "Out of memory allocating receive buffers\n");
+      return -1;
+    }
+  memset (&reg, 0, sizeof reg);
+  reg.ring_addr = (uintptr_t) u->br;
+  reg.ring_entries = nbufs;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (sys_io_uring_register (u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+      fprintf (stderr, "io_uring_register(PBUF_RING): %s\n", strerror (errno));
+      return -1;
+    }
+  for (k = 0; k < nbufs; ++k)
+    provide_buffer (u, k);
+  commit_buffers (u);
+  return 0;
+}
+
+static void
+free_uring (u)
+     struct uring *u;
+{
+  if (u->sqes != 0)
+    munmap (u->sqes, u->sqes_size);
+  if (u->cq_ring != 0 && u->cq_ring != u->sq_ring)
+    munmap (u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring != 0)
+    munmap (u->sq_ring, u->sq_ring_size);
+  if (u->fd != -1)
+    close (u->fd);
+  if (u->br != 0)
+    munmap (u->br, u->br_size);
+  free (u->bufs);
+  free (u->held);
+  free (u);
+}
+
+/*
+ make_uring(sock, entries, nbufs, pdulen, controllen)
+
+ Create an io_uring for receive socket SOCK with room for at least
+ ENTRIES requests to be prepared between two calls of uring_submit(),
+ and NBUFS receive buffers (a power of two) for datagrams of up to
+ PDULEN bytes with CONTROLLEN bytes of ancillary data.  Returns 0
+ after printing an error message if that fails.
+ */
+struct uring *
+make_uring (sock, entries, nbufs, pdulen, controllen)
+     int sock;
+     unsigned entries;
+     unsigned nbufs;
+     size_t pdulen;
+     size_t controllen;
+{
+  struct io_uring_params p;
+  struct uring *u;
+
+  if ((u = calloc (1, sizeof (struct uring))) == 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return 0;
+    }
+  u->sock = sock;
+  memset (&p, 0, sizeof p);
+  p.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE
+    | IORING_SETUP_SUBMIT_ALL
+    | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  /* Room for the completions of all requests in the SQ, plus those
+     of the multishot receive, which can use every buffer. */
+  p.cq_entries = 2 * entries + nbufs;
+  if ((u->fd = sys_io_uring_setup (entries, &p)) == -1 && errno == EINVAL)
+    {
+      memset (&p, 0, sizeof p);
+      p.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+      p.cq_entries = 2 * entries + nbufs;
+      u->fd = sys_io_uring_setup (entries, &p);
+    }
+  if (u->fd == -1)
+    {
+      fprintf (stderr, "io_uring_setup(): %s\n", strerror (errno));
+      free_uring (u);
+      return 0;
+    }
+  if (map_uring (u, &p) != 0
+      || setup_buffers (u, nbufs, pdulen, controllen) != 0)
+    {
+      free_uring (u);
+      return 0;
+    }
+  return u;
+}
+
+/*
+ uring_start(u)
+
+ Enable U for use by the calling thread.  Returns 0 on success, or -1
+ after printing an error message.
+ */
+int
+uring_start (u)
+     struct uring *u;
+{
+  if (sys_io_uring_register (u->fd, IORING_REGISTER_ENABLE_RINGS, 0, 0) == -1)
+    {
+      fprintf (stderr, "io_uring_register(ENABLE_RINGS): %s\n",
+	       strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ submit(u, min_complete)
+
+ Submit all prepared requests of U, and wait until at least
+ MIN_COMPLETE completions are in the CQ.  Returns -1 with errno set
+ on failure, and 0 otherwise.  A full CQ is not a failure: the
+ caller reaps completions anyway.
+ */
+static int
+submit (u, min_complete)
+     struct uring *u;
+     unsigned min_complete;
+{
+  unsigned to_submit;
+  int n;
+
+  __atomic_store_n (u->sq_tail, u->sq_tail_local, __ATOMIC_RELEASE);
+  to_submit = u->sq_tail_local - u->sq_submitted;
+  while (1)
+    {
+      n = sys_io_uring_enter (u->fd, to_submit, min_complete,
+			      IORING_ENTER_GETEVENTS);
+      if (n >= 0)
+	{
+	  u->sq_submitted += n;
+	  if ((unsigned) n >= to_submit)
+	    return 0;
+	  /* Not all requests taken: the CQ is full. */
+	  to_submit -= n;
+	  min_complete = 0;
+	  if (*u->cq_head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+	    return 0;
+	  continue;
+	}
+      if (errno == EBUSY || errno == EAGAIN)
+	return 0;
+      return -1;
+    }
+}
+
+/*
+ get_sqe(u)
+
+ Return a cleared submission queue entry of U for a new request.  If
+ the SQ is full, the requests in it are submitted first.
+ */
+static struct io_uring_sqe *
+get_sqe (u)
+     struct uring *u;
+{
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  while (u->sq_tail_local - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE)
+	 >= u->sq_entries)
+    {
+      if (submit (u, 0) == -1 && errno != EINTR)
+	{
+	  fprintf (stderr, "io_uring_enter(): %s\n", strerror (errno));
+	  exit (1);
+	}
+    }
+  idx = u->sq_tail_local & u->sq_mask;
+  sqe = &u->sqes[idx];
+  memset (sqe, 0, sizeof *sqe);
+  u->sq_array[idx] = idx;
+  ++u->sq_tail_local;
+  return sqe;
+}
+
+static void
+arm_recv (u)
+     struct uring *u;
+{
+  struct io_uring_sqe *sqe = get_sqe (u);
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = u->sock;
+  sqe->addr = (uintptr_t) &u->recv_msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_TRUNC;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = UD_RECV;
+  u->recv_armed = 1;
+  u->recv_stalled = 0;
+}
+
+/*
+ uring_submit(u, min_complete)
+
+ Submit the requests prepared on U, re-arming the receive request if
+ necessary, and wait until at least MIN_COMPLETE completions are
+ available to uring_next().  Returns 0 on success, and -1 with errno
+ set on failure; EINTR means that the wait was interrupted by a
+ signal.
+ */
+int
+uring_submit (u, min_complete)
+     struct uring *u;
+     unsigned min_complete;
+{
+  if (!u->recv_armed && !u->recv_stalled)
+    arm_recv (u);
+  return submit (u, min_complete);
+}
+
+/*
+ uring_sendmsg(u, fd, msg, tag, link)
+
+ Prepare a sendmsg() of MSG on FD.  Its completion is reported by
+ uring_next() with TAG.  If LINK is non-zero, the next request
+ prepared is only started when this one has succeeded, and is
+ cancelled otherwise.  MSG and the data it refers to must stay valid
+ until the completion has been reported.
+ */
+void
+uring_sendmsg (u, fd, msg, tag, link)
+     struct uring *u;
+     int fd;
+     const struct msghdr *msg;
+     uint32_t tag;
+     int link;
+{
+  struct io_uring_sqe *sqe = get_sqe (u);
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) msg;
+  sqe->len = 1;
+  /* Fail with EAGAIN when the socket is full, rather than have the
+     kernel wait for it to drain. */
+  sqe->msg_flags = MSG_DONTWAIT;
+  if (link)
+    sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = UD_SEND | tag;
+}
+
+/*
+ uring_poll_out(u, fd)
+
+ Prepare a poll of FD for writability, unless one is already pending.
+ */
+void
+uring_poll_out (u, fd)
+     struct uring *u;
+     int fd;
+{
+  struct io_uring_sqe *sqe;
+  unsigned k;
+
+  for (k = 0; k < u->npolled; ++k)
+    if (u->polled[k] == fd)
+      return;
+  if (u->npolled == URING_MAX_POLLS)
+    return;
+  u->polled[u->npolled++] = fd;
+  sqe = get_sqe (u);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = UD_POLL | (uint32_t) fd;
+}
+
+/*
+ uring_set_timeout(u, at)
+
+ Make sure that a wait on U ends no later than time AT (see
+ monotonic_ns()).  The pending timeout is moved forward if it expires
+ later.
+ */
+void
+uring_set_timeout (u, at)
+     struct uring *u;
+     int64_t at;
+{
+  struct io_uring_sqe *sqe;
+
+  if (u->timeout_armed && u->timeout_at <= at)
+    return;
+  u->timeout_ts.tv_sec = at / 1000000000;
+  u->timeout_ts.tv_nsec = at % 1000000000;
+  sqe = get_sqe (u);
+  if (u->timeout_armed)
+    {
+      sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+      sqe->addr = UD_TIMEOUT;
+      sqe->addr2 = (uintptr_t) &u->timeout_ts;
+      sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+      sqe->user_data = UD_TIMEOUT_UPDATE;
+    }
+  else
+    {
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->addr = (uintptr_t) &u->timeout_ts;
+      sqe->len = 1;
+      sqe->timeout_flags = IORING_TIMEOUT_ABS;
+      sqe->user_data = UD_TIMEOUT;
+    }
+  u->timeout_armed = 1;
+  u->timeout_at = at;
+}
+
+/*
+ recv_completion(u, cqe, c)
+
+ Fill in C from a successful completion CQE of the receive request of
+ U.  Returns 1 if it holds a datagram, and 0 otherwise.
+ */
+static int
+recv_completion (u, cqe, c)
+     struct uring *u;
+     const struct io_uring_cqe *cqe;
+     struct uring_completion *c;
+{
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  unsigned char *buf = u->bufs + (size_t) bid * u->buf_size;
+  struct io_uring_recvmsg_out out;
+  unsigned char *name, *control;
+
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return 0;
+  u->held[(u->held_head + u->nheld++) & (u->nbufs - 1)] = bid;
+  memcpy (&out, buf, sizeof out);
+  name = buf + sizeof out;
+  control = name + u->recv_msg.msg_namelen;
+  c->data = control + u->recv_msg.msg_controllen;
+  c->len = out.payloadlen;
+  c->addr = (struct sockaddr *) name;
+  c->addrlen = out.namelen < u->recv_msg.msg_namelen
+    ? out.namelen : u->recv_msg.msg_namelen;
+  memset (&c->control, 0, sizeof c->control);
+  c->control.msg_control = control;
+  c->control.msg_controllen = out.controllen;
+  return 1;
+}
+
+/*
+ uring_next(u, c)
+
+ Take the next completion from the CQ of U, and describe it in C.
+ Returns 1 if there was one, and 0 if the CQ is empty.
+
+ For a received datagram, C->data points into a receive buffer,
+ which stays valid until it is released by uring_release_buffers().
+ Completions that concern only U itself are not reported.
+ */
+int
+uring_next (u, c)
+     struct uring *u;
+     struct uring_completion *c;
+{
+  uint32_t head = *u->cq_head;
+
+  while (head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+      uint64_t ud = cqe->user_data;
+      int found = 1;
+
+      c->res = cqe->res;
+      switch (UD_KIND (ud))
+	{
+	case UD_RECV:
+	  c->event = URING_RECV;
+	  if (!(cqe->flags & IORING_CQE_F_MORE))
+	    u->recv_armed = 0;
+	  if (cqe->res == -ENOBUFS)
+	    {
+	      /* Wait for buffers to be released before re-arming. */
+	      u->recv_stalled = 1;
+	      found = 0;
+	    }
+	  else if (cqe->res >= 0)
+	    found = recv_completion (u, cqe, c);
+	  break;
+	case UD_SEND:
+	  c->event = URING_SEND;
+	  c->tag = (uint32_t) ud;
+	  break;
+	case UD_POLL:
+	  {
+	    unsigned k;
+
+	    for (k = 0; k < u->npolled; ++k)
+	      if (u->polled[k] == (int) (uint32_t) ud)
+		u->polled[k--] = u->polled[--u->npolled];
+	  }
+	  c->event = URING_POLL;
+	  c->tag = (uint32_t) ud;
+	  break;
+	case UD_TIMEOUT:
+	  u->timeout_armed = 0;
+	  c->event = URING_TIMEOUT;
+	  break;
+	case UD_TIMEOUT_UPDATE:
+	  /* The timeout had expired already, and was not re-armed. */
+	  if (cqe->res == -ENOENT)
+	    u->timeout_armed = 0;
+	  found = 0;
+	  break;
+	default:
+	  found = 0;
+	}
+      __atomic_store_n (u->cq_head, ++head, __ATOMIC_RELEASE);
+      if (found)
+	return 1;
+    }
+  return 0;
+}
+
+/*
+ uring_release_buffers(u, n)
+
+ Give the N receive buffers that were handed out first back to the
+ kernel.
+ */
+void
+uring_release_buffers (u, n)
+     struct uring *u;
+     unsigned n;
+{
+  if (n > u->nheld)
+    n = u->nheld;
+  if (n == 0)
+    return;
+  for (; n > 0; --n, --u->nheld)
+    provide_buffer (u, u->held[u->held_head++ & (u->nbufs - 1)]);
+  commit_buffers (u);
+  u->recv_stalled = 0;
+}
+
+#else /* not (HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_REGISTER_PBUF_RING && HAVE_DECL_IORING_RECV_MULTISHOT) */
+
+struct uring *
+make_uring (sock, entries, nbufs, pdulen, controllen)
+     int sock;
+     unsigned entries;
+     unsigned nbufs;
+     size_t pdulen;
+     size_t controllen;
+{
+  fprintf (stderr, "io_uring (-I) is not supported on this system\n");
+  return 0;
+}
+
+int
+uring_start (u)
+     struct uring *u;
+{
+  return -1;
+}
+
+int
+uring_submit (u, min_complete)
+     struct uring *u;
+     unsigned min_complete;
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+uring_sendmsg (u, fd, msg, tag, link)
+     struct uring *u;
+     int fd;
+     const struct msghdr *msg;
+     uint32_t tag;
+     int link;
+{
+}
+
+void
+uring_poll_out (u, fd)
+     struct uring *u;
+     int fd;
+{
+}
+
+void
+uring_set_timeout (u, at)
+     struct uring *u;
+     int64_t at;
+{
+}
+
+int
+uring_next (u, c)
+     struct uring *u;
+     struct uring_completion *c;
+{
+  return 0;
+}
+
+void
+uring_release_buffers (u, n)
+     struct uring *u;
+     unsigned n;
+{
+}
+
+#endif /* not (HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_REGISTER_PBUF_RING && HAVE_DECL_IORING_RECV_MULTISHOT) */
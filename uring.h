@@ -0,0 +1,36 @@
+/*
+ uring.h
+
+ Date Created: Wed Oct 21 14:37:05 2026
+ */
+
+struct uring;
+
+enum uring_event
+{
+  URING_RECV,		/* a datagram, or RES < 0 */
+  URING_SEND,		/* a send with TAG completed */
+  URING_POLL,		/* file descriptor TAG is writable */
+  URING_TIMEOUT,	/* see uring_set_timeout() */
+};
+
+struct uring_completion {
+  enum uring_event		event;
+  int				res; /* result, or -errno */
+  uint32_t			tag;
+  unsigned char		       *data; /* URING_RECV only */
+  size_t			len;
+  const struct sockaddr	       *addr;
+  socklen_t			addrlen;
+  struct msghdr			control; /* ancillary data only */
+};
+
+extern struct uring *make_uring (int, unsigned, unsigned, size_t, size_t);
+extern int uring_start (struct uring *);
+extern int uring_submit (struct uring *, unsigned);
+extern void uring_sendmsg (struct uring *, int, const struct msghdr *,
+			   uint32_t, int);
+extern void uring_poll_out (struct uring *, int);
+extern void uring_set_timeout (struct uring *, int64_t);
+extern int uring_next (struct uring *, struct uring_completion *);
+extern void uring_release_buffers (struct uring *, unsigned);
@@ -0,0 +1,991 @@
+/*
+ xsk.c
+
+ Date Created: Mon Oct 19 09:12:48 2026
+
+ Reception and transmission of flow-export datagrams through AF_XDP
+ sockets (the -X option), bypassing the socket layer altogether.
+
+ An XDP program on the interface redirects UDP datagrams to the
+ flow-export port to the AF_XDP socket of the receive queue they
+ arrived on; all other traffic is passed on to the network stack as
+ usual.  Each worker has one socket, bound to the queue with its
+ index, and there must be a worker for every receive queue, as
+ datagrams arriving on a queue without a socket would be passed on to
+ the stack, where nothing listens on the port.  Each worker has its
+ own UMEM, the memory area that holds the frames exchanged with the
+ kernel.  The datagrams are handed to the matching and fan-out code
+ where they are in the UMEM.
+
+ Spoofed copies for receivers on the same interface (dev= with the
+ -X interface) are sent from the same UMEM: the Ethernet, IP and UDP
+ headers for each receiver go into a frame of their own, and where
+ the kernel supports multi-buffer AF_XDP, the frame is chained to the
+ payload in the received frame, so that all receivers share one copy
+ of it.  Otherwise the payload is copied after the headers.  Copies
+ for other receivers take the usual path.
+
+ Frames are reference counted: a received frame is held until the
+ next xsk_receive(), and until the kernel has completed all
+ transmissions of its payload.  Frames that are no longer referenced
+ go back to the fill ring.
+
+ The XDP program is built and loaded with the bpf() system call, and
+ attached through a BPF link, so that it goes away when samplicator
+ exits.  Native XDP is tried first, then generic (SKB) mode, which
+ works on any interface, e.g. veth.  There is no libbpf dependency.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#if defined (HAVE_LINUX_IF_XDP_H) && defined (HAVE_LINUX_BPF_H)
+# include <sys/syscall.h>
+# include <sys/ioctl.h>
+# include <sys/mman.h>
+# include <net/if.h>
+# include <net/if_arp.h>
+# include <linux/if_ether.h>
+# include <linux/if_link.h>
+# include <linux/if_xdp.h>
+# include <linux/bpf.h>
+#endif
+#ifdef HAVE_LINUX_ETHTOOL_H
+# include <linux/ethtool.h>
+# include <linux/sockios.h>
+#endif
+
+#include "samplicator.h"
+#include "rawsend.h"
+#include "rxring.h"
+#include "xsk.h"
+
+#if defined (HAVE_LINUX_IF_XDP_H) && defined (HAVE_LINUX_BPF_H) \
+  && HAVE_DECL_BPF_XDP
+
+#ifndef AF_XDP
+# define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+# define SOL_XDP 283
+#endif
+/* Multi-buffer AF_XDP (Linux 6.6), missing from older headers.  The
+   kernel rejects the bind flag if it doesn't know it. */
+#ifndef XDP_USE_SG
+# define XDP_USE_SG (1 << 4)
+#endif
+#ifndef XDP_PKT_CONTD
+# define XDP_PKT_CONTD (1 << 0)
+#endif
+
+/* Frames in each UMEM, and entries in each of the four rings of a
+   socket. */
+#define XSK_FRAMES 4096
+#define XSK_RING_SIZE 2048
+
+/* How many calls of xsk_receive() between updates of the drop
+   count. */
+#define XSK_STATS_INTERVAL 256
+
+/* One of the rings shared with the kernel.  DESCS holds SIZE entries,
+   either UMEM addresses or struct xdp_desc. */
+struct xsk_ring {
+  uint32_t		       *producer;
+  uint32_t		       *consumer;
+  void			       *descs;
+  uint32_t			size;
+};
+
+/*
+ struct xsk
+
+ An AF_XDP socket on interface IFINDEX, with its UMEM of NFRAMES
+ frames of FRAME_SIZE bytes each.  REFS counts the references to each
+ frame, and FREE_FRAMES holds the NFREE frames that are neither
+ referenced nor in the fill ring.  HELD lists the NHELD frames
+ returned by the last xsk_receive().  If SG is set, transmitted
+ datagrams can consist of two frames.  MTU is the largest IP datagram
+ that can be sent.
+ */
+struct xsk {
+  int				fd;
+  int				ifindex;
+  int				sg;
+  unsigned char		       *umem;
+  size_t			umem_size;
+  unsigned			frame_size;
+  unsigned			nframes;
+  size_t			mtu;
+  unsigned char			lladdr[ETH_ALEN]; /* our own address */
+  struct xsk_ring		fill;
+  struct xsk_ring		comp;
+  struct xsk_ring		rx;
+  struct xsk_ring		tx;
+  uint16_t		       *refs;
+  uint32_t		       *free_frames;
+  unsigned			nfree;
+  uint32_t		       *held;
+  unsigned			nheld;
+  int				skipping; /* rest of a multi-buffer packet */
+  unsigned			calls; /* since the last drop count */
+  struct xdp_statistics		stats_seen;
+  unsigned long			drops; /* not yet reported */
+};
+
+static int
+sys_bpf (cmd, attr)
+     int cmd;
+     union bpf_attr *attr;
+{
+  return syscall (__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+#define INSN(code, dst, src, off, imm) { (code), (dst), (src), (off), (imm) }
+
+/* Jump targets in load_xdp_program(), which jump instructions carry
+   in their offset field until the program is assembled. */
+enum { L_IPV4, L_IPV6, L_PORT, L_PASS, NLABELS };
+
+/* Append the N instructions of BLOCK to CODE at *POS. */
+static void
+emit (code, pos, block, n)
+     struct bpf_insn *code;
+     unsigned *pos;
+     const struct bpf_insn *block;
+     size_t n;
+{
+  memcpy (code + *pos, block, n * sizeof *block);
+  *pos += n;
+}
+
+/*
+ load_xdp_program(map_fd, port, ipv4_p, ipv6_p)
+
+ Load an XDP program that redirects incoming, unfragmented UDP
+ datagrams to PORT over IPv4 (if IPV4_P) and IPv6 (if IPV6_P) to the
+ socket for the packet's receive queue in XSKMAP MAP_FD.  Everything
+ else is passed on.  IPv6 extension headers and VLAN tags are not
+ followed.  Returns the program's file descriptor, or -1 after
+ printing an error message.
+
+ The verifier rejects unreachable code, so the parts for the address
+ families are only included when needed.
+ */
+static int
+load_xdp_program (map_fd, port, ipv4_p, ipv6_p)
+     int map_fd;
+     unsigned port;
+     int ipv4_p;
+     int ipv6_p;
+{
+  /* R2 = data, R3 = data_end, check for an Ethernet header, R5 =
+     EtherType */
+  const struct bpf_insn head[] = {
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 0, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, 4, 0),
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+    INSN (BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN),
+    INSN (BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, L_PASS, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0),
+  };
+  const struct bpf_insn ipv4_jump[] = {
+    INSN (BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, L_IPV4, htons (ETH_P_IP)),
+  };
+  const struct bpf_insn ipv6_jump[] = {
+    INSN (BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, L_IPV6, htons (ETH_P_IPV6)),
+  };
+  const struct bpf_insn other[] = {
+    INSN (BPF_JMP | BPF_JA, 0, 0, L_PASS, 0),
+  };
+  /* IPv6: UDP, R5 = destination port */
+  const struct bpf_insn ipv6[] = {
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+    INSN (BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN + 40 + 8),
+    INSN (BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, L_PASS, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6, 0),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, L_PASS, IPPROTO_UDP),
+    INSN (BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2,
+	  ETH_HLEN + 40 + 2, 0),
+    INSN (BPF_JMP | BPF_JA, 0, 0, L_PORT, 0),
+  };
+  /* IPv4: UDP, not a fragment, R4 = UDP header, R5 = destination
+     port */
+  const struct bpf_insn ipv4[] = {
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+    INSN (BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN + 20),
+    INSN (BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, L_PASS, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 9, 0),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, L_PASS, IPPROTO_UDP),
+    INSN (BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6, 0),
+    INSN (BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons (0x3fff)),
+    INSN (BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, L_PASS, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN, 0),
+    INSN (BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0xf),
+    INSN (BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_5, 0, 0, 2),
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+    INSN (BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_4, BPF_REG_5, 0, 0),
+    INSN (BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HLEN),
+    INSN (BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_5, BPF_REG_4, 0, 0),
+    INSN (BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_5, 0, 0, 8),
+    INSN (BPF_JMP | BPF_JGT | BPF_X, BPF_REG_5, BPF_REG_3, L_PASS, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_4, 2, 0),
+  };
+  /* Check the port, redirect by receive queue */
+  const struct bpf_insn redirect[] = {
+    INSN (BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, L_PASS, htons (port)),
+    INSN (BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+    INSN (0, 0, 0, 0, 0),
+    INSN (BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+	  offsetof (struct xdp_md, rx_queue_index), 0),
+    INSN (BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+    INSN (BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+    INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+  const struct bpf_insn pass[] = {
+    INSN (BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+    INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+#define NELEMS(a) (sizeof (a) / sizeof (a)[0])
+  struct bpf_insn code[NELEMS (head) + NELEMS (ipv4_jump) + NELEMS (ipv6_jump)
+		       + NELEMS (other) + NELEMS (ipv6) + NELEMS (ipv4)
+		       + NELEMS (redirect) + NELEMS (pass)];
+  unsigned labels[NLABELS], n = 0, k;
+  union bpf_attr attr;
+  static char log[65536];
+  int fd;
+
+  emit (code, &n, head, NELEMS (head));
+  if (ipv4_p)
+    emit (code, &n, ipv4_jump, NELEMS (ipv4_jump));
+  if (ipv6_p)
+    emit (code, &n, ipv6_jump, NELEMS (ipv6_jump));
+  emit (code, &n, other, NELEMS (other));
+  if (ipv6_p)
+    {
+      labels[L_IPV6] = n;
+      emit (code, &n, ipv6, NELEMS (ipv6));
+    }
+  if (ipv4_p)
+    {
+      labels[L_IPV4] = n;
+      emit (code, &n, ipv4, NELEMS (ipv4));
+    }
+  labels[L_PORT] = n;
+  emit (code, &n, redirect, NELEMS (redirect));
+  labels[L_PASS] = n;
+  emit (code, &n, pass, NELEMS (pass));
+#undef NELEMS
+  for (k = 0; k < n; ++k)
+    if (BPF_CLASS (code[k].code) == BPF_JMP
+	&& BPF_OP (code[k].code) != BPF_CALL
+	&& BPF_OP (code[k].code) != BPF_EXIT)
+      code[k].off = labels[code[k].off] - (k + 1);
+
+  memset (&attr, 0, sizeof attr);
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uintptr_t) code;
+  attr.insn_cnt = n;
+  attr.license = (uintptr_t) "GPL";
+  if ((fd = sys_bpf (BPF_PROG_LOAD, &attr)) != -1)
+    return fd;
+  fprintf (stderr, "bpf(BPF_PROG_LOAD): %s\n", strerror (errno));
+  /* Load it again to get the verifier's complaint. */
+  attr.log_buf = (uintptr_t) log;
+  attr.log_size = sizeof log;
+  attr.log_level = 1;
+  log[0] = 0;
+  if (sys_bpf (BPF_PROG_LOAD, &attr) == -1 && log[0] != 0)
+    fprintf (stderr, "%s", log);
+  return -1;
+}
+
+/*
+ attach_xdp_program(prog_fd, ifindex, ifname)
+
+ Attach XDP program PROG_FD to interface IFINDEX, in native mode if
+ the driver supports it, and in generic mode otherwise.  The program
+ stays attached as long as the returned link file descriptor is
+ open.  Returns -1 after printing an error message on failure.
+ */
+static int
+attach_xdp_program (prog_fd, ifindex, ifname)
+     int prog_fd;
+     int ifindex;
+     const char *ifname;
+{
+  union bpf_attr attr;
+  int fd;
+
+  memset (&attr, 0, sizeof attr);
+  attr.link_create.prog_fd = prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+  if ((fd = sys_bpf (BPF_LINK_CREATE, &attr)) != -1)
+    return fd;
+  if (errno != EOPNOTSUPP && errno != EINVAL)
+    goto fail;
+  attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+  if ((fd = sys_bpf (BPF_LINK_CREATE, &attr)) != -1)
+    return fd;
+ fail:
+  fprintf (stderr, "Cannot attach XDP program to %s: %s\n",
+	   ifname, strerror (errno));
+  return -1;
+}
+
+/*
+ map_ring(x, ring, pgoff, off, entry_size)
+
+ Map RING of socket X, which has XSK_RING_SIZE entries of ENTRY_SIZE
+ bytes, into memory from PGOFF.  OFF gives its layout.
+ */
+static int
+map_ring (x, ring, pgoff, off, entry_size)
+     struct xsk *x;
+     struct xsk_ring *ring;
+     off_t pgoff;
+     const struct xdp_ring_offset *off;
+     size_t entry_size;
+{
+  unsigned char *map;
+
+  ring->size = XSK_RING_SIZE;
+  if ((map = mmap (0, off->desc + ring->size * entry_size,
+		   PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, x->fd, pgoff)) == MAP_FAILED)
+    {
+      fprintf (stderr, "mmap(AF_XDP ring): %s\n", strerror (errno));
+      return -1;
+    }
+  ring->producer = (uint32_t *) (map + off->producer);
+  ring->consumer = (uint32_t *) (map + off->consumer);
+  ring->descs = map + off->desc;
+  return 0;
+}
+
+static int
+set_ring_size (x, type, name)
+     struct xsk *x;
+     int type;
+     const char *name;
+{
+  int size = XSK_RING_SIZE;
+
+  if (setsockopt (x->fd, SOL_XDP, type, (char *) &size, sizeof size) == -1)
+    {
+      fprintf (stderr, "setsockopt(%s): %s\n", name, strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ make_xsk(ifname, ifindex, queue)
+
+ Create an AF_XDP socket with its UMEM for receive queue QUEUE of
+ interface IFNAME with index IFINDEX, and bind it.  Returns 0 after
+ printing an error message on failure.
+ */
+static struct xsk *
+make_xsk (ifname, ifindex, queue)
+     const char *ifname;
+     int ifindex;
+     unsigned queue;
+{
+  struct xsk *x;
+  struct ifreq ifr;
+  struct xdp_umem_reg reg;
+  struct xdp_mmap_offsets off;
+  struct sockaddr_xdp sxdp;
+  socklen_t optlen = sizeof off;
+  long page_size = sysconf (_SC_PAGESIZE);
+  unsigned k;
+  int s, result;
+
+  if ((x = calloc (1, sizeof (struct xsk))) == 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return 0;
+    }
+  x->ifindex = ifindex;
+  if ((x->fd = socket (AF_XDP, SOCK_RAW, 0)) == -1)
+    {
+      fprintf (stderr, "socket(AF_XDP): %s\n", strerror (errno));
+      free (x);
+      return 0;
+    }
+  /* AF_XDP sockets don't do interface ioctls. */
+  if ((s = socket (AF_INET, SOCK_DGRAM, 0)) == -1)
+    {
+      fprintf (stderr, "socket(): %s\n", strerror (errno));
+      goto fail;
+    }
+  memset (&ifr, 0, sizeof ifr);
+  strncpy (ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  if (ioctl (s, SIOCGIFHWADDR, &ifr) == -1
+      || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+    {
+      fprintf (stderr, "%s is not an Ethernet interface\n", ifname);
+      close (s);
+      goto fail;
+    }
+  memcpy (x->lladdr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+  if (ioctl (s, SIOCGIFMTU, &ifr) == -1)
+    {
+      fprintf (stderr, "ioctl(SIOCGIFMTU, %s): %s\n", ifname, strerror (errno));
+      close (s);
+      goto fail;
+    }
+  close (s);
+  x->mtu = ifr.ifr_mtu;
+
+  /* Frames must hold the kernel's headroom and a full-sized packet,
+     and cannot be larger than a page.  Larger datagrams are only
+     received with multi-buffer support, and are skipped. */
+  for (x->frame_size = 2048;
+       x->frame_size < XDP_PACKET_HEADROOM + ETH_HLEN + x->mtu
+	 && x->frame_size < page_size;
+       x->frame_size *= 2)
+    ;
+  if (x->mtu > x->frame_size - ETH_HLEN)
+    x->mtu = x->frame_size - ETH_HLEN;
+  x->nframes = XSK_FRAMES;
+  x->umem_size = (size_t) x->nframes * x->frame_size;
+  if ((x->umem = mmap (0, x->umem_size, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+      fprintf (stderr, "mmap(UMEM): %s\n", strerror (errno));
+      goto fail;
+    }
+  x->refs = calloc (x->nframes, sizeof (uint16_t));
+  x->free_frames = calloc (x->nframes, sizeof (uint32_t));
+  x->held = calloc (XSK_RING_SIZE, sizeof (uint32_t));
+  if (x->refs == 0 || x->free_frames == 0 || x->held == 0)
+    {
+      fprintf (stderr, "Out of memory\n");
+      goto fail;
+    }
+  for (k = 0; k < x->nframes; ++k)
+    x->free_frames[k] = x->nframes - 1 - k;
+  x->nfree = x->nframes;
+
+  memset (&reg, 0, sizeof reg);
+  reg.addr = (uintptr_t) x->umem;
+  reg.len = x->umem_size;
+  reg.chunk_size = x->frame_size;
+  if (setsockopt (x->fd, SOL_XDP, XDP_UMEM_REG, (char *) &reg, sizeof reg) == -1)
+    {
+      fprintf (stderr, "setsockopt(XDP_UMEM_REG): %s\n", strerror (errno));
+      goto fail;
+    }
+  if (set_ring_size (x, XDP_UMEM_FILL_RING, "XDP_UMEM_FILL_RING") != 0
+      || set_ring_size (x, XDP_UMEM_COMPLETION_RING,
+			"XDP_UMEM_COMPLETION_RING") != 0
+      || set_ring_size (x, XDP_RX_RING, "XDP_RX_RING") != 0
+      || set_ring_size (x, XDP_TX_RING, "XDP_TX_RING") != 0)
+    goto fail;
+  if (getsockopt (x->fd, SOL_XDP, XDP_MMAP_OFFSETS, (char *) &off, &optlen) == -1)
+    {
+      fprintf (stderr, "getsockopt(XDP_MMAP_OFFSETS): %s\n", strerror (errno));
+      goto fail;
+    }
+  if (map_ring (x, &x->fill, XDP_UMEM_PGOFF_FILL_RING,
+		&off.fr, sizeof (uint64_t)) != 0
+      || map_ring (x, &x->comp, XDP_UMEM_PGOFF_COMPLETION_RING,
+		   &off.cr, sizeof (uint64_t)) != 0
+      || map_ring (x, &x->rx, XDP_PGOFF_RX_RING,
+		   &off.rx, sizeof (struct xdp_desc)) != 0
+      || map_ring (x, &x->tx, XDP_PGOFF_TX_RING,
+		   &off.tx, sizeof (struct xdp_desc)) != 0)
+    goto fail;
+
+  memset (&sxdp, 0, sizeof sxdp);
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = ifindex;
+  sxdp.sxdp_queue_id = queue;
+  sxdp.sxdp_flags = XDP_USE_SG;
+  x->sg = 1;
+  if ((result = bind (x->fd, (struct sockaddr *) &sxdp, sizeof sxdp)) == -1
+      && (errno == EINVAL || errno == EOPNOTSUPP))
+    {
+      /* No multi-buffer support */
+      sxdp.sxdp_flags = 0;
+      x->sg = 0;
+      result = bind (x->fd, (struct sockaddr *) &sxdp, sizeof sxdp);
+    }
+  if (result == -1)
+    {
+      fprintf (stderr, "Cannot bind AF_XDP socket to queue %u of %s: %s\n",
+	       queue, ifname, strerror (errno));
+      goto fail;
+    }
+  return x;
+
+  /* The ring mappings go away with the process. */
+ fail:
+  close (x->fd);
+  if (x->umem != 0 && x->umem != MAP_FAILED)
+    munmap (x->umem, x->umem_size);
+  free (x->refs);
+  free (x->free_frames);
+  free (x->held);
+  free (x);
+  return 0;
+}
+
+/*
+ rx_queue_count(ifname)
+
+ Return the number of receive queues of interface IFNAME, as shown by
+ "ethtool -l", or 0 if the driver doesn't tell.
+ */
+static unsigned
+rx_queue_count (ifname)
+     const char *ifname;
+{
+#if defined (HAVE_LINUX_ETHTOOL_H) && defined (ETHTOOL_GCHANNELS)
+  struct ethtool_channels channels;
+  struct ifreq ifr;
+  int s, result;
+
+  if ((s = socket (AF_INET, SOCK_DGRAM, 0)) == -1)
+    return 0;
+  memset (&channels, 0, sizeof channels);
+  channels.cmd = ETHTOOL_GCHANNELS;
+  memset (&ifr, 0, sizeof ifr);
+  strncpy (ifr.ifr_name, ifname, IFNAMSIZ - 1);
+  ifr.ifr_data = (char *) &channels;
+  result = ioctl (s, SIOCETHTOOL, &ifr);
+  close (s);
+  if (result == -1)
+    return 0;
+  return channels.rx_count + channels.combined_count;
+#else
+  return 0;
+#endif
+}
+
+/*
+ open_xsks(ifname, port, ipv4_p, ipv6_p, xsks, n)
+
+ Create N AF_XDP sockets on interface IFNAME, one per receive queue
+ starting at queue 0, and store them in XSKS.  Then attach an XDP
+ program that redirects UDP datagrams to PORT to them, see
+ load_xdp_program().  Returns -1 after printing an error message on
+ failure, including when the interface has more than N receive
+ queues.
+ */
+int
+open_xsks (ifname, port, ipv4_p, ipv6_p, xsks, n)
+     const char *ifname;
+     unsigned port;
+     int ipv4_p;
+     int ipv6_p;
+     struct xsk **xsks;
+     unsigned n;
+{
+  union bpf_attr attr;
+  int ifindex, map_fd, prog_fd;
+  unsigned k, nqueues;
+
+  if ((ifindex = if_nametoindex (ifname)) == 0)
+    {
+      fprintf (stderr, "Unknown interface %s\n", ifname);
+      return -1;
+    }
+  if ((nqueues = rx_queue_count (ifname)) > n)
+    {
+      fprintf (stderr, "%s has %u receive queues, "
+	       "use -w %u or reduce them with ethtool -L\n",
+	       ifname, nqueues, nqueues);
+      return -1;
+    }
+  memset (&attr, 0, sizeof attr);
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof (uint32_t);
+  attr.value_size = sizeof (uint32_t);
+  attr.max_entries = n;
+  if ((map_fd = sys_bpf (BPF_MAP_CREATE, &attr)) == -1)
+    {
+      fprintf (stderr, "bpf(BPF_MAP_CREATE): %s\n", strerror (errno));
+      return -1;
+    }
+  for (k = 0; k < n; ++k)
+    {
+      uint32_t key = k, value;
+
+      if ((xsks[k] = make_xsk (ifname, ifindex, k)) == 0)
+	return -1;
+      value = xsks[k]->fd;
+      memset (&attr, 0, sizeof attr);
+      attr.map_fd = map_fd;
+      attr.key = (uintptr_t) &key;
+      attr.value = (uintptr_t) &value;
+      if (sys_bpf (BPF_MAP_UPDATE_ELEM, &attr) == -1)
+	{
+	  fprintf (stderr, "bpf(BPF_MAP_UPDATE_ELEM): %s\n", strerror (errno));
+	  return -1;
+	}
+    }
+  /* The program and link stay open for the life of the process. */
+  if ((prog_fd = load_xdp_program (map_fd, port, ipv4_p, ipv6_p)) == -1
+      || attach_xdp_program (prog_fd, ifindex, ifname) == -1)
+    return -1;
+  return 0;
+}
+
+int
+xsk_fd (x)
+     const struct xsk *x;
+{
+  return x->fd;
+}
+
+int
+xsk_ifindex (x)
+     const struct xsk *x;
+{
+  return x->ifindex;
+}
+
+/* Drop a reference to frame F of socket X. */
+static void
+unref_frame (x, f)
+     struct xsk *x;
+     uint32_t f;
+{
+  if (--x->refs[f] == 0)
+    x->free_frames[x->nfree++] = f;
+}
+
+/* Release the frames of the datagrams that the kernel has sent. */
+static void
+reap_completions (x)
+     struct xsk *x;
+{
+  uint64_t *addrs = x->comp.descs;
+  uint32_t cons = *x->comp.consumer;
+  uint32_t prod = __atomic_load_n (x->comp.producer, __ATOMIC_ACQUIRE);
+
+  for (; cons != prod; ++cons)
+    unref_frame (x, addrs[cons & (x->comp.size - 1)] / x->frame_size);
+  __atomic_store_n (x->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/* Give free frames to the kernel for receiving. */
+static void
+refill (x)
+     struct xsk *x;
+{
+  uint64_t *addrs = x->fill.descs;
+  uint32_t prod = *x->fill.producer;
+  uint32_t room = x->fill.size
+    - (prod - __atomic_load_n (x->fill.consumer, __ATOMIC_ACQUIRE));
+
+  for (; room > 0 && x->nfree > 0; --room, ++prod)
+    addrs[prod & (x->fill.size - 1)]
+      = (uint64_t) x->free_frames[--x->nfree] * x->frame_size;
+  __atomic_store_n (x->fill.producer, prod, __ATOMIC_RELEASE);
+}
+
+/* Add the kernel's count of packets dropped on socket X since the
+   last call to X->drops. */
+static void
+collect_drops (x)
+     struct xsk *x;
+{
+  struct xdp_statistics st;
+  socklen_t len = sizeof st;
+
+  if (getsockopt (x->fd, SOL_XDP, XDP_STATISTICS, (char *) &st, &len) == 0)
+    {
+      x->drops += (st.rx_dropped - x->stats_seen.rx_dropped)
+	+ (st.rx_ring_full - x->stats_seen.rx_ring_full);
+      x->stats_seen = st;
+    }
+}
+
+/*
+ xsk_receive(x, pdus, max)
+
+ Store up to MAX datagrams received on socket X in PDUS, and return
+ their number, which is zero if there are none.  The PDUs point into
+ the UMEM, and stay valid until the next call.
+ */
+unsigned
+xsk_receive (x, pdus, max)
+     struct xsk *x;
+     struct pdu *pdus;
+     unsigned max;
+{
+  struct xdp_desc *descs = x->rx.descs;
+  uint32_t cons, prod;
+  unsigned k, n = 0;
+  unsigned type;
+
+  for (k = 0; k < x->nheld; ++k)
+    unref_frame (x, x->held[k]);
+  x->nheld = 0;
+  reap_completions (x);
+  refill (x);
+  if (++x->calls >= XSK_STATS_INTERVAL)
+    {
+      collect_drops (x);
+      x->calls = 0;
+    }
+
+  cons = *x->rx.consumer;
+  prod = __atomic_load_n (x->rx.producer, __ATOMIC_ACQUIRE);
+  for (; cons != prod && n < max; ++cons)
+    {
+      struct xdp_desc *d = &descs[cons & (x->rx.size - 1)];
+      uint32_t f = d->addr / x->frame_size;
+      unsigned char *frame = x->umem + d->addr;
+
+      x->refs[f] = 1;
+      if (x->skipping || (d->options & XDP_PKT_CONTD))
+	{
+	  x->skipping = (d->options & XDP_PKT_CONTD) != 0;
+	  unref_frame (x, f);
+	  continue;
+	}
+      type = frame[12] << 8 | frame[13];
+      if (d->len <= ETH_HLEN
+	  || (type != ETH_P_IP && type != ETH_P_IPV6)
+	  || rx_parse_datagram (frame + ETH_HLEN, d->len - ETH_HLEN,
+				&pdus[n]) != 0)
+	{
+	  unref_frame (x, f);
+	  continue;
+	}
+      x->held[x->nheld++] = f;
+      ++n;
+    }
+  __atomic_store_n (x->rx.consumer, cons, __ATOMIC_RELEASE);
+  return n;
+}
+
+/*
+ xsk_drops(x)
+
+ Return the number of packets that the kernel had to drop on socket
+ X since the last call.  The count is updated every
+ XSK_STATS_INTERVAL calls of xsk_receive().
+ */
+unsigned long
+xsk_drops (x)
+     struct xsk *x;
+{
+  unsigned long drops = x->drops;
+
+  x->drops = 0;
+  return drops;
+}
+
+/* Free entries in the transmit ring of X. */
+static uint32_t
+tx_room (x)
+     struct xsk *x;
+{
+  return x->tx.size
+    - (*x->tx.producer - __atomic_load_n (x->tx.consumer, __ATOMIC_ACQUIRE));
+}
+
+/*
+ kick_xsk(x)
+
+ Tell the kernel to send the frames in the transmit ring of X.  In
+ copy mode, the kernel only sends a limited number of frames per
+ call, so this is repeated while it makes progress.
+ */
+static void
+kick_xsk (x)
+     struct xsk *x;
+{
+  while (1)
+    {
+      uint32_t cons = __atomic_load_n (x->tx.consumer, __ATOMIC_ACQUIRE);
+
+      if (cons == *x->tx.producer)
+	return;
+      if (sendto (x->fd, 0, 0, MSG_DONTWAIT, 0, 0) == -1
+	  && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+	return;
+      if (__atomic_load_n (x->tx.consumer, __ATOMIC_ACQUIRE) == cons)
+	return;			/* try again on the next flush */
+    }
+}
+
+/*
+ xsk_send(x, lladdr, t, msg, msglen, payload_sum, saddr, flags)
+
+ Put a frame to link-layer address LLADDR into the transmit ring of
+ socket X, containing the datagram that raw_send_with_template()
+ would send with the same arguments.  If MSG is in the UMEM, and the
+ kernel supports it, the frame only contains the headers, and is
+ chained to MSG.  The frame is only sent on the next flush_xsk().
+ Returns 0 on success.  Returns -1 with errno set to EAGAIN if the
+ ring is full or there is no free frame, or to EMSGSIZE if the
+ datagram is too large.
+ */
+int
+xsk_send (x, lladdr, t, msg, msglen, payload_sum, saddr, flags)
+     struct xsk *x;
+     const unsigned char *lladdr;
+     const struct raw_send_template *t;
+     const void *msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr;
+     int flags;
+{
+  struct xdp_desc *descs = x->tx.descs;
+  const unsigned char *p = msg;
+  int chain_p = x->sg && msglen > 0
+    && p >= x->umem && p < x->umem + x->umem_size;
+  uint32_t prod, f;
+  unsigned char *frame;
+  uint16_t type;
+  int n;
+
+  if (tx_room (x) < (chain_p ? 2 : 1) || x->nfree == 0)
+    {
+      kick_xsk (x);
+      reap_completions (x);
+      if (tx_room (x) < (chain_p ? 2 : 1) || x->nfree == 0)
+	{
+	  errno = EAGAIN;
+	  return -1;
+	}
+    }
+  f = x->free_frames[--x->nfree];
+  frame = x->umem + (size_t) f * x->frame_size;
+  if (chain_p)
+    n = raw_build_headers (frame + ETH_HLEN, x->mtu, t, msg, msglen,
+			   payload_sum, saddr, flags);
+  else
+    n = raw_build_datagram (frame + ETH_HLEN, x->mtu, t, msg, msglen,
+			    payload_sum, saddr, flags);
+  if (n == -1)
+    {
+      x->free_frames[x->nfree++] = f;
+      return -1;
+    }
+  type = htons ((frame[ETH_HLEN] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP);
+  memcpy (frame, lladdr, ETH_ALEN);
+  memcpy (frame + ETH_ALEN, x->lladdr, ETH_ALEN);
+  memcpy (frame + 2 * ETH_ALEN, &type, sizeof type);
+  x->refs[f] = 1;
+
+  prod = *x->tx.producer;
+  descs[prod & (x->tx.size - 1)].addr = (uint64_t) f * x->frame_size;
+  descs[prod & (x->tx.size - 1)].len = ETH_HLEN + n;
+  descs[prod & (x->tx.size - 1)].options = chain_p ? XDP_PKT_CONTD : 0;
+  ++prod;
+  if (chain_p)
+    {
+      descs[prod & (x->tx.size - 1)].addr = p - x->umem;
+      descs[prod & (x->tx.size - 1)].len = msglen;
+      descs[prod & (x->tx.size - 1)].options = 0;
+      ++prod;
+      ++x->refs[(p - x->umem) / x->frame_size];
+    }
+  __atomic_store_n (x->tx.producer, prod, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ flush_xsk(x)
+
+ Tell the kernel to send the frames that have been put into the
+ transmit ring of socket X.
+ */
+void
+flush_xsk (x)
+     struct xsk *x;
+{
+  kick_xsk (x);
+}
+
+#else /* not (HAVE_LINUX_IF_XDP_H && HAVE_LINUX_BPF_H && HAVE_DECL_BPF_XDP) */
+
+int
+open_xsks (ifname, port, ipv4_p, ipv6_p, xsks, n)
+     const char *ifname;
+     unsigned port;
+     int ipv4_p;
+     int ipv6_p;
+     struct xsk **xsks;
+     unsigned n;
+{
+  fprintf (stderr, "AF_XDP (-X) is not supported on this system\n");
+  return -1;
+}
+
+int
+xsk_fd (x)
+     const struct xsk *x;
+{
+  return -1;
+}
+
+int
+xsk_ifindex (x)
+     const struct xsk *x;
+{
+  return 0;
+}
+
+unsigned
+xsk_receive (x, pdus, max)
+     struct xsk *x;
+     struct pdu *pdus;
+     unsigned max;
+{
+  return 0;
+}
+
+unsigned long
+xsk_drops (x)
+     struct xsk *x;
+{
+  return 0;
+}
+
+int
+xsk_send (x, lladdr, t, msg, msglen, payload_sum, saddr, flags)
+     struct xsk *x;
+     const unsigned char *lladdr;
+     const struct raw_send_template *t;
+     const void *msg;
+     size_t msglen;
+     uint32_t payload_sum;
+     const struct sockaddr *saddr;
+     int flags;
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+flush_xsk (x)
+     struct xsk *x;
+{
+}
+
+#endif /* not (HAVE_LINUX_IF_XDP_H && HAVE_LINUX_BPF_H && HAVE_DECL_BPF_XDP) */
@@ -0,0 +1,22 @@
+/*
+ xsk.h
+
+ Date Created: Mon Oct 19 09:12:48 2026
+ */
+
+struct xsk;
+struct raw_send_template;
+
+extern int open_xsks (const char *, unsigned, int, int,
+		      struct xsk **, unsigned);
+extern int xsk_fd (const struct xsk *);
+extern int xsk_ifindex (const struct xsk *);
+extern unsigned xsk_receive (struct xsk *, struct pdu *, unsigned);
+extern unsigned long xsk_drops (struct xsk *);
+extern int xsk_send (struct xsk *, const unsigned char *,
+		     const struct raw_send_template *,
+		     const void *, size_t,
+		     uint32_t,
+		     const struct sockaddr *,
+		     int);
+extern void flush_xsk (struct xsk *);